@@ -0,0 +1,154 @@
+/********************************************************************
+ * alloc_test.cpp: Checks that the steady-state control cycle does no
+ *                 heap allocations, including its log output.
+ * (C) 2015, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "error.h"
+
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <cstdio>
+#include <atomic>
+#include <memory>
+#include <thread>
+
+#include "thinkfan.h"
+#include "config.h"
+#include "poller.h"
+#include "message.h"
+#include "fixture.h"
+
+
+/* While slow_ino is set, every read of that file takes SLOW_READ, which is
+ * longer than the sensor timeout. This replaces the libc pread() for the
+ * whole program, so the drivers are tested as they are. */
+static std::atomic<ino_t> slow_ino(0);
+static const std::chrono::milliseconds SLOW_READ(60);
+
+extern "C" ssize_t pread(int fd, void *buf, size_t count, off_t offset)
+{
+	ino_t ino = slow_ino.load();
+	struct stat st;
+	if (ino && ::fstat(fd, &st) == 0 && st.st_ino == ino)
+		std::this_thread::sleep_for(SLOW_READ);
+	return ::syscall(SYS_pread64, fd, buf, count, offset);
+}
+
+// Where pread() is fortified, the drivers end up here instead
+extern "C" ssize_t __pread_chk(int fd, void *buf, size_t count, off_t offset, size_t)
+{ return pread(fd, buf, count, offset); }
+
+
+namespace thinkfan {
+
+static const unsigned int NUM_HWMON = 2;
+static const unsigned int NUM_LEVELS = 8;
+
+// Enough for the temperatures to go through all levels twice
+static const unsigned int NUM_CYCLES = 200;
+static const unsigned int TEMP_PERIOD = 5;
+static const int TEMP_INCREMENT = 3;
+
+// With worker threads, the second hwmon sensor is slow for these cycles
+static const unsigned int SLOW_FROM = 40;
+static const unsigned int SLOW_UNTIL = 45;
+
+
+/* One control loop from init_control() to NUM_CYCLES cycles later, with the
+ * temperatures going up & down through all levels. With worker threads, one
+ * sensor also goes stale and recovers, so every message the steady state can
+ * log is logged at least once at the default verbosity. Returns the number of
+ * heap allocations done by the cycles. */
+static unsigned long long test_loop(const string &base_dir, LogLevel lvl, unsigned int threads)
+{
+	Fixture fixture(base_dir + "/alloc-test-" + std::to_string(lvl) + "-" + std::to_string(threads),
+			NUM_HWMON);
+	std::unique_ptr<Config> config(Config::read_config(fixture.write_config(NUM_LEVELS, false)));
+
+	struct stat st;
+	if (::stat(fixture.hwmon_path(1).c_str(), &st))
+		throw IOerror("stat(" + fixture.hwmon_path(1) + "): ", errno);
+
+	Logger::instance().set_log_lvl(lvl);
+	num_threads = threads;
+	temp_state = TemperatureState(*config);
+	SensorPoller poller(config->sensors(), num_threads);
+	init_control(*config, poller);
+
+	const int span = BASE_TEMP + int(NUM_LEVELS) * LEVEL_STEP + 5 - MIN_TEMP;
+	unsigned int updates = 0;
+	unsigned long long allocs = num_allocs.load();
+	for (unsigned int i = 0; i < NUM_CYCLES; ++i) {
+		if (i % TEMP_PERIOD == 0) {
+			int x = (updates++ * TEMP_INCREMENT) % (2 * span);
+			fixture.set_temp(MIN_TEMP + (x < span ? x : 2 * span - x));
+		}
+		if (threads > 0)
+			slow_ino.store(i >= SLOW_FROM && i < SLOW_UNTIL ? st.st_ino : 0);
+		control_cycle(*config, poller, true);
+	}
+	allocs = num_allocs.load() - allocs;
+
+	// Let the writer catch up, so the output is in order
+	Logger::instance().stop_writer();
+	Logger::instance().start_writer();
+
+	printf("%s, %u thread(s): %llu heap allocation(s) in %u cycles\n",
+			lvl == DEFAULT_LOG_LVL ? "Default verbosity" : "-v", threads, allocs, NUM_CYCLES);
+	return allocs;
+}
+
+
+}
+
+
+int main()
+{
+	using namespace thinkfan;
+
+	string base_dir = ::access("/dev/shm", W_OK) == 0 ? "/dev/shm" : "/tmp";
+	sensor_timeout = secondsf(0.02);
+
+	LogLevel verbose = DEFAULT_LOG_LVL;
+	++verbose;
+
+	// Log output is handed to a writer thread, just like in the daemon
+	Logger::instance().start_writer();
+
+	unsigned long long allocs = 0;
+	try {
+		for (LogLevel lvl : { LogLevel(DEFAULT_LOG_LVL), verbose })
+			for (unsigned int threads : { 0, 2 })
+				allocs += test_loop(base_dir, lvl, threads);
+	}
+	catch (ExpectedError &e) {
+		fprintf(stderr, "ERROR: %s\n", e.what());
+		return 1;
+	}
+
+	if (allocs) {
+		fprintf(stderr, "ERROR: The control cycle did %llu heap allocation(s).\n", allocs);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,303 @@
+/********************************************************************
+ * bench.cpp: Benchmark of the control loop & config parser against
+ *            fake sysfs/procfs files.
+ * (C) 2015, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "error.h"
+
+#include <getopt.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+
+#include "thinkfan.h"
+#include "config.h"
+#include "parser.h"
+#include "poller.h"
+#include "message.h"
+#include "image.h"
+#include "fixture.h"
+
+
+namespace thinkfan {
+
+typedef std::chrono::steady_clock clock;
+
+// The temperatures change every TEMP_PERIOD cycles
+static const unsigned int TEMP_PERIOD = 10;
+static const int TEMP_INCREMENT = 3;
+
+
+/* Number of read() & write() syscalls done by this process so far, or -1 if
+ * the kernel doesn't have task IO accounting. Includes all threads. */
+static long long count_syscalls()
+{
+	std::ifstream io("/proc/self/io");
+	string key;
+	long long value, rv = 0;
+	unsigned int found = 0;
+	while (io >> key >> value) {
+		if (key == "syscr:" || key == "syscw:") {
+			rv += value;
+			++found;
+		}
+	}
+	return found == 2 ? rv : -1;
+}
+
+
+static double usecs(clock::duration d)
+{ return std::chrono::duration_cast<std::chrono::duration<double, std::micro>>(d).count(); }
+
+
+/* Returns the number of heap allocations done by the measured cycles, which
+ * must be 0: After init_control(), a cycle may only reuse what it has. */
+static unsigned long long bench_loop(const string &base_dir, unsigned int num_hwmon,
+		unsigned int num_levels, bool complex, unsigned int num_cycles)
+{
+	Fixture fixture(base_dir + "/bench-" + std::to_string(num_hwmon) + "-" + std::to_string(num_levels)
+			+ (complex ? "-complex" : "-simple"), num_hwmon);
+	string conf_path = fixture.write_config(num_levels, complex);
+
+	clock::time_point start = clock::now();
+	std::unique_ptr<Config> config(Config::read_config(conf_path));
+	clock::duration parse_time = clock::now() - start;
+
+	// The same config once more, from its image
+	const string image_path = ConfigImage::path(conf_path);
+	ConfigImage::compile(conf_path);
+	start = clock::now();
+	std::unique_ptr<Config> image_config(Config::read_config(conf_path));
+	clock::duration image_time = clock::now() - start;
+	image_config.reset();
+	::unlink(image_path.c_str());
+
+	{
+		temp_state = TemperatureState(*config);
+		SensorPoller poller(config->sensors(), num_threads);
+		init_control(*config, poller);
+
+		// The temperature ramps up and down through all levels
+		const int span = BASE_TEMP + int(num_levels) * LEVEL_STEP + 5 - MIN_TEMP;
+		std::vector<clock::duration> times;
+		times.reserve(num_cycles);
+		unsigned int updates = 0;
+		unsigned long long allocs = 0;
+
+		long long syscalls = count_syscalls();
+		for (unsigned int i = 0; i < num_cycles; ++i) {
+			if (i % TEMP_PERIOD == 0) {
+				int x = (updates++ * TEMP_INCREMENT) % (2 * span);
+				fixture.set_temp(MIN_TEMP + (x < span ? x : 2 * span - x));
+			}
+			unsigned long long allocs_before = num_allocs.load(std::memory_order_relaxed);
+			clock::time_point t0 = clock::now();
+			control_cycle(*config, poller, true);
+			times.push_back(clock::now() - t0);
+			allocs += num_allocs.load(std::memory_order_relaxed) - allocs_before;
+		}
+		if (syscalls >= 0)
+			syscalls = count_syscalls() - syscalls - updates * fixture.writes_per_update();
+
+		clock::duration total = clock::duration::zero();
+		for (clock::duration d : times)
+			total += d;
+		std::sort(times.begin(), times.end());
+
+		char syscall_str[16];
+		if (syscalls >= 0)
+			snprintf(syscall_str, sizeof(syscall_str), "%.1f", double(syscalls) / num_cycles);
+		else
+			snprintf(syscall_str, sizeof(syscall_str), "n/a");
+
+		printf("%7u %6u %-7s %10.0f %9.1f %9.1f %9s %9.2f %10.2f %7llu\n",
+				num_hwmon, num_levels, complex ? "complex" : "simple",
+				num_cycles / (usecs(total) / 1e6),
+				usecs(times[times.size() / 2]),
+				usecs(times[times.size() * 99 / 100]),
+				syscall_str, usecs(parse_time) / 1000, usecs(image_time) / 1000, allocs);
+		return allocs;
+	}
+}
+
+
+/* Parse time of the example configs, with their /proc/acpi/ibm paths pointed
+ * at a fixture. Only the parser runs (which includes opening the drivers),
+ * not the consistency checks in Config::read_config(). */
+static void bench_example(const string &base_dir, const string &example, unsigned int repeat)
+{
+	Fixture fixture(base_dir + "/bench-example", 0);
+
+	std::ifstream f(example);
+	std::stringstream buf;
+	buf << f.rdbuf();
+	if (!f.good()) {
+		printf("%-40s  can't read\n", example.c_str());
+		return;
+	}
+
+	string text = buf.str();
+	const string proc_path("/proc/acpi/ibm");
+	for (size_t pos = text.find(proc_path); pos != string::npos; pos = text.find(proc_path, pos + 1)) {
+		text.replace(pos, proc_path.length(), fixture.tp_dir());
+		pos += fixture.tp_dir().length();
+	}
+
+	static const ConfigParser parser;
+	clock::duration total = clock::duration::zero();
+	for (unsigned int i = 0; i < repeat; ++i) {
+		fixture.reset_tp_fan();
+		const char *input = text.c_str();
+		clock::time_point start = clock::now();
+		std::unique_ptr<Config> config;
+		try {
+			config = parser.parse_config(input);
+		} catch (ExpectedError &e) {
+			printf("%-40s  failed: %s\n", example.c_str(), e.what());
+			return;
+		}
+		total += clock::now() - start;
+		if (!config) {
+			printf("%-40s  syntax error at offset %zu\n", example.c_str(), size_t(input - text.c_str()));
+			return;
+		}
+	}
+	printf("%-40s %9.1f us\n", example.c_str(), usecs(total) / repeat);
+}
+
+
+}
+
+
+#ifdef USE_IO_URING
+#define BENCH_OPTSTRING "hn:j:d:u"
+#define BENCH_URING_HELP "\n -u  Batch sensor reads with io_uring (see thinkfan --io-uring)"
+#else
+#define BENCH_OPTSTRING "hn:j:d:"
+#define BENCH_URING_HELP ""
+#endif
+
+#define BENCH_USAGE \
+ "Usage: thinkfan-bench [-hu] [-n CYCLES] [-j THREADS] [-d DIR] [EXAMPLE...]" \
+ "\n -h  This help message" \
+ "\n -n  Number of control cycles per scenario. Default: 2000" \
+ "\n -j  Read sensors in parallel using THREADS worker threads (see thinkfan -j)" \
+ BENCH_URING_HELP \
+ "\n -d  Directory for the fake sysfs/procfs files. Default: /dev/shm, or /tmp" \
+ "\n     if that doesn't exist." \
+ "\n EXAMPLE...  Config files to measure the parse time of. Default: the" \
+ "\n     example configs from the source tree." \
+ "\n Exits with status 2 if the control cycle did any heap allocations.\n"
+
+
+int main(int argc, char **argv)
+{
+	using namespace thinkfan;
+
+	unsigned int num_cycles = 2000;
+	string base_dir = ::access("/dev/shm", W_OK) == 0 ? "/dev/shm" : "/tmp";
+
+	int opt;
+	while ((opt = getopt(argc, argv, BENCH_OPTSTRING)) != -1) {
+		switch (opt) {
+		case 'n':
+			num_cycles = std::max(1ul, std::strtoul(optarg, nullptr, 10));
+			break;
+		case 'j':
+			num_threads = std::strtoul(optarg, nullptr, 10);
+			break;
+		case 'd':
+			base_dir = optarg;
+			break;
+#ifdef USE_IO_URING
+		case 'u':
+			uring_reads = true;
+			break;
+#endif
+		case 'h':
+			fputs(BENCH_USAGE, stdout);
+			return 0;
+		default:
+			fputs(BENCH_USAGE, stderr);
+			return 3;
+		}
+	}
+
+	std::vector<string> examples(argv + optind, argv + argc);
+	if (examples.empty()) {
+		examples.push_back(EXAMPLES_DIR "/thinkfan.conf.simple");
+		examples.push_back(EXAMPLES_DIR "/thinkfan.conf.complex");
+	}
+
+	// Only errors, since a level change with logging would be a different benchmark
+	Logger::instance().set_log_lvl(TF_ERR);
+
+	// 1000 hwmon sensors keep 1000 files open
+	struct rlimit nofile;
+	if (::getrlimit(RLIMIT_NOFILE, &nofile) == 0) {
+		nofile.rlim_cur = nofile.rlim_max;
+		::setrlimit(RLIMIT_NOFILE, &nofile);
+	}
+
+	unsigned long long allocs = 0;
+	try {
+		printf("Control loop: %u cycles per scenario, %u thread(s), %u tp_thermal temperatures"
+				" + N hwmon sensors\n\n", num_cycles, num_threads, TP_TEMPS);
+		printf("%7s %6s %-7s %10s %9s %9s %9s %9s %10s %7s\n",
+				"N", "levels", "mode", "cycles/s", "p50 (us)", "p99 (us)", "syscalls", "load (ms)",
+				"image (ms)", "allocs");
+
+		for (unsigned int num_hwmon : { 1, 10, 100, 1000 })
+			for (unsigned int num_levels : { 8, 64, 256 })
+				for (bool complex : { false, true })
+					allocs += bench_loop(base_dir, num_hwmon, num_levels, complex, num_cycles);
+		printf("\nsyscalls: read() & write() calls per cycle. load: Config::read_config().\n"
+				"image: The same with a config image (see --compile-config).\n"
+				"allocs: Heap allocations in all cycles of a scenario. Anything but 0 is an error.\n");
+#ifdef USE_IO_URING
+		if (uring_reads && num_threads == 0)
+			printf("Sensor reads that are batched through io_uring don't count as read() calls.\n");
+#endif
+
+		printf("\nConfig parser:\n\n");
+		for (const string &example : examples)
+			bench_example(base_dir, example, 1000);
+	}
+	catch (ExpectedError &e) {
+		fprintf(stderr, "ERROR: %s\n", e.what());
+		return 1;
+	}
+
+	if (allocs) {
+		fprintf(stderr, "ERROR: The control cycle did %llu heap allocation(s).\n", allocs);
+		return 2;
+	}
+
+	return 0;
+}
@@ -23,23 +23,58 @@
 #include <fstream>
 #include <limits>
 #include <cstring>
+#include <algorithm>
+#include <exception>
+#include <system_error>
+#include <thread>
 #include "parser.h"
+#include "image.h"
+#include "hwmon.h"
+#include "udp.h"
 #include "message.h"
 #include "thinkfan.h"
 
 
 namespace thinkfan {
 
-Config::Config() : num_temps_(0), fan_(nullptr) {}
+Config::Config(Config *lender, bool offline)
+: offline_(offline),
+  num_temps_(0),
+  lender_(lender),
+  init_time_(0)
+{}
+
+
+Config *Config::read_config(const string &filename, Config *lender, bool init)
+{
+	// A compiled image skips the parser, but not the checks on the whole config
+	unique_ptr<Config> rv(ConfigImage::load(filename, lender));
+	if (rv)
+		rv->check();
+	else
+		rv.reset(parse(filename, lender));
+
+	// Before the hand-over, so a driver that fails doesn't cost the running
+	// config the drivers it has lent out.
+	if (init)
+		rv->init_drivers();
+	rv->adopt_borrowed();
+	return rv.release();
+}
 
 
-const Config *Config::read_config(const string &filename)
+Config *Config::read_offline(const string &filename)
+{ return parse(filename, nullptr, true); }
+
+
+Config *Config::parse(const string &filename, Config *lender, bool offline)
 {
-	Config *rv = nullptr;
+	// The grammar is stateless, so it's only built once
+	static const ConfigParser parser;
+
+	unique_ptr<Config> rv;
 	ifstream f_in(filename);
 	try {
-		ConfigParser parser;
-
 		f_in.exceptions(f_in.badbit | f_in.failbit);
 		f_in.seekg(0, f_in.end);
 		ifstream::pos_type f_size = f_in.tellg();
@@ -51,35 +86,24 @@ const Config *Config::read_config(const string &filename)
 		const char *input = f_data.c_str();
 		const char *start = input;
 
-		rv = parser.parse_config(input);
+		rv = parser.parse_config(input, lender, offline);
 		if (!rv) {
-			throw SyntaxError(filename, parser.get_max_addr() - start, f_data);
+			throw SyntaxError(filename, input - start, f_data);
 		}
 		else {
-			// Consistency checks which require the complete config
-
-			if (rv->levels().size() == 0)
-				throw ConfigError("No fan levels specified.");
-
-			if (!rv->fan()) {
+			// Only levels, but no fan
+			if (rv->fans().size() && rv->fan_specs_.empty()) {
 				log(TF_WRN) << MSG_CONF_DEFAULT_FAN << flush;
-				rv->add_fan(unique_ptr<TpFanDriver>(new TpFanDriver(DEFAULT_FAN)));
+				rv->add_fan(FanSpec(FanSpec::TPACPI, DEFAULT_FAN));
 			}
 
 			if (rv->sensors().size() < 1) {
 				log(TF_WRN) << MSG_SENSOR_DEFAULT << flush;
-				rv->add_sensor(unique_ptr<TpSensorDriver>(new TpSensorDriver(DEFAULT_SENSOR)));
+				rv->add_sensor(SensorSpec(SensorSpec::TPACPI, DEFAULT_SENSOR));
 			}
 
-			int maxlvl = (*rv->levels_.rbegin())->num();
-			if (dynamic_cast<HwmonFanDriver *>(rv->fan()) && maxlvl < 128)
-				error<ConfigError>(MSG_CONF_MAXLVL((*rv->levels_.rbegin())->num()));
-			else if (dynamic_cast<TpFanDriver *>(rv->fan())
-					&& maxlvl != std::numeric_limits<int>::max()
-					&& maxlvl > 7)
-				error<ConfigError>(MSG_CONF_TP_LVL7(maxlvl, 7));
-
-			return rv;
+			rv->check();
+			return rv.release();
 		}
 	} catch (std::ios_base::failure &e) {
 		string msg = std::strerror(errno);
@@ -88,39 +112,648 @@ const Config *Config::read_config(const string &filename)
 }
 
 
+/* Consistency checks which require the complete config. Also compiles the
+ * level tables, which is all that's left to do after that. */
+void Config::check()
+{
+	// An exporting node may just be there to send its temperatures
+	if (fans_.size() == 0 && export_address.empty())
+		throw ConfigError("No fan levels specified.");
+
+	check_groups();
+
+	// By the specs, since an offline config has no fan drivers
+	for (size_t i = 0; i < fans_.size(); ++i) {
+		FanConfig *fan_cfg = fans_[i];
+		const FanSpec &spec = fan_specs_[i];
+		if (fan_cfg->levels().size() == 0)
+			throw ConfigError(MSG_CONF_FAN_NOLEVELS(spec.path));
+		if (groups_.size() && dynamic_cast<const SimpleLevel *>(fan_cfg->levels().front()))
+			log(TF_WRN) << MSG_CONF_GROUPS_SIMPLE(spec.path) << flush;
+
+		fan_cfg->compile(num_columns());
+
+		int maxlvl = fan_cfg->levels().back()->num();
+		if (spec.type == FanSpec::HWMON && maxlvl < 128)
+			error<ConfigError>(MSG_CONF_MAXLVL(maxlvl));
+		else if (spec.type == FanSpec::TPACPI
+				&& maxlvl != std::numeric_limits<int>::max()
+				&& maxlvl > 7)
+			error<ConfigError>(MSG_CONF_TP_LVL7(maxlvl, 7));
+	}
+}
+
+
 Config::~Config()
 {
-	delete fan_;
-	for (const SensorDriver *sensor : sensors_) delete sensor;
-	for (const Level *level : levels_) delete level;
+	for (FanConfig *fan_cfg : fans_) {
+		if (borrowed(fan_cfg->fan()))
+			fan_cfg->release_fan();
+		delete fan_cfg;
+	}
+	for (const SensorDriver *sensor : sensors_)
+		if (sensor && !borrowed(sensor) && !sensor->stuck())
+			delete sensor;
+	for (LoadDriver *load : loads_)
+		delete load;
 }
 
 
-bool Config::add_fan(std::unique_ptr<FanDriver> &&fan)
+bool Config::add_fan(const FanSpec &spec)
 {
-	if (!fan) return false;
+	if (spec.type == FanSpec::HWMON && HwmonIndex::is_name(spec.path) && !offline_) {
+		FanSpec resolved(spec);
+		resolved.path = HwmonIndex::get().resolve(spec.path, HwmonIndex::PWM);
+		add_fan(resolved);
+		// hwmon numbers may change with every boot, so an image keeps the name
+		fan_specs_.back() = spec;
+		return true;
+	}
 
-	if (fan_)
-		error<ConfigError>(MSG_CONF_FAN);
-	this->fan_ = fan.release();
+	for (const FanConfig *fan_cfg : fans_)
+		if (fan_cfg->fan() && fan_cfg->fan()->path() == spec.path)
+			error<ConfigError>(MSG_CONF_FAN(spec.path));
+	const bool first = fan_specs_.empty();
+	fan_specs_.push_back(spec);
+
+	unique_ptr<FanDriver> fan;
+	bool initialized = false;
+	if (!offline_) {
+		// A borrowed fan is already running, so it must not be initialized again
+		fan.reset(borrow_fan(spec));
+		initialized = static_cast<bool>(fan);
+		if (!fan) {
+			clock::time_point start = clock::now();
+			fan = spec.make();
+			timed("fan", fan->path(), start);
+		}
+	}
+
+	// Levels that were specified before the first fan belong to that fan
+	if (first && fans_.size() == 1)
+		fans_.front()->set_fan(std::move(fan), initialized);
+	else
+		fans_.push_back(new FanConfig(std::move(fan), initialized));
+
+	if (spec.continuous) {
+		// Not just a sanity check: The interpolator needs an HwmonFanDriver
+		if (spec.type != FanSpec::HWMON)
+			throw ConfigError(MSG_CONF_CONTINUOUS_PWM(spec.path));
+		fans_.back()->set_continuous(spec.ramp);
+	}
 	return true;
 }
 
 
-bool Config::add_sensor(std::unique_ptr<const SensorDriver> &&sensor)
+bool Config::add_sensor(const SensorSpec &spec)
 {
-	if (!sensor) return false;
+	if (spec.type == SensorSpec::HWMON && HwmonIndex::is_name(spec.path) && !offline_) {
+		SensorSpec resolved(spec);
+		resolved.path = HwmonIndex::get().resolve(spec.path, HwmonIndex::TEMP);
+		add_sensor(resolved);
+		sensor_specs_.back() = spec;	// Like in add_fan()
+		return true;
+	}
+
+	int group = -1;
+	if (spec.group.length()) {
+		std::vector<SensorGroup>::const_iterator it = std::find_if(groups_.begin(), groups_.end(),
+				[&spec] (const SensorGroup &g) { return g.name == spec.group; });
+		if (it == groups_.end())
+			throw ConfigError(MSG_CONF_GROUP_UNKNOWN(spec.group));
+		group = it - groups_.begin();
+	}
+
+	unique_ptr<const SensorDriver> sensor;
+	if (offline_)
+		sensor = spec.make_offline();
+	else
+		sensor.reset(borrow_sensor(spec));
+	if (!sensor) {
+		clock::time_point start = clock::now();
+		unique_ptr<SensorDriver> made = spec.make();
+		pending_.push_back({ made.get(), nullptr, timed("sensor", made->path(), start) });
+		sensor = std::move(made);
+	}
 
 	num_temps_ += sensor->num_temps();
+	temp_groups_.insert(temp_groups_.end(), sensor->num_temps(), group);
 	sensors_.push_back(sensor.release());
+	sensor_specs_.push_back(spec);
+	return true;
+}
+
+
+bool Config::add_group(const SensorGroup &group)
+{
+	for (const SensorGroup &g : groups_)
+		if (g.name == group.name)
+			throw ConfigError(MSG_CONF_GROUP_DUP(group.name));
+	groups_.push_back(group);
+	return true;
+}
+
+
+/* Once there are groups, complex levels only see the groups, so a sensor
+ * outside of any group would be silently ignored. */
+void Config::check_groups() const
+{
+	if (groups_.empty())
+		return;
+
+	unsigned int offset = 0;
+	for (const SensorDriver *sensor : sensors_) {
+		if (sensor->num_temps() && temp_groups_[offset] < 0)
+			throw ConfigError(MSG_CONF_GROUP_MISSING(sensor->path()));
+		offset += sensor->num_temps();
+	}
+
+	for (unsigned int i = 0; i < groups_.size(); ++i) {
+		unsigned int size = std::count(temp_groups_.begin(), temp_groups_.end(), int(i));
+		if (size == 0 || size < groups_[i].rank)
+			throw ConfigError(MSG_CONF_GROUP_SIZE(groups_[i].name, size, groups_[i].rank));
+	}
+}
+
+
+/* Load sources aren't borrowed on a reload: They're cheap to open, and the
+ * NVML context is shared anyway. */
+bool Config::add_load(const LoadSpec &spec)
+{
+	if (!offline_) {
+		clock::time_point start = clock::now();
+		unique_ptr<LoadDriver> load = spec.make();
+		pending_.push_back({ nullptr, load.get(), timed("load", load->path(), start) });
+		loads_.push_back(load.release());
+	}
+	load_specs_.push_back(spec);
 	return true;
 }
 
 
+size_t Config::timed(const char *kind, const string &path, clock::time_point start)
+{
+	timings_.push_back({ kind, path, clock::now() - start, clock::duration(0) });
+	return timings_.size() - 1;
+}
+
+
+/* Runs the init() of all drivers that have been made since the last call.
+ * Each gets its own thread, since most of them just wait for a disk or a
+ * library, so startup takes as long as the slowest driver instead of all of
+ * them together. Nothing is logged from the threads, and once they're all
+ * done, the first error (in config order) is thrown. */
+void Config::init_drivers()
+{
+	std::vector<std::exception_ptr> errors(pending_.size());
+	auto init = [this, &errors] (size_t i) {
+		clock::time_point start = clock::now();
+		try {
+			if (pending_[i].sensor)
+				pending_[i].sensor->init();
+			else
+				pending_[i].load->init();
+		} catch (...) {
+			errors[i] = std::current_exception();
+		}
+		timings_[pending_[i].timing].init = clock::now() - start;
+	};
+
+	clock::time_point start = clock::now();
+	std::vector<std::thread> threads;
+	// The first one is done right here, so a single sensor needs no thread
+	for (size_t i = 1; i < pending_.size(); ++i) {
+		try {
+			threads.emplace_back(init, i);
+		} catch (std::system_error &) {
+			init(i);
+		}
+	}
+	if (pending_.size())
+		init(0);
+	for (std::thread &t : threads)
+		t.join();
+	init_time_ = clock::now() - start;
+	pending_.clear();
+
+	for (const std::exception_ptr &e : errors)
+		if (e)
+			std::rethrow_exception(e);
+
+	// Only paths that have worked out are worth remembering
+	HwmonIndex::save();
+}
+
+
+FanDriver *Config::borrow_fan(const FanSpec &spec)
+{
+	if (!lender_)
+		return nullptr;
+
+	for (FanConfig *fan_cfg : lender_->fans_) {
+		FanDriver *fan = fan_cfg->fan();
+		if (fan && spec.matches(*fan) && !borrowed(fan)) {
+			borrowed_.push_back(fan);
+			return fan;
+		}
+	}
+	return nullptr;
+}
+
+
+const SensorDriver *Config::borrow_sensor(const SensorSpec &spec)
+{
+	if (!lender_)
+		return nullptr;
+
+	// The same sensor may be specified twice, but each driver can only be used once
+	for (const SensorDriver *sensor : lender_->sensors_) {
+		if (sensor && spec.matches(*sensor) && !borrowed(sensor) && !sensor->stuck()) {
+			borrowed_.push_back(sensor);
+			return sensor;
+		}
+	}
+	return nullptr;
+}
+
+
+bool Config::borrowed(const void *driver) const
+{ return std::find(borrowed_.begin(), borrowed_.end(), driver) != borrowed_.end(); }
+
+
+void Config::adopt_borrowed()
+{
+	if (!lender_)
+		return;
+
+	for (FanConfig *fan_cfg : lender_->fans_)
+		if (borrowed(fan_cfg->fan()))
+			fan_cfg->release_fan();
+	for (const SensorDriver *&sensor : lender_->sensors_)
+		if (borrowed(sensor))
+			sensor = nullptr;
+
+	if (borrowed_.size() > 0)
+		log(TF_INF) << MSG_CONF_REUSED(borrowed_.size()) << flush;
+
+	borrowed_.clear();
+	lender_ = nullptr;
+}
+
+
 bool Config::add_level(std::unique_ptr<const Level> &&level)
 {
 	if (!level) return false;
 
+	// A level always belongs to the most recently specified fan
+	if (fans_.size() == 0)
+		fans_.push_back(new FanConfig(nullptr));
+	return fans_.back()->add_level(std::move(level));
+}
+
+
+unsigned int Config::num_temps() const
+{ return num_temps_; }
+
+const std::vector<Config::DriverTiming> &Config::timings() const
+{ return timings_; }
+
+Config::clock::duration Config::init_time() const
+{ return init_time_; }
+
+// What a complex level needs a limit for
+unsigned int Config::num_columns() const
+{ return groups_.size() ? groups_.size() : num_temps_; }
+
+const std::vector<SensorGroup> &Config::groups() const
+{ return groups_; }
+
+const std::vector<int> &Config::temp_groups() const
+{ return temp_groups_; }
+
+const std::vector<FanConfig *> &Config::fans() const
+{ return fans_; }
+
+const std::vector<const SensorDriver *> &Config::sensors() const
+{ return sensors_; }
+
+const std::vector<LoadDriver *> &Config::loads() const
+{ return loads_; }
+
+const std::vector<FanSpec> &Config::fan_specs() const
+{ return fan_specs_; }
+
+const std::vector<LoadSpec> &Config::load_specs() const
+{ return load_specs_; }
+
+
+/*----------------------------------------------------------------------------
+| FanSpec, SensorSpec: A driver as specified in the config. Two specs that   |
+| match the same running driver can share it, i.e. the driver would behave   |
+| exactly the same if it were newly instantiated from the spec.              |
+----------------------------------------------------------------------------*/
+
+// PWM steps per second by which a continuously controlled fan may change
+static const float PWM_RAMP_DEFAULT = 20;
+
+FanSpec::FanSpec()
+: type(TPACPI),
+  continuous(false),
+  ramp(PWM_RAMP_DEFAULT),
+  verify(false)
+{}
+
+
+FanSpec::FanSpec(Type type, const string &path)
+: type(type),
+  path(path),
+  continuous(false),
+  ramp(PWM_RAMP_DEFAULT),
+  verify(false)
+{}
+
+
+unique_ptr<FanDriver> FanSpec::make() const
+{
+	unique_ptr<FanDriver> rv;
+
+	switch (type) {
+	case TPACPI:
+		rv.reset(new TpFanDriver(path));
+		break;
+	case HWMON:
+		rv.reset(new HwmonFanDriver(path));
+		break;
+	}
+
+	if (!FanDispatch::supports(*rv))
+		throw ConfigError(MSG_CONF_STATIC_UNSUPP(path));
+	rv->set_verify(verify);
+	return rv;
+}
+
+
+bool FanSpec::matches(const FanDriver &fan) const
+{
+	if (fan.path() != path || fan.verify() != verify)
+		return false;
+
+	switch (type) {
+	case TPACPI:
+		return dynamic_cast<const TpFanDriver *>(&fan);
+	case HWMON:
+		return dynamic_cast<const HwmonFanDriver *>(&fan);
+	}
+	return false;
+}
+
+
+// How far ahead a trend predicts the temperature, unless configured
+static const secondsf HORIZON_DEFAULT(5);
+
+// Three missed datagrams at the default sleeptime
+static const secondsf UDP_STALE_DEFAULT(15);
+
+SensorSpec::SensorSpec()
+: type(HWMON),
+  poll_interval(0),
+  timeout(0),
+  trend(TemperatureState::TREND_JUMP),
+  horizon(HORIZON_DEFAULT),
+  num_temps(1),
+  stale(UDP_STALE_DEFAULT)
+{}
+
+
+SensorSpec::SensorSpec(Type type, const string &path)
+: type(type),
+  path(path),
+  poll_interval(0),
+  timeout(0),
+  trend(TemperatureState::TREND_JUMP),
+  horizon(HORIZON_DEFAULT),
+  num_temps(1),
+  stale(UDP_STALE_DEFAULT)
+{}
+
+
+unique_ptr<SensorDriver> SensorSpec::make() const
+{
+	unique_ptr<SensorDriver> rv;
+
+	switch (type) {
+	case TPACPI:
+		rv.reset(new TpSensorDriver(path));
+		break;
+	case HWMON:
+		rv.reset(new HwmonSensorDriver(path));
+		break;
+	case ATASMART:
+#ifdef USE_ATASMART
+		rv.reset(new AtasmartSensorDriver(path));
+		break;
+#else
+		throw SystemError(MSG_CONF_ATASMART_UNSUPP);
+#endif /* USE_ATASMART */
+	case NVML:
+#ifdef USE_NVML
+		rv.reset(new NvmlSensorDriver(path));
+		break;
+#else
+		throw SystemError(MSG_CONF_NVML_UNSUPP);
+#endif /* USE_NVML */
+	case UDP:
+		rv.reset(new UdpSensorDriver(path, num_temps, stale, from));
+		break;
+	}
+
+	if (!SensorDispatch::supports(*rv))
+		throw ConfigError(MSG_CONF_STATIC_UNSUPP(path));
+	if (correction.size() > 0)
+		rv->set_correction(correction);
+	rv->set_poll_interval(poll_interval);
+	rv->set_timeout(timeout);
+	rv->set_trend(trend, horizon);
+	return rv;
+}
+
+
+namespace {
+
+/* Stands in for a sensor in an offline config. It has as many temperatures as
+ * the real driver, but nothing to read them from. */
+class OfflineSensorDriver final : public SensorDriver {
+public:
+	OfflineSensorDriver(const string &path, unsigned int num_temps)
+	: SensorDriver(path)
+	{ set_num_temps(num_temps); }
+
+	void read_temps() const override
+	{ throw Bug("OfflineSensorDriver::read_temps(): " + path_); }
+};
+
+}
+
+
+/* Without touching the hardware, except that tp_thermal has to be read once
+ * since its number of temperatures depends on the machine. */
+unique_ptr<SensorDriver> SensorSpec::make_offline() const
+{
+	unsigned int count = 1;
+
+	switch (type) {
+	case TPACPI:
+		count = TpSensorDriver(path).num_temps();
+		break;
+	case HWMON:
+	case ATASMART:
+		break;
+	case NVML:
+#ifdef USE_NVML
+		count = NvmlContext::bus_ids(path).size();
+		break;
+#else
+		throw SystemError(MSG_CONF_NVML_UNSUPP);
+#endif /* USE_NVML */
+	case UDP:
+		count = num_temps;
+		break;
+	}
+
+	unique_ptr<SensorDriver> rv(new OfflineSensorDriver(path, count));
+	rv->set_trend(trend, horizon);
+	return rv;
+}
+
+
+bool SensorSpec::matches(const SensorDriver &sensor) const
+{
+	if (sensor.path() != path
+			|| sensor.poll_interval() != poll_interval
+			|| sensor.timeout() != timeout
+			|| sensor.trend() != trend
+			|| sensor.horizon() != horizon)
+		return false;
+
+	// The driver's correction is always padded to the number of temperatures
+	if (correction.size() > sensor.correction().size()
+			|| !std::equal(correction.begin(), correction.end(), sensor.correction().begin())
+			|| std::any_of(sensor.correction().begin() + correction.size(), sensor.correction().end(),
+					[] (int c) { return c != 0; }))
+		return false;
+
+	switch (type) {
+	case TPACPI:
+		return dynamic_cast<const TpSensorDriver *>(&sensor);
+	case HWMON:
+		return dynamic_cast<const HwmonSensorDriver *>(&sensor);
+	case ATASMART:
+#ifdef USE_ATASMART
+		return dynamic_cast<const AtasmartSensorDriver *>(&sensor);
+#else
+		return false;
+#endif /* USE_ATASMART */
+	case NVML:
+#ifdef USE_NVML
+		return dynamic_cast<const NvmlSensorDriver *>(&sensor);
+#else
+		return false;
+#endif /* USE_NVML */
+	case UDP:
+		if (const UdpSensorDriver *udp = dynamic_cast<const UdpSensorDriver *>(&sensor))
+			return udp->num_temps() == num_temps && udp->stale() == stale && udp->from() == from;
+		return false;
+	}
+	return false;
+}
+
+
+// Degrees added to all temperatures at full load, unless configured
+static const float LOAD_GAIN_DEFAULT = 10;
+
+LoadSpec::LoadSpec()
+: type(CPU),
+  gain(LOAD_GAIN_DEFAULT)
+{}
+
+
+unique_ptr<LoadDriver> LoadSpec::make() const
+{
+	unique_ptr<LoadDriver> rv;
+
+	switch (type) {
+	case CPU:
+		rv.reset(new CpuLoadDriver(path));
+		break;
+	case NVML:
+#ifdef USE_NVML
+		rv.reset(new NvmlLoadDriver(path));
+		break;
+#else
+		throw SystemError(MSG_CONF_NVML_UNSUPP);
+#endif /* USE_NVML */
+	}
+
+	rv->set_gain(gain);
+	return rv;
+}
+
+
+SensorGroup::SensorGroup()
+: rank(1)
+{}
+
+
+/*----------------------------------------------------------------------------
+| FanConfig: A fan (zone) along with its own table of fan levels. All fans   |
+| are evaluated against the same TemperatureState in each cycle.             |
+----------------------------------------------------------------------------*/
+
+FanConfig::FanConfig(std::unique_ptr<FanDriver> &&fan, bool initialized)
+: fan_(fan.release()),
+  dispatch_(fan_),
+  fan_initialized_(initialized),
+  cur_lvl_(0),
+  cur_pwm_(-1),
+  forced_(false),
+  forced_written_(false),
+  forced_lvl_(0)
+{}
+
+
+FanConfig::~FanConfig()
+{
+	delete fan_;
+	for (const Level *level : levels_) delete level;
+}
+
+
+void FanConfig::set_fan(std::unique_ptr<FanDriver> &&fan, bool initialized)
+{
+	delete fan_;
+	fan_ = fan.release();
+	dispatch_ = FanDispatch(fan_);
+	fan_initialized_ = initialized;
+}
+
+
+void FanConfig::set_continuous(float ramp)
+{ interpolator_.reset(new PwmInterpolator(ramp)); }
+
+
+FanDriver *FanConfig::release_fan()
+{
+	FanDriver *rv = fan_;
+	fan_ = nullptr;
+	dispatch_ = FanDispatch();
+	return rv;
+}
+
+
+bool FanConfig::add_level(std::unique_ptr<const Level> &&level)
+{
+	if (!level) return false;
+
 	if (levels_.size() > 0) {
 		const Level *last_lvl = levels_.back();
 		if (level->num() != std::numeric_limits<int>::max()
@@ -144,17 +777,338 @@ bool Config::add_level(std::unique_ptr<const Level> &&level)
 }
 
 
-FanDriver *Config::fan() const
+FanDriver *FanConfig::fan() const
 { return fan_; }
 
-unsigned int Config::num_temps() const
-{ return num_temps_; }
-
-const std::vector<const Level *> &Config::levels() const
+const std::vector<const Level *> &FanConfig::levels() const
 { return levels_; }
 
-const std::vector<const SensorDriver *> &Config::sensors() const
-{ return sensors_; }
+const Level *FanConfig::cur_lvl() const
+{ return levels_[cur_lvl_]; }
+
+unsigned int FanConfig::cur_lvl_idx() const
+{ return cur_lvl_; }
+
+const LevelTable &FanConfig::table() const
+{ return table_; }
+
+bool FanConfig::continuous() const
+{ return static_cast<bool>(interpolator_); }
+
+int FanConfig::cur_pwm() const
+{ return cur_pwm_; }
+
+bool FanConfig::forced() const
+{ return forced_; }
+
+FanConfig::clock::time_point FanConfig::forced_until() const
+{ return forced_until_; }
+
+
+void FanConfig::compile(unsigned int num_temps)
+{
+	table_.compile(levels_, num_temps);
+	if (interpolator_)
+		interpolator_->compile(levels_, num_temps);
+}
+
+
+void FanConfig::init_fanspeed()
+{
+	if (!fan_initialized_) {
+		fan_->init();
+		fan_initialized_ = true;
+	}
+	if (interpolator_) {
+		interpolator_->reset();
+		cur_pwm_ = interpolator_->update(PwmInterpolator::clock::now());
+		cur_lvl_ = interpolator_->level_idx();
+		static_cast<HwmonFanDriver *>(fan_)->set_pwm(cur_pwm_);
+		return;
+	}
+	cur_lvl_ = table_.lookup(0);
+	dispatch_.set_speed(levels_[cur_lvl_]);
+}
+
+
+bool FanConfig::set_fanspeed(bool ping_watchdog)
+{
+	if (unlikely(forced_)) {
+		if (clock::now() < forced_until_)
+			return hold_forced(ping_watchdog);
+		forced_ = false;
+		log(TF_INF) << MSG_FAN_FORCE_END(fan_->path()) << flush;
+	}
+
+	if (interpolator_) {
+		// Only written if it actually changed, but the level is only reported
+		// as changed when the PWM value crosses a level from the table.
+		int pwm = interpolator_->update(PwmInterpolator::clock::now());
+		if (pwm != cur_pwm_) {
+			static_cast<HwmonFanDriver *>(fan_)->set_pwm(pwm);
+			cur_pwm_ = pwm;
+		}
+		else if (ping_watchdog)
+			dispatch_.ping_watchdog_and_depulse(levels_[cur_lvl_]);
+		unsigned int new_lvl = interpolator_->level_idx();
+		if (new_lvl < cur_lvl_)
+			tmp_sleeptime = sleeptime;
+		bool changed = new_lvl != cur_lvl_;
+		cur_lvl_ = new_lvl;
+		return changed;
+	}
+
+	unsigned int new_lvl = table_.lookup(cur_lvl_);
+
+	if (unlikely(new_lvl != cur_lvl_)) {
+		if (new_lvl < cur_lvl_)
+			tmp_sleeptime = sleeptime;
+		cur_lvl_ = new_lvl;
+		dispatch_.set_speed(levels_[cur_lvl_]);
+		return true;
+	}
+	else {
+		if (ping_watchdog)
+			dispatch_.ping_watchdog_and_depulse(levels_[cur_lvl_]);
+		return false;
+	}
+}
+
+
+/* Overrides the levels (or the interpolated PWM value) until the given time,
+ * or until the config is reloaded. The temperatures are still read, so the
+ * normal level is applied as soon as the override ends. */
+void FanConfig::force_level(unsigned int idx, clock::time_point until)
+{
+	forced_ = true;
+	forced_written_ = false;
+	forced_lvl_ = idx;
+	forced_until_ = until;
+}
+
+
+void FanConfig::release()
+{ forced_until_ = clock::time_point::min(); }
+
+
+bool FanConfig::hold_forced(bool ping_watchdog)
+{
+	// Every cycle, so the ramp doesn't count the override's duration as
+	// time it had to get away from the forced value.
+	if (interpolator_)
+		interpolator_->hold(levels_[forced_lvl_]->num(), PwmInterpolator::clock::now());
+
+	if (unlikely(!forced_written_)) {
+		bool changed = forced_lvl_ != cur_lvl_;
+		cur_lvl_ = forced_lvl_;
+		dispatch_.set_speed(levels_[cur_lvl_]);
+		// So the interpolator's next value is written once the override ends
+		if (interpolator_)
+			cur_pwm_ = levels_[cur_lvl_]->num();
+		forced_written_ = true;
+		return changed;
+	}
+	if (ping_watchdog)
+		dispatch_.ping_watchdog_and_depulse(levels_[cur_lvl_]);
+	return false;
+}
+
+
+/*----------------------------------------------------------------------------
+| LevelTable: All limits of a fan's levels, compiled into two flat matrices  |
+| (one row per level) when the config is loaded. Rows are padded to a        |
+| multiple of 8 so the compare loop vectorizes without a scalar tail. The    |
+| padding never affects the result: unused limits are INT_MAX and unused     |
+| temperatures INT_MIN. A lookup evaluates all levels in one pass and then   |
+| picks the target level with the same hysteresis as stepping through them   |
+| one at a time: Go up while the temperature reaches a level's upper limit,  |
+| otherwise go down while it's below the lower limit. Simple levels compare  |
+| only the highest biased temperature, complex levels each raw temperature,  |
+| or with sensor groups, the aggregate temperature of each group.            |
+----------------------------------------------------------------------------*/
+
+LevelTable::LevelTable()
+: simple_(true),
+  num_levels_(0),
+  stride_(0)
+{}
+
+
+void LevelTable::compile(const std::vector<const Level *> &levels, unsigned int num_temps)
+{
+	simple_ = dynamic_cast<const SimpleLevel *>(levels.front());
+	unsigned int width = simple_ ? 1 : num_temps;
+
+	num_levels_ = levels.size();
+	stride_ = (width + 7) & ~7u;
+	lower_.assign(num_levels_ * stride_, std::numeric_limits<int>::max());
+	upper_.assign(num_levels_ * stride_, std::numeric_limits<int>::max());
+	temps_.assign(stride_, std::numeric_limits<int>::min());
+	up_.assign(num_levels_, 0);
+	down_.assign(num_levels_, 0);
+
+	for (unsigned int i = 0; i < num_levels_; ++i) {
+		const Level *level = levels[i];
+		// Not just a sanity check: The copy below would read past the limits
+		size_t count = std::min(level->lower_limit().size(), level->upper_limit().size());
+		if (count < width)
+			throw ConfigError(MSG_CONF_LIMITCOUNT(level->str(), count, width));
+
+		std::copy(level->lower_limit().begin(), level->lower_limit().begin() + width, lower_.begin() + i * stride_);
+		std::copy(level->upper_limit().begin(), level->upper_limit().begin() + width, upper_.begin() + i * stride_);
+	}
+}
+
+
+unsigned int LevelTable::lookup(unsigned int cur_lvl) const
+{
+	if (simple_)
+		temps_[0] = *temp_state.tmax;
+	else
+		std::copy(temp_state.columns().begin(), temp_state.columns().end(), temps_.begin());
+
+	const int *t = temps_.data();
+	for (unsigned int i = 0; i < num_levels_; ++i) {
+		const int *lower = &lower_[i * stride_];
+		const int *upper = &upper_[i * stride_];
+		int any_up = 0, all_down = 1;
+		for (unsigned int j = 0; j < stride_; ++j) {
+			any_up |= t[j] >= upper[j];
+			all_down &= t[j] < lower[j];
+		}
+		up_[i] = any_up;
+		down_[i] = all_down;
+	}
+
+	unsigned int lvl = cur_lvl;
+	if (unlikely(up_[lvl])) {
+		while (lvl < num_levels_ - 1 && up_[lvl])
+			++lvl;
+	}
+	else {
+		while (lvl > 0 && down_[lvl])
+			--lvl;
+	}
+	return lvl;
+}
+
+
+/*----------------------------------------------------------------------------
+| PwmInterpolator: Each level of the table becomes an anchor point, i.e. the |
+| temperature at which the fan runs exactly at that level's PWM value. For   |
+| a level above the lowest one, that's where the stepped table would switch  |
+| up to it (the previous level's upper limit). The lowest level is anchored  |
+| where the table would switch back down to it (the next level's lower       |
+| limit). In between, the PWM value is interpolated linearly. With complex   |
+| levels, each temperature is interpolated over its own column of limits,    |
+| and the highest result wins.                                               |
+----------------------------------------------------------------------------*/
+
+PwmInterpolator::PwmInterpolator(float ramp)
+: ramp_(ramp),
+  simple_(true),
+  num_levels_(0),
+  width_(0),
+  out_(0),
+  level_idx_(0),
+  started_(false)
+{}
+
+
+void PwmInterpolator::compile(const std::vector<const Level *> &levels, unsigned int num_temps)
+{
+	simple_ = dynamic_cast<const SimpleLevel *>(levels.front());
+	width_ = simple_ ? 1 : num_temps;
+	num_levels_ = levels.size();
+
+	pwm_.resize(num_levels_);
+	anchors_.assign(num_levels_ * width_, 0);
+	for (unsigned int i = 0; i < num_levels_; ++i) {
+		const Level *level = levels[i];
+		// Always checked since the level numbers are written as PWM values
+		if (level->num() < 0 || level->num() > 255)
+			throw ConfigError(MSG_CONF_CONTINUOUS_LVL(level->str()));
+		size_t count = std::min(level->lower_limit().size(), level->upper_limit().size());
+		if (count < width_)
+			throw ConfigError(MSG_CONF_LIMITCOUNT(level->str(), count, width_));
+		pwm_[i] = level->num();
+
+		for (unsigned int j = 0; j < width_; ++j) {
+			if (i > 0)
+				anchors_[i * width_ + j] = levels[i - 1]->upper_limit()[j];
+			else if (num_levels_ > 1)
+				anchors_[j] = levels[1]->lower_limit()[j];
+		}
+	}
+}
+
+
+void PwmInterpolator::reset()
+{ started_ = false; }
+
+
+/* The fan is at pwm for reasons of its own (i.e. it's forced), so that's
+ * where the ramp has to start from once we're in control again. */
+void PwmInterpolator::hold(int pwm, clock::time_point now)
+{
+	out_ = pwm;
+	last_ = now;
+	started_ = true;
+}
+
+
+/* Fractional index into the level list for one temperature */
+float PwmInterpolator::position(int temp, unsigned int col) const
+{
+	const int *a = &anchors_[col];
+	if (temp <= a[0])
+		return 0;
+	for (unsigned int i = 0; i + 1 < num_levels_; ++i) {
+		int lo = a[i * width_], hi = a[(i + 1) * width_];
+		if (temp < hi)
+			return hi > lo ? i + float(temp - lo) / (hi - lo) : i;
+	}
+	return num_levels_ - 1;
+}
+
+
+int PwmInterpolator::update(clock::time_point now)
+{
+	float pos = 0;
+	if (simple_)
+		pos = position(*temp_state.tmax, 0);
+	else
+		for (unsigned int j = 0; j < width_; ++j)
+			pos = std::max(pos, position(temp_state.columns()[j], j));
+
+	unsigned int idx = static_cast<unsigned int>(pos);
+	float target = pwm_[idx];
+	if (idx + 1 < num_levels_)
+		target += (pos - idx) * (pwm_[idx + 1] - pwm_[idx]);
+
+	if (started_) {
+		float max_step = ramp_ * std::chrono::duration_cast<secondsf>(now - last_).count();
+		out_ += std::max(-max_step, std::min(max_step, target - out_));
+	}
+	else {
+		out_ = target;
+		started_ = true;
+	}
+	last_ = now;
+
+	int rv = static_cast<int>(out_ + 0.5f);
+
+	// The level that this PWM value has reached, for logging
+	level_idx_ = 0;
+	while (level_idx_ + 1 < num_levels_ && rv >= pwm_[level_idx_ + 1])
+		++level_idx_;
+
+	return rv;
+}
+
+
+unsigned int PwmInterpolator::level_idx() const
+{ return level_idx_; }
 
 
 Level::Level(int level, int lower_limit, int upper_limit)
@@ -170,6 +1124,7 @@ Level::Level(string level, int lower_limit, int upper_limit)
 Level::Level(int level, const std::vector<int> &lower_limit, const std::vector<int> &upper_limit)
 : level_s_("level " + std::to_string(level)),
   level_n_(level),
+  num_s_(std::to_string(level)),
   lower_limit_(lower_limit),
   upper_limit_(upper_limit)
 {}
@@ -193,7 +1148,7 @@ Level::Level(string level, const std::vector<int> &lower_limit, const std::vecto
 	if (level == "level auto" || level == "level disengaged" || level == "level full-speed")
 		level_n_ = std::numeric_limits<int>::min();
 	else if (sscanf(level.c_str(), "level %d", &level_n_) == 1)
-		return;
+		;
 	else try {
 		level_n_ = std::stoi(level);
 		level_s_ = "level " + level;
@@ -202,6 +1157,22 @@ Level::Level(string level, const std::vector<int> &lower_limit, const std::vecto
 	} catch (std::invalid_argument &e) {
 		error<ConfigError>(MSG_CONF_LVLFORMAT(level));
 	}
+
+	// Formatted once here so setting a PWM fan doesn't have to allocate
+	num_s_ = std::to_string(level_n_);
+}
+
+
+/* The limits are the lower ones followed by the upper ones */
+Level::Level(const string &str, int num, const string &num_str, const int *limits, unsigned int width)
+: level_s_(str),
+  level_n_(num),
+  num_s_(num_str),
+  lower_limit_(limits, limits + width),
+  upper_limit_(limits + width, limits + 2 * width)
+{
+	for (unsigned int i = 0; i < width; ++i)
+		if (lower_limit_[i] >= upper_limit_[i]) error<ConfigError>(MSG_CONF_LOWHIGH);
 }
 
 
@@ -217,6 +1188,9 @@ const string &Level::str() const
 int Level::num() const
 { return this->level_n_; }
 
+const string &Level::num_str() const
+{ return this->num_s_; }
+
 
 SimpleLevel::SimpleLevel(int level, int lower_limit, int upper_limit)
 : Level(level, lower_limit, upper_limit) {}
@@ -224,14 +1198,8 @@ SimpleLevel::SimpleLevel(int level, int lower_limit, int upper_limit)
 SimpleLevel::SimpleLevel(string level, int lower_limit, int upper_limit)
 : Level(level, lower_limit, upper_limit) {}
 
-bool SimpleLevel::up() const
-{
-	return *temp_state.tmax >= upper_limit().front();
-}
-
-
-bool SimpleLevel::down() const
-{ return *temp_state.tmax < lower_limit().front(); }
+SimpleLevel::SimpleLevel(const string &str, int num, const string &num_str, const int *limits)
+: Level(str, num, num_str, limits, 1) {}
 
 
 
@@ -241,29 +1209,8 @@ ComplexLevel::ComplexLevel(int level, const std::vector<int> &lower_limit, const
 ComplexLevel::ComplexLevel(string level, const std::vector<int> &lower_limit, const std::vector<int> &upper_limit)
 : Level(level, lower_limit, upper_limit) {}
 
-
-bool ComplexLevel::up() const
-{
-	std::vector<int>::const_iterator temp_it = temp_state.get().begin();
-	const int *upper_idx = upper_limit().data();
-
-	while (temp_it != temp_state.get().end())
-		if (*(temp_it++) >= *upper_idx++) return true;
-
-	return false;
-}
-
-
-bool ComplexLevel::down() const
-{
-	std::vector<int>::const_iterator temp_it = temp_state.get().begin();
-	const int *lower_idx = lower_limit().data();
-
-	while (temp_it != temp_state.get().end() && *(temp_it++) < *lower_idx++)
-		;
-
-	return temp_it == temp_state.get().end();
-}
+ComplexLevel::ComplexLevel(const string &str, int num, const string &num_str, const int *limits, unsigned int width)
+: Level(str, num, num_str, limits, width) {}
 
 
 } /* namespace thinkfan */
@@ -27,8 +27,10 @@
 #include <string>
 #include <vector>
 #include <memory>
+#include <chrono>
 
 #include "drivers.h"
+#include "dispatch.h"
 #include "thinkfan.h"
 
 namespace thinkfan {
@@ -39,6 +41,7 @@ class Level {
 protected:
 	string level_s_;
 	int level_n_;
+	string num_s_;
 	std::vector<int> lower_limit_;
 	std::vector<int> upper_limit_;
 public:
@@ -47,16 +50,17 @@ public:
 	Level(int level, const std::vector<int> &lower_limit, const std::vector<int> &upper_limit);
 	Level(string level, const std::vector<int> &lower_limit, const std::vector<int> &upper_limit);
 
+	// From a config image, i.e. with lower & upper limits of the same length
+	Level(const string &str, int num, const string &num_str, const int *limits, unsigned int width);
+
 	virtual ~Level() = default;
 
 	const std::vector<int> &lower_limit() const;
 	const std::vector<int> &upper_limit() const;
 
-	virtual bool up() const = 0;
-	virtual bool down() const = 0;
-
 	const string &str() const;
 	int num() const;
+	const string &num_str() const;
 };
 
 
@@ -64,8 +68,7 @@ class SimpleLevel : public Level {
 public:
 	SimpleLevel(int level, int lower_limit, int upper_limit);
 	SimpleLevel(string level, int lower_limit, int upper_limit);
-	virtual bool up() const override;
-	virtual bool down() const override;
+	SimpleLevel(const string &str, int num, const string &num_str, const int *limits);
 };
 
 
@@ -73,33 +76,263 @@ class ComplexLevel : public Level {
 public:
 	ComplexLevel(int level, const std::vector<int> &lower_limit, const std::vector<int> &upper_limit);
 	ComplexLevel(string level, const std::vector<int> &lower_limit, const std::vector<int> &upper_limit);
-	virtual bool up() const override;
-	virtual bool down() const override;
+	ComplexLevel(const string &str, int num, const string &num_str, const int *limits, unsigned int width);
+};
+
+
+class LevelTable {
+public:
+	LevelTable();
+	void compile(const std::vector<const Level *> &levels, unsigned int num_temps);
+	unsigned int lookup(unsigned int cur_lvl) const;
+
+private:
+	bool simple_;
+	unsigned int num_levels_;
+	unsigned int stride_;
+	std::vector<int> lower_;
+	std::vector<int> upper_;
+	mutable std::vector<int> temps_;
+	mutable std::vector<unsigned char> up_;
+	mutable std::vector<unsigned char> down_;
+};
+
+
+/* Continuous control for PWM fans: Instead of jumping between the levels of
+ * the table, the PWM value is interpolated linearly between them, and it may
+ * change only by a limited number of steps per second. */
+class PwmInterpolator {
+public:
+	typedef std::chrono::steady_clock clock;
+
+	PwmInterpolator(float ramp);
+	void compile(const std::vector<const Level *> &levels, unsigned int num_temps);
+	void reset();
+	void hold(int pwm, clock::time_point now);
+	int update(clock::time_point now);
+	unsigned int level_idx() const;
+
+private:
+	float position(int temp, unsigned int col) const;
+
+	float ramp_;
+	bool simple_;
+	unsigned int num_levels_;
+	unsigned int width_;
+	std::vector<int> anchors_;
+	std::vector<int> pwm_;
+	float out_;
+	unsigned int level_idx_;
+	bool started_;
+	clock::time_point last_;
+};
+
+
+/* What the config says about a fan or a sensor. The parser only produces
+ * these, and the Config then either instantiates a new driver from them or
+ * takes over a matching driver from the config that is being reloaded. */
+struct FanSpec {
+	enum Type { TPACPI, HWMON };
+
+	FanSpec();
+	FanSpec(Type type, const string &path);
+	std::unique_ptr<FanDriver> make() const;
+	bool matches(const FanDriver &fan) const;
+
+	Type type;
+	string path;
+	bool continuous;
+	float ramp;
+	bool verify;
+};
+
+
+struct SensorSpec {
+	enum Type { TPACPI, HWMON, ATASMART, NVML, UDP };
+
+	SensorSpec();
+	SensorSpec(Type type, const string &path);
+	std::unique_ptr<SensorDriver> make() const;
+	std::unique_ptr<SensorDriver> make_offline() const;
+	bool matches(const SensorDriver &sensor) const;
+
+	Type type;
+	string path;
+	std::vector<int> correction;
+	secondsf poll_interval;
+	secondsf timeout;
+	TemperatureState::Trend trend;
+	secondsf horizon;
+	string group;
+
+	// Only for UDP
+	unsigned int num_temps;
+	secondsf stale;
+	string from;
+};
+
+
+struct LoadSpec {
+	enum Type { CPU, NVML };
+
+	LoadSpec();
+	std::unique_ptr<LoadDriver> make() const;
+
+	Type type;
+	string path;
+	float gain;
+};
+
+
+/* A named set of sensors that complex levels see as a single temperature.
+ * A rank of 0 means the mean of all its temperatures, otherwise it's the
+ * rank-th highest one (i.e. 1 is the maximum). */
+struct SensorGroup {
+	SensorGroup();
+
+	string name;
+	unsigned int rank;
+};
+
+
+class FanConfig {
+public:
+	typedef std::chrono::steady_clock clock;
+
+	FanConfig(std::unique_ptr<FanDriver> &&fan, bool initialized = false);
+	FanConfig(const FanConfig &) = delete;
+	~FanConfig();
+	bool add_level(std::unique_ptr<const Level> &&level);
+	void set_fan(std::unique_ptr<FanDriver> &&fan, bool initialized = false);
+	void set_continuous(float ramp);
+	FanDriver *release_fan();
+
+	FanDriver *fan() const;
+	const std::vector<const Level *> &levels() const;
+	const Level *cur_lvl() const;
+	unsigned int cur_lvl_idx() const;
+	const LevelTable &table() const;
+	bool continuous() const;
+	int cur_pwm() const;
+	bool forced() const;
+	clock::time_point forced_until() const;
+
+	void compile(unsigned int num_temps);
+	void init_fanspeed();
+	bool set_fanspeed(bool ping_watchdog);
+	void force_level(unsigned int idx, clock::time_point until);
+	void release();
+
+	FanConfig &operator = (const FanConfig &) = delete;
+
+private:
+	friend class ConfigImage;
+
+	FanDriver *fan_;
+	FanDispatch dispatch_;
+	bool fan_initialized_;
+	std::vector<const Level *> levels_;
+	LevelTable table_;
+	unsigned int cur_lvl_;
+	std::unique_ptr<PwmInterpolator> interpolator_;
+	int cur_pwm_;
+	bool forced_;
+	bool forced_written_;
+	unsigned int forced_lvl_;
+	clock::time_point forced_until_;
+
+	bool hold_forced(bool ping_watchdog);
 };
 
 
 class Config {
 public:
-	Config();
+	typedef std::chrono::steady_clock clock;
+
+	// How long a driver that was made for this config (not borrowed) took to
+	// construct and to init(). Fans don't have an init().
+	struct DriverTiming {
+		const char *kind;
+		string path;
+		clock::duration construct;
+		clock::duration init;
+	};
+
+	Config(Config *lender = nullptr, bool offline = false);
 	Config(const Config &) = delete;
 	~Config();
-	static const Config *read_config(const string &filename);
-	bool add_fan(std::unique_ptr<FanDriver> &&fan);
-	bool add_sensor(std::unique_ptr<const SensorDriver> &&sensor);
+
+	// With init = false, the config is only checked and the drivers must be
+	// initialized with init_drivers() before it's used.
+	static Config *read_config(const string &filename, Config *lender = nullptr, bool init = true);
+
+	// For --replay: Only the levels, the groups and the number of temperatures.
+	// There are no fan or load drivers, and the sensors are stand-ins that
+	// can't be read. Always parses the text, never the image.
+	static Config *read_offline(const string &filename);
+	void init_drivers();
+	bool add_fan(const FanSpec &spec);
+	bool add_sensor(const SensorSpec &spec);
+	bool add_load(const LoadSpec &spec);
+	bool add_group(const SensorGroup &group);
 	bool add_level(std::unique_ptr<const Level> &&level);
 
 	unsigned int num_temps() const;
-	FanDriver *fan() const;
-	const std::vector<const Level *> &levels() const;
+	unsigned int num_columns() const;
+	const std::vector<SensorGroup> &groups() const;
+	const std::vector<int> &temp_groups() const;
+	const std::vector<FanConfig *> &fans() const;
 	const std::vector<const SensorDriver *> &sensors() const;
+	const std::vector<LoadDriver *> &loads() const;
+	const std::vector<FanSpec> &fan_specs() const;
+	const std::vector<LoadSpec> &load_specs() const;
+	const std::vector<DriverTiming> &timings() const;
+	clock::duration init_time() const;
 
 	Config &operator = (const Config &) = delete;
 
 private:
+	friend class ConfigImage;
+
+	static Config *parse(const string &filename, Config *lender, bool offline = false);
+
+	struct Pending {
+		SensorDriver *sensor;
+		LoadDriver *load;
+		size_t timing;
+	};
+
+	size_t timed(const char *kind, const string &path, clock::time_point start);
+
+	FanDriver *borrow_fan(const FanSpec &spec);
+	const SensorDriver *borrow_sensor(const SensorSpec &spec);
+	bool borrowed(const void *driver) const;
+	void adopt_borrowed();
+	void check();
+	void check_groups() const;
+
 	std::vector<const SensorDriver *> sensors_;
-	std::vector<const Level *> levels_;
+	std::vector<FanConfig *> fans_;
+	std::vector<LoadDriver *> loads_;
+	const bool offline_;
 	unsigned int num_temps_;
-	FanDriver *fan_;
+	std::vector<SensorGroup> groups_;
+	std::vector<int> temp_groups_;	// Index into groups_ for each temperature, or -1
+
+	// What the drivers were made from, in the same order, for a ConfigImage
+	std::vector<FanSpec> fan_specs_;
+	std::vector<SensorSpec> sensor_specs_;
+	std::vector<LoadSpec> load_specs_;
+
+	// While a reloaded config is being read, drivers that are unchanged are
+	// borrowed from the running config. They're only handed over when the new
+	// config has turned out valid, until then the lender keeps owning them.
+	Config *lender_;
+	std::vector<const void *> borrowed_;
+
+	std::vector<Pending> pending_;	// Made, but not yet initialized
+	std::vector<DriverTiming> timings_;
+	clock::duration init_time_;
 };
 
 
@@ -0,0 +1,298 @@
+/********************************************************************
+ * control.cpp: Queries & overrides through a Unix domain socket.
+ * (C) 2015, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "error.h"
+#include "control.h"
+#include "config.h"
+#include "message.h"
+
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <signal.h>
+#include <cstring>
+#include <cstdlib>
+#include <sstream>
+
+namespace thinkfan {
+
+static const unsigned int CONTROL_MAX_CLIENTS = 16;
+static const size_t CONTROL_MAX_LINE = 256;
+
+// A forced level always ends by itself, so it can't be forgotten about.
+static const int CONTROL_FORCE_DEFAULT = 60;
+static const int CONTROL_FORCE_MAX = 3600;
+
+
+/*----------------------------------------------------------------------------
+| ControlSocket: Only root may connect, since the socket is created with     |
+| mode 0600. Each client is read from until it would block, and every        |
+| complete line is executed as soon as it's in. A reply that doesn't fit     |
+| into the socket buffer right away (or a line that's too long) drops the    |
+| client.                                                                    |
+----------------------------------------------------------------------------*/
+
+ControlSocket::ControlSocket(const string &path)
+: path_(path),
+  listen_fd_(-1),
+  epoll_fd_(-1)
+{
+	struct sockaddr_un addr;
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (path_.length() >= sizeof(addr.sun_path))
+		throw SystemError(MSG_CONTROL_PATH(path_));
+	std::memcpy(addr.sun_path, path_.data(), path_.length());
+
+	// A socket there was left over by a thinkfan that didn't exit cleanly
+	// (the PID file has already made sure that it isn't still running).
+	// Anything else is most likely a typo, and we're running as root.
+	struct stat st;
+	if (::lstat(path_.c_str(), &st) == 0) {
+		if (!S_ISSOCK(st.st_mode))
+			throw ExpectedError(MSG_CONTROL_NOT_SOCKET(path_));
+		if (::unlink(path_.c_str()))
+			throw IOerror(MSG_CONTROL_OPEN(path_), errno);
+	}
+	else if (errno != ENOENT)
+		throw IOerror(MSG_CONTROL_OPEN(path_), errno);
+
+	listen_fd_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd_ < 0)
+		throw IOerror(MSG_CONTROL_OPEN(path_), errno);
+
+	mode_t old_mask = ::umask(0077);
+	int rv = ::bind(listen_fd_, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr));
+	int err = errno;
+	::umask(old_mask);
+	if (rv)
+		throw IOerror(MSG_CONTROL_OPEN(path_), err);
+	if (::listen(listen_fd_, CONTROL_MAX_CLIENTS))
+		throw IOerror(MSG_CONTROL_OPEN(path_), errno);
+
+	epoll_fd_ = ::epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd_ < 0)
+		throw IOerror("epoll_create1: ", errno);
+	struct epoll_event ev;
+	std::memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = listen_fd_;
+	if (::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &ev))
+		throw IOerror("epoll_ctl: ", errno);
+}
+
+
+ControlSocket::~ControlSocket()
+{
+	for (Client &client : clients_)
+		::close(client.fd);
+	if (epoll_fd_ >= 0)
+		::close(epoll_fd_);
+	if (listen_fd_ >= 0) {
+		::close(listen_fd_);
+		::unlink(path_.c_str());
+	}
+}
+
+
+/* Serves whatever is ready without blocking. Returns true if a command
+ * changed how the fans are controlled, so the next cycle should come now. */
+bool ControlSocket::handle(const Config &config)
+{
+	bool changed = false;
+	struct epoll_event evs[8];
+	int n = ::epoll_wait(epoll_fd_, evs, sizeof(evs) / sizeof(*evs), 0);
+	for (int i = 0; i < n; ++i) {
+		if (evs[i].data.fd == listen_fd_) {
+			accept_clients();
+			continue;
+		}
+		for (unsigned int c = 0; c < clients_.size(); ++c) {
+			if (clients_[c].fd == evs[i].data.fd) {
+				if (!serve(clients_[c], config, changed))
+					drop(c);
+				break;
+			}
+		}
+	}
+	return changed;
+}
+
+
+void ControlSocket::accept_clients()
+{
+	int fd;
+	while ((fd = ::accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+		struct epoll_event ev;
+		std::memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.fd = fd;
+		if (clients_.size() >= CONTROL_MAX_CLIENTS || ::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev)) {
+			::close(fd);
+			continue;
+		}
+		clients_.push_back({ fd, string() });
+	}
+}
+
+
+void ControlSocket::drop(unsigned int idx)
+{
+	// Closing it also removes it from the epoll set
+	::close(clients_[idx].fd);
+	clients_.erase(clients_.begin() + idx);
+}
+
+
+static string error_reply(const string &msg)
+{ return "error: " + msg + "\n"; }
+
+
+/* Returns false if the client is done, or has to be dropped. */
+bool ControlSocket::serve(Client &client, const Config &config, bool &changed)
+{
+	char buf[256];
+	for (;;) {
+		ssize_t len = ::recv(client.fd, buf, sizeof(buf), MSG_DONTWAIT);
+		if (len == 0)
+			return false;
+		else if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		}
+		client.in.append(buf, len);
+
+		string::size_type end;
+		while ((end = client.in.find('\n')) != string::npos) {
+			string line = client.in.substr(0, end);
+			client.in.erase(0, end + 1);
+			if (line.length() && line.back() == '\r')
+				line.pop_back();
+
+			const string reply = execute(line, config, changed);
+			if (::send(client.fd, reply.data(), reply.length(), MSG_DONTWAIT | MSG_NOSIGNAL) != ssize_t(reply.length()))
+				return false;
+		}
+
+		// Checked on every read, so a client that never sends a newline
+		// can't make us buffer more than this.
+		if (client.in.length() > CONTROL_MAX_LINE) {
+			const string reply = error_reply(MSG_CONTROL_LINE);
+			::send(client.fd, reply.data(), reply.length(), MSG_DONTWAIT | MSG_NOSIGNAL);
+			return false;
+		}
+	}
+}
+
+
+static bool at_end(std::istream &in)
+{
+	in >> std::ws;
+	return in.eof();
+}
+
+
+static bool parse_fan(std::istream &in, const Config &config, int &idx)
+{ return (in >> idx) && idx >= 0 && idx < int(config.fans().size()); }
+
+
+string ControlSocket::execute(const string &line, const Config &config, bool &changed)
+{
+	std::istringstream in(line);
+	std::ostringstream out;
+	string cmd;
+	if (!(in >> cmd))
+		return "";
+
+	if (cmd == "status" && at_end(in)) {
+		out << "bias " << bias_level * 10 << "\n";
+		out << "feedforward " << temp_state.feedforward() << "\n";
+		out << "temps";
+		for (int t : temp_state.get())
+			out << " " << t;
+		out << "\nbiases";
+		for (float b : temp_state.biases())
+			out << " " << b;
+		out << "\n";
+
+		const FanConfig::clock::time_point now = FanConfig::clock::now();
+		for (unsigned int i = 0; i < config.fans().size(); ++i) {
+			const FanConfig *fan_cfg = config.fans()[i];
+			out << "fan " << i << " " << fan_cfg->fan()->path()
+				<< " level " << fan_cfg->cur_lvl_idx()
+				<< " value " << (fan_cfg->continuous() ? fan_cfg->cur_pwm() : fan_cfg->cur_lvl()->num());
+			if (fan_cfg->forced() && fan_cfg->forced_until() > now)
+				out << " forced " << std::chrono::duration_cast<seconds>(fan_cfg->forced_until() - now).count();
+			out << "\n";
+		}
+	}
+	else if (cmd == "bias") {
+		string arg;
+		char *end;
+		if (!(in >> arg) || !at_end(in))
+			return error_reply(MSG_OPT_B);
+		float b = std::strtof(arg.c_str(), &end);
+		if (*end || b < -10 || b > 30)
+			return error_reply(MSG_OPT_B);
+		bias_level = b / 10;
+		log(TF_INF) << MSG_CONTROL_BIAS(arg) << flush;
+		changed = true;
+	}
+	else if (cmd == "force") {
+		int fan_idx, lvl_idx, secs = CONTROL_FORCE_DEFAULT;
+		if (!parse_fan(in, config, fan_idx))
+			return error_reply(MSG_CONTROL_FAN);
+		FanConfig *fan_cfg = config.fans()[fan_idx];
+		if (!(in >> lvl_idx) || lvl_idx < 0 || lvl_idx >= int(fan_cfg->levels().size()))
+			return error_reply(MSG_CONTROL_LEVEL);
+		if (!at_end(in) && (!(in >> secs) || !at_end(in) || secs < 1 || secs > CONTROL_FORCE_MAX))
+			return error_reply(MSG_CONTROL_SECONDS(CONTROL_FORCE_MAX));
+		fan_cfg->force_level(lvl_idx, FanConfig::clock::now() + seconds(secs));
+		log(TF_INF) << MSG_CONTROL_FORCE(fan_cfg->fan()->path(), fan_cfg->levels()[lvl_idx]->str(), secs) << flush;
+		changed = true;
+	}
+	else if (cmd == "release") {
+		int fan_idx = -1;
+		if (!at_end(in) && (!parse_fan(in, config, fan_idx) || !at_end(in)))
+			return error_reply(MSG_CONTROL_FAN);
+		for (unsigned int i = 0; i < config.fans().size(); ++i)
+			if (fan_idx < 0 || int(i) == fan_idx)
+				config.fans()[i]->release();
+		changed = true;
+	}
+	else if (cmd == "reload" && at_end(in))
+		interrupted = SIGHUP;
+	else if (cmd == "reinit" && at_end(in))
+		interrupted = SIGUSR2;
+	else if (cmd == "help" && at_end(in))
+		out << MSG_CONTROL_HELP;
+	else
+		return error_reply(MSG_CONTROL_UNKNOWN);
+
+	out << "ok\n";
+	return out.str();
+}
+
+
+}
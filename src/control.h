@@ -0,0 +1,70 @@
+/********************************************************************
+ * control.h: Queries & overrides through a Unix domain socket.
+ * (C) 2015, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#ifndef THINKFAN_CONTROL_H_
+#define THINKFAN_CONTROL_H_
+
+#include <vector>
+
+#include "thinkfan.h"
+
+namespace thinkfan {
+
+class Config;
+
+
+/* A Unix domain socket that takes one command per line and answers each with
+ * zero or more lines of output, followed by "ok" or "error: ...". The socket
+ * and its clients are on an epoll set of their own, and the EventLoop only
+ * watches that set's fd. So clients are served in between control cycles,
+ * and a slow client can never hold up the control loop. */
+class ControlSocket {
+public:
+	ControlSocket(const string &path);
+	ControlSocket(const ControlSocket &) = delete;
+	~ControlSocket();
+
+	int fd() const { return epoll_fd_; }
+	bool handle(const Config &config);
+
+	ControlSocket &operator = (const ControlSocket &) = delete;
+
+private:
+	struct Client {
+		int fd;
+		string in;
+	};
+
+	void accept_clients();
+	bool serve(Client &client, const Config &config, bool &changed);
+	string execute(const string &line, const Config &config, bool &changed);
+	void drop(unsigned int idx);
+
+	const string path_;
+	int listen_fd_;
+	int epoll_fd_;
+	std::vector<Client> clients_;
+};
+
+
+}
+
+#endif /* THINKFAN_CONTROL_H_ */
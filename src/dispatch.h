@@ -0,0 +1,236 @@
+/********************************************************************
+ * dispatch.h: Calls into drivers, optionally without virtual dispatch.
+ * (C) 2015, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#ifndef THINKFAN_DISPATCH_H_
+#define THINKFAN_DISPATCH_H_
+
+#include <type_traits>
+
+#include "thinkfan.h"
+#include "drivers.h"
+#include "udp.h"
+
+namespace thinkfan {
+
+
+/* A fixed list of driver types, e.g. from STATIC_SENSORS. index() finds the
+ * type of a driver once, and apply() then calls a functor with the driver
+ * cast to that type. Since all drivers are final, the compiler can call
+ * (and inline) them directly instead of going through the vtable. Base may
+ * be const, then so are the drivers that are handed to the functor. */
+template<class Base, class... Drivers> struct DriverList;
+
+template<class Base> struct DriverList<Base> {
+	static int index(const Base &) { return -1; }
+
+	template<class F> static void apply(unsigned int, Base *, F &) {}
+};
+
+template<class Base, class First, class... Rest> struct DriverList<Base, First, Rest...> {
+	typedef typename std::conditional<std::is_const<Base>::value, const First, First>::type Driver;
+
+	static int index(const Base &driver) {
+		if (dynamic_cast<const First *>(&driver))
+			return 0;
+		int rv = DriverList<Base, Rest...>::index(driver);
+		return rv < 0 ? rv : rv + 1;
+	}
+
+	template<class F> static void apply(unsigned int idx, Base *driver, F &f) {
+		if (idx == 0)
+			f(*static_cast<Driver *>(driver));
+		else
+			DriverList<Base, Rest...>::apply(idx - 1, driver, f);
+	}
+};
+
+
+namespace dispatch {
+
+struct ReadTemps {
+	template<class T> void operator () (T &sensor) { sensor.read_temps(); }
+};
+
+struct ReadRequest {
+	int &fd;
+	char *&buf;
+	size_t &size;
+	bool rv;
+	template<class T> void operator () (T &sensor) { rv = sensor.read_request(fd, buf, size); }
+};
+
+struct ReadDone {
+	ssize_t len;
+	template<class T> void operator () (T &sensor) { sensor.read_done(len); }
+};
+
+struct SetSpeed {
+	const Level *level;
+	template<class T> void operator () (T &fan) { fan.set_speed(level); }
+};
+
+struct PingWatchdog {
+	const Level *level;
+	template<class T> void operator () (T &fan) { fan.ping_watchdog_and_depulse(level); }
+};
+
+}
+
+
+#ifdef STATIC_SENSORS
+typedef DriverList<const SensorDriver, STATIC_SENSORS> StaticSensors;
+#endif
+#ifdef STATIC_FANS
+typedef DriverList<FanDriver, STATIC_FANS> StaticFans;
+#endif
+
+
+/* What the control loop calls a sensor through. Without STATIC_SENSORS,
+ * that's just the vtable. */
+class SensorDispatch {
+public:
+	explicit SensorDispatch(const SensorDriver *sensor);
+	static bool supports(const SensorDriver &sensor);
+
+	const SensorDriver *sensor() const { return sensor_; }
+	void read_temps() const;
+	bool read_request(int &fd, char *&buf, size_t &size) const;
+	void read_done(ssize_t len) const;
+
+private:
+	const SensorDriver *sensor_;
+#ifdef STATIC_SENSORS
+	unsigned int type_;
+#endif
+};
+
+
+/* The same for fans, with STATIC_FANS. May be empty while a FanConfig
+ * doesn't have its fan yet. */
+class FanDispatch {
+public:
+	explicit FanDispatch(FanDriver *fan = nullptr);
+	static bool supports(const FanDriver &fan);
+
+	void set_speed(const Level *level) const;
+	void ping_watchdog_and_depulse(const Level *level) const;
+
+private:
+	FanDriver *fan_;
+#ifdef STATIC_FANS
+	unsigned int type_;
+#endif
+};
+
+
+#ifdef STATIC_SENSORS
+
+inline SensorDispatch::SensorDispatch(const SensorDriver *sensor)
+: sensor_(sensor),
+  type_(StaticSensors::index(*sensor))
+{}
+
+inline bool SensorDispatch::supports(const SensorDriver &sensor)
+{ return StaticSensors::index(sensor) >= 0; }
+
+inline void SensorDispatch::read_temps() const
+{
+	dispatch::ReadTemps f;
+	StaticSensors::apply(type_, sensor_, f);
+}
+
+inline bool SensorDispatch::read_request(int &fd, char *&buf, size_t &size) const
+{
+	dispatch::ReadRequest f { fd, buf, size, false };
+	StaticSensors::apply(type_, sensor_, f);
+	return f.rv;
+}
+
+inline void SensorDispatch::read_done(ssize_t len) const
+{
+	dispatch::ReadDone f { len };
+	StaticSensors::apply(type_, sensor_, f);
+}
+
+#else
+
+inline SensorDispatch::SensorDispatch(const SensorDriver *sensor)
+: sensor_(sensor)
+{}
+
+inline bool SensorDispatch::supports(const SensorDriver &)
+{ return true; }
+
+inline void SensorDispatch::read_temps() const
+{ sensor_->read_temps(); }
+
+inline bool SensorDispatch::read_request(int &fd, char *&buf, size_t &size) const
+{ return sensor_->read_request(fd, buf, size); }
+
+inline void SensorDispatch::read_done(ssize_t len) const
+{ sensor_->read_done(len); }
+
+#endif /* STATIC_SENSORS */
+
+
+#ifdef STATIC_FANS
+
+inline FanDispatch::FanDispatch(FanDriver *fan)
+: fan_(fan),
+  type_(fan ? StaticFans::index(*fan) : 0)
+{}
+
+inline bool FanDispatch::supports(const FanDriver &fan)
+{ return StaticFans::index(fan) >= 0; }
+
+inline void FanDispatch::set_speed(const Level *level) const
+{
+	dispatch::SetSpeed f { level };
+	StaticFans::apply(type_, fan_, f);
+}
+
+inline void FanDispatch::ping_watchdog_and_depulse(const Level *level) const
+{
+	dispatch::PingWatchdog f { level };
+	StaticFans::apply(type_, fan_, f);
+}
+
+#else
+
+inline FanDispatch::FanDispatch(FanDriver *fan)
+: fan_(fan)
+{}
+
+inline bool FanDispatch::supports(const FanDriver &)
+{ return true; }
+
+inline void FanDispatch::set_speed(const Level *level) const
+{ fan_->set_speed(level); }
+
+inline void FanDispatch::ping_watchdog_and_depulse(const Level *level) const
+{ fan_->ping_watchdog_and_depulse(level); }
+
+#endif /* STATIC_FANS */
+
+
+}
+
+#endif /* THINKFAN_DISPATCH_H_ */
@@ -23,44 +23,224 @@
 #include "drivers.h"
 #include "message.h"
 #include "config.h"
+#include "probes.h"
 
 #include <fstream>
 #include <cstring>
+#include <cstdio>
+#include <limits>
 #include <thread>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
 
 #ifdef USE_NVML
 #include <dlfcn.h>
 #endif
 
+#ifdef USE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
 namespace thinkfan {
 
 
+/*----------------------------------------------------------------------------
+| AttributeFile: A sysfs/procfs attribute that is opened once and then kept  |
+| open. Every access goes to offset 0 so the kernel regenerates the content. |
+| If the device went away (e.g. after suspend or an hwmon rebind), the file  |
+| is reopened once before an error is returned.                              |
+----------------------------------------------------------------------------*/
+
+AttributeFile::~AttributeFile()
+{ close(); }
+
+
+bool AttributeFile::open(const string &path, int flags)
+{
+	close();
+	path_ = path;
+	flags_ = flags;
+	fd_ = ::open(path_.c_str(), flags_ | O_CLOEXEC);
+	return fd_ >= 0;
+}
+
+
+void AttributeFile::close() const
+{
+	if (fd_ >= 0) {
+		int err = errno;
+		::close(fd_);
+		errno = err;
+	}
+	fd_ = -1;
+}
+
+
+bool AttributeFile::reopen() const
+{
+	close();
+	fd_ = ::open(path_.c_str(), flags_ | O_CLOEXEC);
+	return fd_ >= 0;
+}
+
+
+ssize_t AttributeFile::read(char *buf, size_t count) const
+{
+	ssize_t rv = ::pread(fd_, buf, count, 0);
+	if (unlikely(rv < 0 && (errno == ENODEV || errno == ESTALE)) && reopen())
+		rv = ::pread(fd_, buf, count, 0);
+	return rv;
+}
+
+
+ssize_t AttributeFile::write(const char *buf, size_t count) const
+{
+	ssize_t rv = ::pwrite(fd_, buf, count, 0);
+	if (unlikely(rv < 0 && (errno == ENODEV || errno == ESTALE)) && reopen())
+		rv = ::pwrite(fd_, buf, count, 0);
+	return rv;
+}
+
+
+/*----------------------------------------------------------------------------
+| IntScanner: Decodes whitespace-separated decimal integers from a text      |
+| buffer in the manner of std::from_chars, i.e. without allocating memory    |
+| and without exceptions. Used to parse the contents of sensor attributes.   |
+----------------------------------------------------------------------------*/
+
+void IntScanner::skip_space()
+{
+	while (pos_ < end_ && (*pos_ == ' ' || *pos_ == '\t' || *pos_ == '\n' || *pos_ == '\r'))
+		++pos_;
+}
+
+
+bool IntScanner::skip(const string &prefix)
+{
+	skip_space();
+	if (size_t(end_ - pos_) < prefix.length() || prefix.compare(0, string::npos, pos_, prefix.length()))
+		return false;
+	pos_ += prefix.length();
+	return true;
+}
+
+
+/* Returns the end of the number, or nullptr if there is none or if its
+ * magnitude exceeds max. Doesn't consume anything. */
+const char *IntScanner::scan(long long &value, long long max)
+{
+	skip_space();
+	const char *p = pos_;
+	bool neg = false;
+	if (p < end_ && (*p == '-' || *p == '+'))
+		neg = *p++ == '-';
+	if (p == end_ || *p < '0' || *p > '9')
+		return nullptr;
+
+	long long v = 0;
+	while (p < end_ && *p >= '0' && *p <= '9') {
+		if (unlikely(v > (max - (*p - '0')) / 10))
+			return nullptr;
+		v = v * 10 + (*p++ - '0');
+	}
+	if (p < end_ && !(*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+		return nullptr;
+
+	value = neg ? -v : v;
+	return p;
+}
+
+
+bool IntScanner::next(int &value)
+{
+	long long v;
+	const char *p = scan(v, std::numeric_limits<int>::max());
+	if (!p)
+		return false;
+	value = static_cast<int>(v);
+	pos_ = p;
+	return true;
+}
+
+
+bool IntScanner::next(long long &value)
+{
+	const char *p = scan(value, std::numeric_limits<long long>::max());
+	if (!p)
+		return false;
+	pos_ = p;
+	return true;
+}
+
+
+bool IntScanner::done()
+{
+	skip_space();
+	return pos_ == end_;
+}
+
+
 /*----------------------------------------------------------------------------
 | FanDriver: Superclass of TpFanDriver and HwmonFanDriver. Can set the speed |
 | on its own since an implementation-specific string representation is       |
-| provided by its subclasses.                                                |
+| provided by its subclasses. Remembers the last value written, so setting   |
+| the same speed again doesn't cost another (possibly slow) write. If asked  |
+| to verify, a subclass reads back the state of the fan when it would skip a |
+| write, and writes again only if the hardware has drifted off that value.   |
 ----------------------------------------------------------------------------*/
 
 FanDriver::FanDriver(const std::string &path, const unsigned int watchdog_timeout)
 : path_(path),
   watchdog_(watchdog_timeout),
-  depulse_(0)
-{}
+  depulse_(0),
+  verify_(false)
+{
+	// Room for any level string, so remembering it doesn't allocate
+	written_.reserve(32);
+	if (!file_.open(path_, O_WRONLY)) {
+		int err = errno;
+		if (err == EACCES || err == EPERM)
+			throw SystemError(MSG_FAN_EPERM(path_));
+		else
+			throw IOerror(MSG_FAN_INIT(path_), err);
+	}
+}
 
 
-void FanDriver::set_speed(const string &level)
+void FanDriver::write(const string &value)
 {
-	std::ofstream f_out(path_);
-	try {
-		f_out.exceptions(f_out.failbit | f_out.badbit);
-		f_out << level << std::flush;
-	} catch (std::ios_base::failure &e) {
+	if (unlikely(file_.write(value.data(), value.length()) < 0)) {
 		int err = errno;
-		if (err == EPERM)
+		if (err == EPERM || err == EACCES)
 			throw SystemError(MSG_FAN_EPERM(path_));
 		else
-			throw IOerror(MSG_FAN_CTRL(level, path_), err);
+			throw IOerror(MSG_FAN_CTRL(value, path_), err);
 	}
+	// Copy rather than share the representation, see reserve() above
+	written_.assign(value.data(), value.length());
+	last_write_ = clock::now();
+}
+
+
+void FanDriver::set_speed(const string &level)
+{
+	if (level != written_)
+		write(level);
+}
+
+
+/* The hardware has lost what we wrote (e.g. the firmware has taken over
+ * after a resume), so it needs to be initialized again, too. */
+void FanDriver::reassert()
+{
+	const string value(written_);
+	log(TF_WRN) << MSG_FAN_DRIFT(path_, value) << flush;
+	init();
+	write(value);
 }
 
 
@@ -100,13 +280,9 @@ TpFanDriver::TpFanDriver(const std::string &path)
 
 TpFanDriver::~TpFanDriver()
 {
-	std::ofstream f(path_);
-	try {
-		f.exceptions(f.failbit | f.badbit);
-		f << "level " << initial_state_ << std::flush;
-	} catch (std::ios_base::failure &e) {
+	string level = "level " + initial_state_;
+	if (file_.write(level.data(), level.length()) < 0)
 		throw IOerror(MSG_FAN_RESET(path_), errno);
-	}
 }
 
 
@@ -118,34 +294,77 @@ void TpFanDriver::set_depulse(float duration)
 { depulse_ = std::chrono::duration<float>(duration); }
 
 
+void TpFanDriver::set_verify(bool verify)
+{
+	if (verify && !readback_.open(path_, O_RDONLY))
+		throw IOerror(MSG_FAN_INIT(path_), errno);
+	FanDriver::set_verify(verify);
+}
+
+
 void TpFanDriver::set_speed(const Level *level)
 {
+	TF_PROBE2(fan__set__start, path_.c_str(), level->str().c_str());
+	auto end = probe_end([this] { TF_PROBE1(fan__set__end, path_.c_str()); });
 	FanDriver::set_speed(level->str());
-	last_watchdog_ping_ = std::chrono::system_clock::now();
 }
 
 
 void TpFanDriver::ping_watchdog_and_depulse(const Level *level)
 {
+	static const string disengaged("level disengaged");
+
 	if (depulse_ > std::chrono::milliseconds(0)) {
-		FanDriver::set_speed("level disengaged");
+		write(disengaged);
 		std::this_thread::sleep_for(depulse_);
-		set_speed(level);
+		write(level->str());
 	}
-	else if (last_watchdog_ping_ + watchdog_ + sleeptime >= std::chrono::system_clock::now())
-		set_speed(level);
+	// There's at most one sleeptime until the next ping, so only write when
+	// the watchdog would expire before the one after that.
+	else if (clock::now() + 2 * sleeptime >= last_write_ + watchdog_)
+		write(level->str());
+	else if (verify_ && unlikely(drifted()))
+		reassert();
 }
 
 
-void TpFanDriver::init() const
+void TpFanDriver::init()
 {
-	std::fstream f(path_);
-	try {
-		f.exceptions(f.failbit | f.badbit);
-		f << "watchdog " << watchdog_.count() << std::flush;
-	} catch (std::ios_base::failure &e) {
+	FanDriver::init();
+	string cmd = "watchdog " + std::to_string(watchdog_.count());
+	if (file_.write(cmd.data(), cmd.length()) < 0)
 		throw IOerror(MSG_FAN_INIT(path_), errno);
-	}
+}
+
+
+/* Compares the level: line, e.g. "level:\t\tauto", with the last write, e.g.
+ * "level auto". Note that the firmware reports full-speed as disengaged. */
+bool TpFanDriver::drifted()
+{
+	static const string level_cmd("level ");
+	static const string level_line("\nlevel:");
+	static const string full_speed("full-speed");
+	static const string disengaged("disengaged");
+
+	ssize_t len = readback_.read(buf_, sizeof(buf_) - 1);
+	if (unlikely(len < 0))
+		throw IOerror(MSG_FAN_READBACK(path_), errno);
+	buf_[len] = 0;
+
+	const char *p = std::strstr(buf_, level_line.c_str());
+	if (!p || written_.compare(0, level_cmd.length(), level_cmd))
+		return false;
+	p += level_line.length();
+	while (*p == ' ' || *p == '\t')
+		++p;
+	const char *end = p;
+	while (*end && *end != '\n' && *end != ' ' && *end != '\t')
+		++end;
+
+	const char *expected = written_.c_str() + level_cmd.length();
+	if (!full_speed.compare(expected))
+		expected = disengaged.c_str();
+	return std::strlen(expected) != size_t(end - p) || std::strncmp(expected, p, end - p);
 }
 
 
@@ -154,15 +373,14 @@ void TpFanDriver::init() const
 ----------------------------------------------------------------------------*/
 
 HwmonFanDriver::HwmonFanDriver(const std::string &path)
-: FanDriver(path, 0)
+: FanDriver(path, 0),
+  expected_pwm_(-1)
 {
+	pwm_s_.reserve(8);
 	std::ifstream f(path_ + "_enable");
 	try {
 		f.exceptions(f.failbit | f.badbit);
-		std::string line;
-		line.resize(64);
-		f.getline(&*line.begin(), 63);
-		initial_state_ = line;
+		std::getline(f, initial_state_);
 	} catch (std::ios_base::failure &e) {
 		throw IOerror(MSG_FAN_INIT(path_), errno);
 	}
@@ -181,8 +399,17 @@ HwmonFanDriver::~HwmonFanDriver()
 }
 
 
-void HwmonFanDriver::init() const
+void HwmonFanDriver::set_verify(bool verify)
 {
+	if (verify && !(readback_.open(path_, O_RDONLY) && enable_.open(path_ + "_enable", O_RDONLY)))
+		throw IOerror(MSG_FAN_INIT(path_), errno);
+	FanDriver::set_verify(verify);
+}
+
+
+void HwmonFanDriver::init()
+{
+	FanDriver::init();
 	std::ofstream f(path_ + "_enable");
 	try {
 		f.exceptions(f.failbit | f.badbit);
@@ -195,20 +422,78 @@ void HwmonFanDriver::init() const
 
 void HwmonFanDriver::set_speed(const Level *level)
 {
+	TF_PROBE2(fan__set__start, path_.c_str(), level->num_str().c_str());
+	auto end = probe_end([this] { TF_PROBE1(fan__set__end, path_.c_str()); });
+	write_pwm(level->num_str());
+}
+
+
+/* For continuous control, which writes arbitrary PWM values. pwm_s_ has room
+ * for any of them, so formatting doesn't allocate. */
+void HwmonFanDriver::set_pwm(int pwm)
+{
+	char buf[8];
+	int len = snprintf(buf, sizeof(buf), "%d", pwm);
+	pwm_s_.assign(buf, std::min<int>(len, sizeof(buf) - 1));
+	TF_PROBE2(fan__set__start, path_.c_str(), pwm_s_.c_str());
+	auto end = probe_end([this] { TF_PROBE1(fan__set__end, path_.c_str()); });
+	write_pwm(pwm_s_);
+}
+
+
+void HwmonFanDriver::write_pwm(const string &value)
+{
+	if (value == written_)
+		return;
 	try {
-		FanDriver::set_speed(std::to_string(level->num()));
+		write(value);
 	} catch (IOerror &e) {
 		if (e.code() == EINVAL) {
 			// This happens when the hwmon kernel driver is reset to automatic control
 			// e.g. after the system has woken up from suspend.
 			// In that case, we need to re-initialize and try once more.
 			init();
-			FanDriver::set_speed(std::to_string(level->num()));
+			write(value);
 			log(TF_DBG) << "It seems we woke up from suspend. PWM fan driver had to be re-initialized." << flush;
 		} else {
 			throw;
 		}
 	}
+	// Many drivers round the PWM value, so what they report back after this
+	// write is what we'll expect from now on.
+	expected_pwm_ = -1;
+}
+
+
+/* A PWM fan has no watchdog, but it may still drift when its driver or the
+ * firmware takes over again. */
+void HwmonFanDriver::ping_watchdog_and_depulse(const Level *)
+{
+	if (verify_ && written_.length() && unlikely(drifted()))
+		reassert();
+}
+
+
+bool HwmonFanDriver::read_int(const AttributeFile &file, int &value)
+{
+	ssize_t len = file.read(buf_, sizeof(buf_));
+	if (unlikely(len < 0))
+		throw IOerror(MSG_FAN_READBACK(path_), errno);
+	IntScanner scanner(buf_, buf_ + len);
+	return scanner.next(value);
+}
+
+
+bool HwmonFanDriver::drifted()
+{
+	int enable, pwm;
+	if (read_int(enable_, enable) && enable != 1)
+		return true;
+	if (!read_int(readback_, pwm))
+		return false;
+	if (expected_pwm_ < 0)
+		expected_pwm_ = pwm;
+	return pwm != expected_pwm_;
 }
 
 
@@ -218,15 +503,14 @@ void HwmonFanDriver::set_speed(const Level *level)
 
 SensorDriver::SensorDriver(std::string path)
 : path_(path),
-  num_temps_(0)
-{
-	std::ifstream f(path_);
-	try {
-		f.exceptions(f.failbit | f.badbit);
-	} catch (std::ios_base::failure &e) {
-		throw IOerror(MSG_FAN_INIT(path_), errno);
-	}
-}
+  outdated_(false),
+  stuck_(false),
+  num_temps_(0),
+  poll_interval_(0),
+  timeout_(0),
+  trend_(TemperatureState::TREND_JUMP),
+  horizon_(0)
+{}
 
 
 void SensorDriver::set_correction(const std::vector<int> &correction)
@@ -236,6 +520,7 @@ void SensorDriver::set_correction(const std::vector<int> &correction)
 	else if (correction.size() < num_temps())
 		log(TF_WRN) << MSG_CONF_CORRECTION_LEN(path_, correction.size(), num_temps_) << flush;
 	correction_ = correction;
+	correction_.resize(num_temps_, 0);
 }
 
 
@@ -243,6 +528,29 @@ void SensorDriver::set_num_temps(unsigned int n)
 {
 	num_temps_ = n;
 	correction_.resize(n, 0);
+	temps_.resize(n, 0);
+}
+
+
+/* buf holds len bytes read into a buffer of size bytes. A full buffer means
+ * that the file may well go on, so it's rejected rather than misparsed. */
+void SensorDriver::scan_temps(const char *buf, ssize_t len, size_t size, int divisor) const
+{
+	if (unlikely(len < 0))
+		throw IOerror(MSG_T_GET(path_), errno);
+	if (unlikely(size_t(len) >= size))
+		throw SyntaxError(path_, size_t(len), string(buf, size_t(len)), MSG_T_OVERLONG(size));
+
+	IntScanner scanner(buf, buf + len);
+	unsigned int tidx = 0;
+	int tmp;
+	for (; tidx < num_temps_ && scanner.next(tmp); ++tidx)
+		temps_[tidx] = tmp / divisor + correction_[tidx];
+
+	if (unlikely(tidx < num_temps_))
+		throw SyntaxError(path_, scanner.pos() - buf, string(buf, size_t(len)), MSG_T_FORMAT(tidx, num_temps_));
+	if (unlikely(!scanner.done()))
+		throw SyntaxError(path_, scanner.pos() - buf, string(buf, size_t(len)), MSG_T_GARBAGE);
 }
 
 
@@ -253,20 +561,50 @@ void SensorDriver::set_num_temps(unsigned int n)
 
 HwmonSensorDriver::HwmonSensorDriver(std::string path)
 : SensorDriver(path)
-{ set_num_temps(1); }
+{
+	if (!file_.open(path_, O_RDONLY))
+		throw IOerror(MSG_SENSOR_INIT(path_), errno);
+	set_num_temps(1);
+}
 
 
 void HwmonSensorDriver::read_temps() const
+{ scan_temps(buf_, file_.read(buf_, sizeof(buf_)), sizeof(buf_), 1000); }
+
+
+bool HwmonSensorDriver::read_request(int &fd, char *&buf, size_t &size) const
 {
-	std::ifstream f(path_);
-	try {
-		f.exceptions(f.failbit | f.badbit);
-		int tmp;
-		f >> tmp;
-		temp_state.add_temp(tmp/1000 + correction_[0]);
-	} catch (std::ios_base::failure &e) {
-		throw IOerror(MSG_T_GET(path_), errno);
+	fd = file_.fd();
+	buf = buf_;
+	size = sizeof(buf_);
+	return fd >= 0;
+}
+
+
+void HwmonSensorDriver::read_done(ssize_t len) const
+{
+	if (unlikely(len < 0)) {
+		errno = -len;
+		// Let the AttributeFile reopen it
+		if (errno == ENODEV || errno == ESTALE)
+			return read_temps();
 	}
+	scan_temps(buf_, len, sizeof(buf_), 1000);
+}
+
+
+/* The alarm attributes that belong to a tempN_input file, as far as the hwmon
+ * sysfs ABI defines them. Only the ones that actually exist can be watched,
+ * and only the ones whose driver calls sysfs_notify() will ever fire. */
+std::vector<string> HwmonSensorDriver::alarm_files() const
+{
+	static const string suffix("_input");
+	if (path_.length() <= suffix.length()
+			|| path_.compare(path_.length() - suffix.length(), suffix.length(), suffix))
+		return {};
+
+	const string base = path_.substr(0, path_.length() - suffix.length());
+	return { base + "_alarm", base + "_max_alarm", base + "_crit_alarm", base + "_emergency_alarm" };
 }
 
 
@@ -280,131 +618,638 @@ const string TpSensorDriver::skip_prefix_("temperatures:");
 TpSensorDriver::TpSensorDriver(std::string path)
 : SensorDriver(path)
 {
-	std::ifstream f(path_);
-	try {
-		f.exceptions(f.failbit | f.badbit);
-		int tmp;
-		unsigned int count = 0;
+	if (!file_.open(path_, O_RDONLY))
+		throw IOerror(MSG_SENSOR_INIT(path_), errno);
 
-		string skip;
-		skip.resize(skip_prefix_.size());
+	ssize_t len = file_.read(buf_, sizeof(buf_));
+	if (len < 0)
+		throw IOerror(MSG_SENSOR_INIT(path_), errno);
+	const string input(buf_, size_t(len));
+	if (size_t(len) >= sizeof(buf_))
+		throw SyntaxError(path_, input.length(), input, MSG_T_OVERLONG(sizeof(buf_)));
+
+	IntScanner scanner(buf_, buf_ + len);
+	if (!scanner.skip(skip_prefix_))
+		throw SyntaxError(path_, scanner.pos() - buf_, input, MSG_T_TP_FORMAT);
+	skip_bytes_ = scanner.pos() - buf_;
+
+	unsigned int count = 0;
+	int tmp;
+	while (scanner.next(tmp))
+		++count;
+	if (!scanner.done())
+		throw SyntaxError(path_, scanner.pos() - buf_, input, MSG_T_TP_FORMAT);
+	set_num_temps(count);
+}
 
-		f.exceptions(f.badbit);
-		f.getline(&*skip.begin(), skip_prefix_.size()+1);
-		f.clear(f.rdstate() & ~f.failbit);
 
-		if (skip == skip_prefix_)
-			skip_bytes_ = f.tellg();
-		else
-			throw SystemError(path_ + ": Unknown file format.");
+void TpSensorDriver::read_temps() const
+{ parse(file_.read(buf_, sizeof(buf_))); }
 
-		while (!(f.eof() || f.fail())) {
-			f >> tmp;
-			if (!f.fail())
-				++count;
-		}
-		set_num_temps(count);
-	} catch (std::ios_base::failure &e) {
-		throw IOerror(MSG_SENSOR_INIT(path_), errno);
+
+bool TpSensorDriver::read_request(int &fd, char *&buf, size_t &size) const
+{
+	fd = file_.fd();
+	buf = buf_;
+	size = sizeof(buf_);
+	return fd >= 0;
+}
+
+
+void TpSensorDriver::read_done(ssize_t len) const
+{
+	if (unlikely(len < 0)) {
+		errno = -len;
+		if (errno == ENODEV || errno == ESTALE)
+			return read_temps();
 	}
+	parse(len);
 }
 
 
-void TpSensorDriver::read_temps() const
+void TpSensorDriver::parse(ssize_t len) const
 {
-	std::ifstream f(path_);
-	try {
-		f.exceptions(f.failbit | f.badbit);
-		f.seekg(skip_bytes_);
+	if (likely(len >= skip_bytes_))
+		scan_temps(buf_ + skip_bytes_, len - skip_bytes_, sizeof(buf_) - skip_bytes_);
+	else
+		scan_temps(buf_, len, sizeof(buf_));
+}
 
-		f.exceptions(f.badbit);
-		unsigned int tidx = 0;
-		int tmp;
-		while (!f.eof()) {
-			f >> tmp;
-			if (!f.fail())
-				temp_state.add_temp(tmp + correction_[tidx++]);
+
+#ifdef USE_IO_URING
+/*----------------------------------------------------------------------------
+| UringBatch: Drives an io_uring through the raw syscalls, so we don't need  |
+| liburing. All sensors get a slot in the registered file table and in the   |
+| registered buffers, both indexed by their position in the batch. If a      |
+| sensor's file has been reopened in the meantime, its slot is updated with  |
+| the new descriptor before the read is queued.                              |
+----------------------------------------------------------------------------*/
+
+static int uring_setup(unsigned int entries, struct io_uring_params *p)
+{ return int(::syscall(__NR_io_uring_setup, entries, p)); }
+
+static int uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{ return int(::syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, nullptr, 0)); }
+
+static int uring_register(int fd, unsigned int opcode, const void *arg, unsigned int nr_args)
+{ return int(::syscall(__NR_io_uring_register, fd, opcode, arg, nr_args)); }
+
+
+std::unique_ptr<UringBatch> UringBatch::make(const std::vector<const SensorDriver *> &sensors)
+{
+	std::unique_ptr<UringBatch> rv(new UringBatch(sensors));
+	if (!rv->setup()) {
+		string msg = std::strerror(errno);
+		log(TF_INF) << MSG_URING_UNAVAILABLE(msg) << flush;
+		rv.reset();
+	}
+	return rv;
+}
+
+
+UringBatch::UringBatch(const std::vector<const SensorDriver *> &sensors)
+: ring_fd_(-1),
+  entries_(0),
+  sq_ring_(nullptr),
+  sq_ring_size_(0),
+  cq_ring_(nullptr),
+  cq_ring_size_(0),
+  sqes_(nullptr),
+  sqes_size_(0),
+  sq_tail_(nullptr), sq_mask_(nullptr), sq_array_(nullptr),
+  cq_head_(nullptr), cq_tail_(nullptr), cq_mask_(nullptr),
+  cqes_(nullptr),
+  fixed_files_(false),
+  fixed_buffers_(false),
+  sensors_(sensors),
+  fds_(sensors.size(), -1),
+  bufs_(sensors.size(), nullptr),
+  sizes_(sensors.size(), 0),
+  results_(sensors.size(), 0)
+{
+	queued_.reserve(sensors.size());
+	for (unsigned int i = 0; i < sensors_.size(); ++i)
+		sensors_[i]->read_request(fds_[i], bufs_[i], sizes_[i]);
+}
+
+
+UringBatch::~UringBatch()
+{
+	if (sqes_)
+		::munmap(sqes_, sqes_size_);
+	if (cq_ring_ && cq_ring_ != sq_ring_)
+		::munmap(cq_ring_, cq_ring_size_);
+	if (sq_ring_)
+		::munmap(sq_ring_, sq_ring_size_);
+	if (ring_fd_ >= 0)
+		::close(ring_fd_);
+}
+
+
+bool UringBatch::setup()
+{
+	struct io_uring_params params;
+	std::memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CLAMP;
+	if ((ring_fd_ = uring_setup(unsigned(sensors_.size()), &params)) < 0)
+		return false;
+	entries_ = params.sq_entries;
+
+	// IORING_OP_READ needs Linux 5.6, which is also where probing started.
+	std::vector<char> probe_buf(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+	io_uring_probe *probe = reinterpret_cast<io_uring_probe *>(probe_buf.data());
+	if (uring_register(ring_fd_, IORING_REGISTER_PROBE, probe, 256) < 0)
+		return false;
+	if (probe->last_op < IORING_OP_READ || !(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED)) {
+		errno = ENOSYS;
+		return false;
+	}
+
+	sq_ring_size_ = params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+	cq_ring_size_ = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+
+	void *map = ::mmap(nullptr, sq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring_fd_, IORING_OFF_SQ_RING);
+	if (map == MAP_FAILED)
+		return false;
+	sq_ring_ = map;
+
+	if (params.features & IORING_FEAT_SINGLE_MMAP)
+		cq_ring_ = sq_ring_;
+	else {
+		map = ::mmap(nullptr, cq_ring_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				ring_fd_, IORING_OFF_CQ_RING);
+		if (map == MAP_FAILED)
+			return false;
+		cq_ring_ = map;
+	}
+
+	sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+	map = ::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ring_fd_, IORING_OFF_SQES);
+	if (map == MAP_FAILED)
+		return false;
+	sqes_ = static_cast<io_uring_sqe *>(map);
+
+	char *sq = static_cast<char *>(sq_ring_);
+	char *cq = static_cast<char *>(cq_ring_);
+	sq_tail_ = reinterpret_cast<unsigned int *>(sq + params.sq_off.tail);
+	sq_mask_ = reinterpret_cast<unsigned int *>(sq + params.sq_off.ring_mask);
+	sq_array_ = reinterpret_cast<unsigned int *>(sq + params.sq_off.array);
+	cq_head_ = reinterpret_cast<unsigned int *>(cq + params.cq_off.head);
+	cq_tail_ = reinterpret_cast<unsigned int *>(cq + params.cq_off.tail);
+	cq_mask_ = reinterpret_cast<unsigned int *>(cq + params.cq_off.ring_mask);
+	cqes_ = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+
+	// Both registrations are optional. Plain reads on plain descriptors are
+	// still batched, they just cost a bit more inside the kernel.
+	fixed_files_ = uring_register(ring_fd_, IORING_REGISTER_FILES,
+			fds_.data(), unsigned(fds_.size())) == 0;
+
+	std::vector<struct iovec> iov(bufs_.size());
+	for (unsigned int i = 0; i < bufs_.size(); ++i) {
+		iov[i].iov_base = bufs_[i];
+		iov[i].iov_len = sizes_[i];
+	}
+	fixed_buffers_ = uring_register(ring_fd_, IORING_REGISTER_BUFFERS,
+			iov.data(), unsigned(iov.size())) == 0;
+
+	return true;
+}
+
+
+void UringBatch::update_file(unsigned int idx, int fd)
+{
+	if (fixed_files_) {
+		struct io_uring_files_update update;
+		std::memset(&update, 0, sizeof(update));
+		update.offset = idx;
+		update.fds = reinterpret_cast<uintptr_t>(&fd);
+		// Without the registered file table, all reads take the slow path.
+		if (uring_register(ring_fd_, IORING_REGISTER_FILES_UPDATE, &update, 1) != 1)
+			fixed_files_ = false;
+	}
+	fds_[idx] = fd;
+}
+
+
+/* fd is what the sensor's read_request() returns now, which the caller has
+ * made through its SensorDispatch. It changes when the file was reopened. */
+void UringBatch::add(unsigned int idx, int fd)
+{
+	if (unlikely(fd != fds_[idx]))
+		update_file(idx, fd);
+	queued_.push_back(idx);
+}
+
+
+/* Submits all queued reads, at most one ring's worth per io_uring_enter(), and
+ * waits for them in the same syscall. Returns false if the ring itself fails,
+ * in which case no result is valid. */
+bool UringBatch::submit()
+{
+	size_t next = 0;
+	while (next < queued_.size()) {
+		const unsigned int n = unsigned(std::min<size_t>(queued_.size() - next, entries_));
+
+		unsigned int tail = *sq_tail_;
+		for (unsigned int i = 0; i < n; ++i, ++tail) {
+			const unsigned int idx = queued_[next + i];
+			const unsigned int slot = tail & *sq_mask_;
+			io_uring_sqe &sqe = sqes_[slot];
+			std::memset(&sqe, 0, sizeof(sqe));
+			sqe.opcode = fixed_buffers_ ? IORING_OP_READ_FIXED : IORING_OP_READ;
+			sqe.flags = fixed_files_ ? IOSQE_FIXED_FILE : 0;
+			sqe.fd = fixed_files_ ? int(idx) : fds_[idx];
+			sqe.addr = reinterpret_cast<uintptr_t>(bufs_[idx]);
+			sqe.len = unsigned(sizes_[idx]);
+			sqe.off = 0;
+			sqe.buf_index = fixed_buffers_ ? idx : 0;
+			sqe.user_data = idx;
+			sq_array_[slot] = slot;
 		}
-	} catch (std::ios_base::failure &e) {
-		throw IOerror(MSG_T_GET(path_), errno);
+		__atomic_store_n(sq_tail_, tail, __ATOMIC_RELEASE);
+
+		unsigned int to_submit = n;
+		unsigned int reaped = 0;
+		while (reaped < n) {
+			int rv = uring_enter(ring_fd_, to_submit, n - reaped, IORING_ENTER_GETEVENTS);
+			if (unlikely(rv < 0)) {
+				if (errno == EINTR)
+					continue;
+				return false;
+			}
+			to_submit -= std::min(unsigned(rv), to_submit);
+
+			unsigned int head = *cq_head_;
+			const unsigned int cq_tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+			for (; head != cq_tail; ++head, ++reaped) {
+				const io_uring_cqe &cqe = cqes_[head & *cq_mask_];
+				const unsigned int idx = unsigned(cqe.user_data);
+				results_[idx] = cqe.res;
+				// The registered file is the old one, so register the reopened
+				// file next time, even if it got the same descriptor.
+				if (unlikely(cqe.res == -ENODEV || cqe.res == -ESTALE))
+					fds_[idx] = -1;
+			}
+			__atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+		}
+		next += n;
 	}
+	return true;
+}
+#endif /* USE_IO_URING */
+
+
+/*----------------------------------------------------------------------------
+| LoadDriver: The superclass of all utilization sources. They aren't         |
+| sensors, i.e. they add no temperatures and aren't read by the poller.      |
+| Instead, the highest load times its gain becomes the feedforward that is   |
+| added to all temperatures in each cycle.                                   |
+----------------------------------------------------------------------------*/
+
+LoadDriver::LoadDriver(const string &path)
+: path_(path),
+  gain_(0)
+{}
+
+
+/*----------------------------------------------------------------------------
+| CpuLoadDriver: The CPU utilization over all CPUs since the last reading,   |
+| from the first line of /proc/stat (the kernel renders the whole file on    |
+| each read, but we only need to copy out the beginning).                    |
+----------------------------------------------------------------------------*/
+
+static const string PROC_STAT_CPU("cpu ");
+
+CpuLoadDriver::CpuLoadDriver(const string &path)
+: LoadDriver(path),
+  busy_(0),
+  total_(0),
+  load_(0)
+{
+	if (!file_.open(path_, O_RDONLY))
+		throw IOerror(MSG_LOAD_INIT(path_), errno);
+	if (!read_jiffies(busy_, total_))
+		throw SystemError(MSG_LOAD_FORMAT(path_));
+}
+
+
+/* cpu user nice system idle iowait irq softirq steal [guest guest_nice]
+ * The guest times are already included in user & nice. */
+bool CpuLoadDriver::read_jiffies(long long &busy, long long &total)
+{
+	ssize_t len = file_.read(buf_, sizeof(buf_));
+	if (unlikely(len < 0))
+		throw IOerror(MSG_LOAD_GET(path_), errno);
+
+	IntScanner scanner(buf_, buf_ + len);
+	if (!scanner.skip(PROC_STAT_CPU))
+		return false;
+
+	long long v;
+	busy = total = 0;
+	for (unsigned int i = 0; i < 8 && scanner.next(v); ++i) {
+		total += v;
+		if (i != 3 && i != 4)
+			busy += v;
+	}
+	return total > 0;
+}
+
+
+float CpuLoadDriver::read_load()
+{
+	long long busy, total;
+	if (unlikely(!read_jiffies(busy, total)))
+		throw SystemError(MSG_LOAD_FORMAT(path_));
+
+	// Less than a jiffy since the last reading: Nothing new to tell
+	if (total > total_) {
+		load_ = float(busy - busy_) / float(total - total_);
+		busy_ = busy;
+		total_ = total;
+	}
+	return load_;
 }
 
 
 #ifdef USE_ATASMART
 /*----------------------------------------------------------------------------
-| AtssmartSensorDriver: Reads temperatures from hard disks using S.M.A.R.T.  |
-| via device files like /dev/sda.                                            |
+| SmartRefresher: Reads S.M.A.R.T data of all AtasmartSensorDrivers in a     |
+| background thread, since that's slow and may block for a long time. Disks  |
+| are refreshed one at a time, and never within MIN_GAP of each other, so    |
+| they don't all hit the SATA bus at once. Each disk is refreshed according  |
+| to its poll interval (60 seconds by default). There is only one refresher  |
+| per process, and it stops when the last disk is gone.                      |
+----------------------------------------------------------------------------*/
+
+static const secondsf SMART_DEFAULT_INTERVAL(60);
+static const std::chrono::seconds SMART_MIN_GAP(1);
+
+std::weak_ptr<SmartRefresher> SmartRefresher::instance_;
+std::mutex SmartRefresher::instance_mutex_;
+
+
+std::shared_ptr<SmartRefresher> SmartRefresher::get()
+{
+	// Disks are initialized concurrently
+	std::lock_guard<std::mutex> lock(instance_mutex_);
+	std::shared_ptr<SmartRefresher> rv = instance_.lock();
+	if (!rv) {
+		rv.reset(new SmartRefresher());
+		instance_ = rv;
+	}
+	return rv;
+}
+
+
+SmartRefresher::SmartRefresher()
+: busy_(nullptr),
+  stop_(false),
+  thread_(&SmartRefresher::run, this)
+{}
+
+
+SmartRefresher::~SmartRefresher()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stop_ = true;
+	}
+	cv_.notify_all();
+	thread_.join();
+}
+
+
+void SmartRefresher::add(AtasmartSensorDriver *disk)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	// The disk has just been read. Disks that are added together are
+	// staggered by MIN_GAP.
+	disks_.push_back({ disk, clock::now() + disks_.size() * SMART_MIN_GAP });
+	cv_.notify_all();
+}
+
+
+void SmartRefresher::remove(AtasmartSensorDriver *disk)
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+	for (std::vector<Entry>::iterator it = disks_.begin(); it != disks_.end(); ++it) {
+		if (it->disk == disk) {
+			disks_.erase(it);
+			break;
+		}
+	}
+
+	// Only a refresh of this very disk has to be waited for, the disk is
+	// about to be freed.
+	while (busy_ == disk)
+		idle_.wait(lock);
+}
+
+
+void SmartRefresher::run()
+{
+	// Signals are for the main thread only
+	sigset_t mask;
+	sigfillset(&mask);
+	sigdelset(&mask, SIGSEGV);
+	pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	clock::time_point earliest = clock::now();
+	while (!stop_) {
+		// The interval is looked up every time since the poll option is only
+		// set after the driver has been added.
+		Entry *next = nullptr;
+		clock::time_point next_due = clock::time_point::max();
+		for (Entry &e : disks_) {
+			clock::time_point due = e.last_refresh
+					+ std::chrono::duration_cast<clock::duration>(e.disk->refresh_interval());
+			if (due < next_due) {
+				next = &e;
+				next_due = due;
+			}
+		}
+
+		if (!next) {
+			cv_.wait(lock);
+			continue;
+		}
+
+		next_due = std::max(next_due, earliest);
+		if (clock::now() < next_due) {
+			// Woken up early if disks are added or removed, or when we're stopped.
+			cv_.wait_until(lock, next_due);
+			continue;
+		}
+
+		// Without the lock, so that adding or removing other disks (on a
+		// reload, or from a concurrent init()) doesn't wait for the I/O.
+		// The entry may be gone afterwards, so it's looked up again.
+		AtasmartSensorDriver *disk = next->disk;
+		busy_ = disk;
+		lock.unlock();
+		disk->refresh();
+		lock.lock();
+		busy_ = nullptr;
+		idle_.notify_all();
+
+		earliest = clock::now() + SMART_MIN_GAP;
+		for (Entry &e : disks_)
+			if (e.disk == disk)
+				e.last_refresh = earliest - SMART_MIN_GAP;
+	}
+}
+
+
+
+/*----------------------------------------------------------------------------
+| AtasmartSensorDriver: Reads the temperature of a hard disk via             |
+| libatasmart. The actual S.M.A.R.T readout is done by the SmartRefresher,   |
+| read_temps() only returns the cached result, so it never blocks the        |
+| control loop.                                                              |
 ----------------------------------------------------------------------------*/
 
 AtasmartSensorDriver::AtasmartSensorDriver(string device_path)
-: SensorDriver(device_path)
+: SensorDriver(device_path),
+  disk_(nullptr),
+  temp_(0)
 {
-	if (sk_disk_open(device_path.c_str(), &disk_) < 0) {
+	// Opening the disk already talks to it, so that's left to init()
+	if (::access(device_path.c_str(), R_OK) < 0) {
 		string msg = std::strerror(errno);
-		throw SystemError("sk_disk_open(" + device_path + "): " + msg);
+		throw SystemError(device_path + ": " + msg);
 	}
 	set_num_temps(1);
 }
 
 
 AtasmartSensorDriver::~AtasmartSensorDriver()
-{ sk_disk_free(disk_); }
+{
+	if (refresher_)
+		refresher_->remove(this);
+	if (disk_)
+		sk_disk_free(disk_);
+}
+
+
+void AtasmartSensorDriver::init()
+{
+	if (sk_disk_open(path_.c_str(), &disk_) < 0) {
+		string msg = std::strerror(errno);
+		disk_ = nullptr;
+		throw SystemError("sk_disk_open(" + path_ + "): " + msg);
+	}
+
+	// Read synchronously once so we start off with a valid temperature
+	refresh();
+	refresher_ = SmartRefresher::get();
+	refresher_->add(this);
+}
+
+
+secondsf AtasmartSensorDriver::refresh_interval() const
+{ return poll_interval() > secondsf(0) ? poll_interval() : SMART_DEFAULT_INTERVAL; }
 
 
 void AtasmartSensorDriver::read_temps() const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	if (unlikely(error_.length() > 0))
+		throw SystemError(error_);
+
+	// If the disk takes way too long, the control loop keeps going with the
+	// last known temperature, but the poller should at least tell someone.
+	outdated_ = SmartRefresher::clock::now() - timestamp_
+			> 2 * std::chrono::duration_cast<SmartRefresher::clock::duration>(refresh_interval());
+
+	temps_[0] = temp_ + correction_[0];
+}
+
+
+void AtasmartSensorDriver::refresh()
 {
 	SkBool disk_sleeping = false;
+	int temp = 0;
+	string error;
 
 	if (unlikely(dnd_disk && (sk_disk_check_sleep_mode(disk_, &disk_sleeping) < 0))) {
 		string msg = strerror(errno);
-		throw SystemError("sk_disk_check_sleep_mode(" + path_ + "): " + msg);
+		error = "sk_disk_check_sleep_mode(" + path_ + "): " + msg;
 	}
-
-	if (unlikely(disk_sleeping)) {
-		temp_state.add_temp(0);
-	}
-	else {
+	else if (!disk_sleeping) {
 		uint64_t mKelvin;
 		double tmp;
 
 		if (unlikely(sk_disk_smart_read_data(disk_) < 0)) {
 			string msg = strerror(errno);
-			throw SystemError("sk_disk_smart_read_data(" + path_ + "): " + msg);
+			error = "sk_disk_smart_read_data(" + path_ + "): " + msg;
 		}
-		if (unlikely(sk_disk_smart_get_temperature(disk_, &mKelvin)) < 0) {
+		else if (unlikely(sk_disk_smart_get_temperature(disk_, &mKelvin)) < 0) {
 			string msg = strerror(errno);
-			throw SystemError("sk_disk_smart_get_temperature(" + path_ + "): " + msg);
+			error = "sk_disk_smart_get_temperature(" + path_ + "): " + msg;
 		}
-
-		tmp = mKelvin / 1000.0f;
-		tmp -= 273.15f;
-
-		if (unlikely(tmp > std::numeric_limits<int>::max() || tmp < std::numeric_limits<int>::min())) {
-			throw SystemError(MSG_T_GET(path_) + std::to_string(tmp) + " isn't a valid temperature.");
+		else {
+			tmp = mKelvin / 1000.0f;
+			tmp -= 273.15f;
+
+			if (unlikely(tmp > std::numeric_limits<int>::max() || tmp < std::numeric_limits<int>::min()))
+				error = MSG_T_GET(path_) + std::to_string(tmp) + " isn't a valid temperature.";
+			else
+				temp = tmp;
 		}
-
-		temp_state.add_temp(tmp);
 	}
+
+	std::lock_guard<std::mutex> lock(mutex_);
+	temp_ = temp;
+	error_ = error;
+	timestamp_ = SmartRefresher::clock::now();
 }
 #endif /* USE_ATASMART */
 
 
 #ifdef USE_NVML
 /*----------------------------------------------------------------------------
-| NvmlSensorDriver: Gets temperatures directly from GPUs supported by the    |
-| nVidia Management Library that is included with the proprietary driver.    |
+| NvmlContext: The loaded & initialized libnvidia-ml.so. There's only one    |
+| per process, shared by all NvmlSensorDrivers, since nvmlShutdown() would   |
+| otherwise pull the rug out from under all other drivers. It's released     |
+| when the last driver that uses it goes away.                               |
 ----------------------------------------------------------------------------*/
 
-NvmlSensorDriver::NvmlSensorDriver(string bus_id)
+std::weak_ptr<NvmlContext> NvmlContext::instance_;
+std::mutex NvmlContext::instance_mutex_;
+
+
+std::shared_ptr<NvmlContext> NvmlContext::get()
+{
+	// Drivers are initialized concurrently, but the library is loaded only once
+	std::lock_guard<std::mutex> lock(instance_mutex_);
+	std::shared_ptr<NvmlContext> rv = instance_.lock();
+	if (!rv) {
+		rv.reset(new NvmlContext());
+		instance_ = rv;
+	}
+	return rv;
+}
+
+
+NvmlContext::NvmlContext()
 : dl_nvmlInit_v2(nullptr),
   dl_nvmlDeviceGetHandleByPciBusId_v2(nullptr),
   dl_nvmlDeviceGetName(nullptr),
   dl_nvmlDeviceGetTemperature(nullptr),
-  dl_nvmlShutdown(nullptr)
+  dl_nvmlShutdown(nullptr),
+  dl_nvmlDeviceGetUtilizationRates(nullptr),
+  dl_nvmlDeviceGetPowerUsage(nullptr),
+  dl_nvmlDeviceGetEnforcedPowerLimit(nullptr)
 {
-	if (!(nvml_so_handle_ = dlopen("libnvidia-ml.so", RTLD_LAZY))) {
-		string msg = strerror(errno);
+	if (!(so_handle_ = dlopen("libnvidia-ml.so", RTLD_LAZY))) {
+		string msg = dlerror();
 		throw SystemError("Failed to load NVML driver: " + msg);
 	}
 
@@ -412,47 +1257,183 @@ NvmlSensorDriver::NvmlSensorDriver(string bus_id)
 	 * this kind of weird stuff.
 	 * See http://stackoverflow.com/questions/1096341/function-pointers-casting-in-c
 	 */
-	*reinterpret_cast<void **>(&dl_nvmlInit_v2) = dlsym(nvml_so_handle_, "nvmlInit_v2");
+	*reinterpret_cast<void **>(&dl_nvmlInit_v2) = dlsym(so_handle_, "nvmlInit_v2");
 	*reinterpret_cast<void **>(&dl_nvmlDeviceGetHandleByPciBusId_v2) = dlsym(
-			nvml_so_handle_, "nvmlDeviceGetHandleByPciBusId_v2");
-	*reinterpret_cast<void **>(&dl_nvmlDeviceGetName) = dlsym(nvml_so_handle_, "nvmlDeviceGetName");
-	*reinterpret_cast<void **>(&dl_nvmlDeviceGetTemperature) = dlsym(nvml_so_handle_, "nvmlDeviceGetTemperature");
-	*reinterpret_cast<void **>(&dl_nvmlShutdown) = dlsym(nvml_so_handle_, "nvmlShutdown");
+			so_handle_, "nvmlDeviceGetHandleByPciBusId_v2");
+	*reinterpret_cast<void **>(&dl_nvmlDeviceGetName) = dlsym(so_handle_, "nvmlDeviceGetName");
+	*reinterpret_cast<void **>(&dl_nvmlDeviceGetTemperature) = dlsym(so_handle_, "nvmlDeviceGetTemperature");
+	*reinterpret_cast<void **>(&dl_nvmlShutdown) = dlsym(so_handle_, "nvmlShutdown");
+	*reinterpret_cast<void **>(&dl_nvmlDeviceGetUtilizationRates) = dlsym(
+			so_handle_, "nvmlDeviceGetUtilizationRates");
+	*reinterpret_cast<void **>(&dl_nvmlDeviceGetPowerUsage) = dlsym(so_handle_, "nvmlDeviceGetPowerUsage");
+	*reinterpret_cast<void **>(&dl_nvmlDeviceGetEnforcedPowerLimit) = dlsym(
+			so_handle_, "nvmlDeviceGetEnforcedPowerLimit");
 
 	if (!(dl_nvmlDeviceGetHandleByPciBusId_v2 && dl_nvmlDeviceGetName &&
-			dl_nvmlDeviceGetTemperature && dl_nvmlInit_v2 && dl_nvmlShutdown))
+			dl_nvmlDeviceGetTemperature && dl_nvmlInit_v2 && dl_nvmlShutdown)) {
+		dlclose(so_handle_);
 		throw SystemError("Incompatible NVML driver.");
+	}
 
 	nvmlReturn_t ret;
-	string name, brand;
-	name.resize(256);
-	brand.resize(256);
-
-	if ((ret = dl_nvmlInit_v2()))
+	if ((ret = dl_nvmlInit_v2())) {
+		dlclose(so_handle_);
 		throw SystemError("Failed to initialize NVML driver. Error code (cf. nvml.h): " + std::to_string(ret));
-	if ((ret = dl_nvmlDeviceGetHandleByPciBusId_v2(bus_id.c_str(), &device_)))
-		throw SystemError("Failed to open PCI device " + bus_id + ". Error code (cf. nvml.h): " + std::to_string(ret));
-	dl_nvmlDeviceGetName(device_, &*name.begin(), 255);
-	log(TF_DBG) << "Initialized NVML sensor on " << name << " at PCI " << bus_id << "." << flush;
-	set_num_temps(1);
+	}
 }
 
 
-NvmlSensorDriver::~NvmlSensorDriver()
+NvmlContext::~NvmlContext()
 {
 	nvmlReturn_t ret;
 	if ((ret = dl_nvmlShutdown()))
-		throw SystemError("Failed to shutdown NVML driver. Error code (cf. nvml.h): " + std::to_string(ret));
-	dlclose(nvml_so_handle_);
+		log(TF_ERR) << "Failed to shutdown NVML driver. Error code (cf. nvml.h): " << std::to_string(ret) << flush;
+	dlclose(so_handle_);
+}
+
+
+nvmlDevice_t NvmlContext::device(const string &bus_id) const
+{
+	nvmlReturn_t ret;
+	nvmlDevice_t rv;
+	if ((ret = dl_nvmlDeviceGetHandleByPciBusId_v2(bus_id.c_str(), &rv)))
+		throw SystemError("Failed to open PCI device " + bus_id + ". Error code (cf. nvml.h): " + std::to_string(ret));
+	return rv;
+}
+
+
+/* A comma-separated list of PCI bus IDs. Doesn't need the library, so a
+ * broken list is found before anything is loaded. */
+std::vector<string> NvmlContext::bus_ids(const string &list)
+{
+	std::vector<string> rv;
+	string::size_type start = 0, end;
+	do {
+		end = list.find(',', start);
+		string bus_id = list.substr(start, end == string::npos ? string::npos : end - start);
+		if (bus_id.length() == 0)
+			throw ConfigError(MSG_CONF_NVML_BUSID(list));
+		rv.push_back(bus_id);
+		start = end + 1;
+	} while (end != string::npos);
+	return rv;
+}
+
+
+std::vector<nvmlDevice_t> NvmlContext::devices(const std::vector<string> &bus_ids) const
+{
+	std::vector<nvmlDevice_t> rv;
+	for (const string &bus_id : bus_ids)
+		rv.push_back(device(bus_id));
+	return rv;
+}
+
+
+string NvmlContext::name(nvmlDevice_t device) const
+{
+	char name[256] = { 0 };
+	dl_nvmlDeviceGetName(device, name, sizeof(name) - 1);
+	return name;
 }
 
+
+nvmlReturn_t NvmlContext::temperature(nvmlDevice_t device, unsigned int *temp) const
+{ return dl_nvmlDeviceGetTemperature(device, NVML_TEMPERATURE_GPU, temp); }
+
+
+bool NvmlContext::has_load() const
+{ return dl_nvmlDeviceGetUtilizationRates && dl_nvmlDeviceGetPowerUsage && dl_nvmlDeviceGetEnforcedPowerLimit; }
+
+
+nvmlReturn_t NvmlContext::utilization(nvmlDevice_t device, unsigned int *percent) const
+{
+	nvmlUtilization_t util;
+	nvmlReturn_t ret = dl_nvmlDeviceGetUtilizationRates(device, &util);
+	if (!ret)
+		*percent = util.gpu;
+	return ret;
+}
+
+
+nvmlReturn_t NvmlContext::power(nvmlDevice_t device, unsigned int *milliwatts, unsigned int *limit) const
+{
+	nvmlReturn_t ret = dl_nvmlDeviceGetPowerUsage(device, milliwatts);
+	if (ret)
+		return ret;
+	return dl_nvmlDeviceGetEnforcedPowerLimit(device, limit);
+}
+
+
+
+/*----------------------------------------------------------------------------
+| NvmlSensorDriver: Gets temperatures directly from GPUs supported by the    |
+| nVidia Management Library that is included with the proprietary driver.    |
+| Takes a comma-separated list of PCI bus IDs and provides one temperature   |
+| per GPU, all of which are read in a single read_temps().                   |
+----------------------------------------------------------------------------*/
+
+NvmlSensorDriver::NvmlSensorDriver(string bus_ids)
+: SensorDriver(bus_ids),
+  bus_ids_(NvmlContext::bus_ids(bus_ids))
+{ set_num_temps(bus_ids_.size()); }
+
+
+void NvmlSensorDriver::init()
+{
+	nvml_ = NvmlContext::get();
+	devices_ = nvml_->devices(bus_ids_);
+}
+
+
 void NvmlSensorDriver::read_temps() const
 {
 	nvmlReturn_t ret;
 	unsigned int tmp;
-	if ((ret = dl_nvmlDeviceGetTemperature(device_, NVML_TEMPERATURE_GPU, &tmp)))
-		throw SystemError(MSG_T_GET(path_) + "Error code (cf. nvml.h): " + std::to_string(ret));
-	temp_state.add_temp(tmp);
+	for (unsigned int i = 0; i < devices_.size(); ++i) {
+		if ((ret = nvml_->temperature(devices_[i], &tmp)))
+			throw SystemError(MSG_T_GET(path_) + "Error code (cf. nvml.h): " + std::to_string(ret));
+		temps_[i] = tmp + correction_[i];
+	}
+}
+
+
+/*----------------------------------------------------------------------------
+| NvmlLoadDriver: The load of the busiest GPU from a comma-separated list of |
+| PCI bus IDs. A GPU's load is its utilization or the fraction of its power  |
+| limit that it draws, whichever is higher. Power rises along with the       |
+| clocks, so it catches a load that the coarse utilization counter misses.   |
+----------------------------------------------------------------------------*/
+
+NvmlLoadDriver::NvmlLoadDriver(const string &bus_ids)
+: LoadDriver(bus_ids),
+  bus_ids_(NvmlContext::bus_ids(bus_ids))
+{}
+
+
+void NvmlLoadDriver::init()
+{
+	nvml_ = NvmlContext::get();
+	if (!nvml_->has_load())
+		throw SystemError(MSG_LOAD_NVML_UNSUPP);
+	devices_ = nvml_->devices(bus_ids_);
+}
+
+
+float NvmlLoadDriver::read_load()
+{
+	nvmlReturn_t ret;
+	unsigned int util, power, limit;
+	float rv = 0;
+	for (nvmlDevice_t device : devices_) {
+		if ((ret = nvml_->utilization(device, &util)))
+			throw SystemError(MSG_LOAD_GET(path_) + "Error code (cf. nvml.h): " + std::to_string(ret));
+		rv = std::max(rv, util / 100.0f);
+
+		// Not every GPU can report its power
+		if (!nvml_->power(device, &power, &limit) && limit > 0)
+			rv = std::max(rv, float(power) / limit);
+	}
+	return std::min(rv, 1.0f);
 }
 #endif /* USE_NVML */
 
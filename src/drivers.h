@@ -23,58 +23,142 @@
 #define THINKFAN_DRIVERS_H_
 
 #include <string>
+#include <memory>
+#include <atomic>
+#include <sys/types.h>
 
 #include "thinkfan.h"
 
 #ifdef USE_ATASMART
 #include <atasmart.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #endif /* USE_ATASMART */
 
 #ifdef USE_NVML
 #include <nvidia/gdk/nvml.h>
+#include <mutex>
 #endif /* USE_NVML */
 
+#ifdef USE_IO_URING
+struct io_uring_sqe;
+struct io_uring_cqe;
+#endif /* USE_IO_URING */
+
 namespace thinkfan {
 
 class Level;
 
+
+class AttributeFile {
+public:
+	AttributeFile() : fd_(-1), flags_(0) {}
+	AttributeFile(const AttributeFile &) = delete;
+	~AttributeFile();
+	bool open(const string &path, int flags);
+	ssize_t read(char *buf, size_t count) const;
+	ssize_t write(const char *buf, size_t count) const;
+	bool is_open() const { return fd_ >= 0; }
+	int fd() const { return fd_; }
+
+	AttributeFile &operator = (const AttributeFile &) = delete;
+private:
+	bool reopen() const;
+	void close() const;
+
+	string path_;
+	mutable int fd_;
+	int flags_;
+};
+
+
+class IntScanner {
+public:
+	IntScanner(const char *first, const char *last)
+	: pos_(first), end_(last) {}
+	bool skip(const string &prefix);
+	bool next(int &value);
+	bool next(long long &value);
+	bool done();
+	const char *pos() const { return pos_; }
+private:
+	void skip_space();
+	const char *scan(long long &value, long long max);
+
+	const char *pos_;
+	const char *end_;
+};
+
+
 class FanDriver {
 protected:
+	typedef std::chrono::steady_clock clock;
+
 	string path_;
+	AttributeFile file_;
 	string initial_state_;
 	seconds watchdog_;
 	secondsf depulse_;
-	std::chrono::system_clock::time_point last_watchdog_ping_;
+	bool verify_;
+	string written_;
+	clock::time_point last_write_;
 	FanDriver(const string &path, const unsigned int watchdog_timeout = 120);
+	void write(const string &value);
+	void reassert();
+	virtual bool drifted() { return false; }
 public:
-	FanDriver() : watchdog_(0) {}
+	FanDriver() : watchdog_(0), verify_(false) {}
 	bool is_default() { return path_.length() == 0; }
+	const string &path() const { return path_; }
+	bool verify() const { return verify_; }
+	clock::time_point last_write() const { return last_write_; }
+	virtual void set_verify(bool verify) { verify_ = verify; }
 	virtual ~FanDriver() = default;
-	virtual void init() const {}
+	virtual void init() { written_.clear(); }
 	virtual void set_speed(const string &level);
 	virtual void set_speed(const Level *level) = 0;
 	virtual void ping_watchdog_and_depulse(const Level *level) {};
 };
 
 
-class TpFanDriver : public FanDriver {
+class TpFanDriver final : public FanDriver {
 public:
 	TpFanDriver(const string &path);
 	~TpFanDriver() override;
 	void set_watchdog(const unsigned int timeout);
 	void set_depulse(float duration);
-	void init() const override;
+	void set_verify(bool verify) override;
+	void init() override;
 	void set_speed(const Level *const level) override;
 	virtual void ping_watchdog_and_depulse(const Level *level) override;
+protected:
+	bool drifted() override;
+private:
+	AttributeFile readback_;
+	char buf_[512];
 };
 
 
-class HwmonFanDriver : public FanDriver {
+class HwmonFanDriver final : public FanDriver {
 public:
 	HwmonFanDriver(const string &path);
 	~HwmonFanDriver() override;
-	void init() const override;
+	void set_verify(bool verify) override;
+	void init() override;
 	virtual void set_speed(const Level *level) override;
+	void set_pwm(int pwm);
+	virtual void ping_watchdog_and_depulse(const Level *level) override;
+protected:
+	bool drifted() override;
+private:
+	void write_pwm(const string &value);
+	bool read_int(const AttributeFile &file, int &value);
+	string pwm_s_;
+	AttributeFile readback_;
+	AttributeFile enable_;
+	char buf_[32];
+	int expected_pwm_;
 };
 
 
@@ -82,58 +166,256 @@ class SensorDriver {
 protected:
 	string path_;
 	SensorDriver(string path);
-	SensorDriver() : num_temps_(0) {}
+	SensorDriver() : outdated_(false), stuck_(false), num_temps_(0), poll_interval_(0), timeout_(0),
+		trend_(TemperatureState::TREND_JUMP), horizon_(0) {}
 	std::vector<int> correction_;
+	void scan_temps(const char *buf, ssize_t len, size_t size, int divisor = 1) const;
 public:
 	virtual ~SensorDriver() = default;
+
+	// May run on a poller thread, so like init(), it must not log. A driver
+	// that could only deliver an old value sets outdated_ instead, and the
+	// poller reports the sensor as stale.
 	virtual void read_temps() const = 0;
+	virtual std::vector<string> alarm_files() const { return {}; }
+
+	// Whatever is slow or wakes up hardware, e.g. loading a library or
+	// spinning up a disk. The constructor only checks the config, so that it
+	// can run before forking. init() is called once after that, concurrently
+	// with the init() of other drivers, so it must not log.
+	virtual void init() {}
+
+	// For batched reads: If read_temps() boils down to a single pread() at
+	// offset 0, a driver can hand out that read, and then parse its result
+	// (or -errno) in read_done(). Other drivers are always read one by one.
+	virtual bool read_request(int &fd, char *&buf, size_t &size) const { return false; }
+	virtual void read_done(ssize_t len) const {}
+	const std::vector<int> &temps() const { return temps_; }
+	bool outdated() const { return outdated_; }
+	const string &path() const { return path_; }
 	unsigned int num_temps() const { return num_temps_; }
+	const std::vector<int> &correction() const { return correction_; }
 	void set_correction(const std::vector<int> &correction);
 	void set_num_temps(unsigned int n);
+	secondsf poll_interval() const { return poll_interval_; }
+	void set_poll_interval(secondsf interval) { poll_interval_ = interval; }
+	secondsf timeout() const { return timeout_; }
+	void set_timeout(secondsf timeout) { timeout_ = timeout; }
+	TemperatureState::Trend trend() const { return trend_; }
+	secondsf horizon() const { return horizon_; }
+	void set_trend(TemperatureState::Trend trend, secondsf horizon) { trend_ = trend; horizon_ = horizon; }
+
+	// Set while a read_temps() is still running on a poller thread that has
+	// been given up on. Such a driver is neither handed over on a reload nor
+	// deleted, since the thread will write to it if the read ever returns.
+	bool stuck() const { return stuck_; }
+	void set_stuck(bool stuck) const { stuck_ = stuck; }
+protected:
+	mutable std::vector<int> temps_;
+	mutable bool outdated_;
 private:
+	mutable std::atomic<bool> stuck_;
 	unsigned int num_temps_;
+	secondsf poll_interval_;
+	secondsf timeout_;
+	TemperatureState::Trend trend_;
+	secondsf horizon_;
 };
 
 
-class TpSensorDriver : public SensorDriver {
+class TpSensorDriver final : public SensorDriver {
 public:
 	TpSensorDriver(string path);
 	virtual void read_temps() const override;
+	virtual bool read_request(int &fd, char *&buf, size_t &size) const override;
+	virtual void read_done(ssize_t len) const override;
 private:
+	void parse(ssize_t len) const;
+	AttributeFile file_;
+	mutable char buf_[256];
 	std::char_traits<char>::off_type skip_bytes_;
 	static const string skip_prefix_;
 };
 
 
-class HwmonSensorDriver : public SensorDriver {
+class HwmonSensorDriver final : public SensorDriver {
 public:
 	HwmonSensorDriver(string path);
 	virtual void read_temps() const override;
+	virtual std::vector<string> alarm_files() const override;
+	virtual bool read_request(int &fd, char *&buf, size_t &size) const override;
+	virtual void read_done(ssize_t len) const override;
+private:
+	AttributeFile file_;
+	mutable char buf_[32];
+};
+
+
+#ifdef USE_IO_URING
+/* Submits the reads of many sensors with a single io_uring_enter() and waits
+ * for all of them to complete. The descriptors and buffers of all sensors are
+ * registered with the ring up front, so the kernel doesn't have to look up a
+ * file or pin a page per read. */
+class UringBatch {
+public:
+	// Returns nullptr if io_uring is unavailable (or disabled) on this kernel.
+	static std::unique_ptr<UringBatch> make(const std::vector<const SensorDriver *> &sensors);
+	UringBatch(const UringBatch &) = delete;
+	~UringBatch();
+
+	void clear() { queued_.clear(); }
+	void add(unsigned int idx, int fd);
+	bool submit();
+	const std::vector<unsigned int> &queued() const { return queued_; }
+	ssize_t result(unsigned int idx) const { return results_[idx]; }
+
+	UringBatch &operator = (const UringBatch &) = delete;
+
+private:
+	UringBatch(const std::vector<const SensorDriver *> &sensors);
+	bool setup();
+	void update_file(unsigned int idx, int fd);
+
+	int ring_fd_;
+	unsigned int entries_;
+	void *sq_ring_;
+	size_t sq_ring_size_;
+	void *cq_ring_;
+	size_t cq_ring_size_;
+	io_uring_sqe *sqes_;
+	size_t sqes_size_;
+	unsigned int *sq_tail_, *sq_mask_, *sq_array_;
+	unsigned int *cq_head_, *cq_tail_, *cq_mask_;
+	io_uring_cqe *cqes_;
+	bool fixed_files_;
+	bool fixed_buffers_;
+
+	std::vector<const SensorDriver *> sensors_;
+	std::vector<int> fds_;
+	std::vector<char *> bufs_;
+	std::vector<size_t> sizes_;
+	std::vector<unsigned int> queued_;
+	std::vector<ssize_t> results_;
+};
+#endif /* USE_IO_URING */
+
+
+/* A source of utilization rather than temperature. Its load (0 to 1) is
+ * multiplied by the gain and added to all temperatures as a feedforward
+ * term, so the fans can react to a load step before the heat arrives. */
+class LoadDriver {
+protected:
+	string path_;
+	LoadDriver(const string &path);
+public:
+	virtual ~LoadDriver() = default;
+	virtual void init() {}	// Like SensorDriver::init()
+	virtual float read_load() = 0;
+	const string &path() const { return path_; }
+	float gain() const { return gain_; }
+	void set_gain(float gain) { gain_ = gain; }
 private:
+	float gain_;
+};
+
+
+class CpuLoadDriver final : public LoadDriver {
+public:
+	CpuLoadDriver(const string &path);
+	virtual float read_load() override;
+private:
+	bool read_jiffies(long long &busy, long long &total);
+
+	AttributeFile file_;
+	char buf_[256];
+	long long busy_;
+	long long total_;
+	float load_;
 };
 
 
 #ifdef USE_ATASMART
-class AtasmartSensorDriver : public SensorDriver {
+class AtasmartSensorDriver;
+
+
+class SmartRefresher {
+public:
+	typedef std::chrono::steady_clock clock;
+
+	static std::shared_ptr<SmartRefresher> get();
+	SmartRefresher(const SmartRefresher &) = delete;
+	~SmartRefresher();
+
+	void add(AtasmartSensorDriver *disk);
+	void remove(AtasmartSensorDriver *disk);
+
+	SmartRefresher &operator = (const SmartRefresher &) = delete;
+
+private:
+	SmartRefresher();
+	void run();
+
+	struct Entry {
+		AtasmartSensorDriver *disk;
+		clock::time_point last_refresh;
+	};
+
+	std::vector<Entry> disks_;
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	AtasmartSensorDriver *busy_;			// Being refreshed without the lock
+	std::condition_variable idle_;
+	bool stop_;
+	std::thread thread_;
+
+	static std::weak_ptr<SmartRefresher> instance_;
+	static std::mutex instance_mutex_;
+};
+
+
+class AtasmartSensorDriver final : public SensorDriver {
 public:
 	AtasmartSensorDriver(string device_path);
 	virtual ~AtasmartSensorDriver();
+	virtual void init() override;
 	virtual void read_temps() const override;
+	void refresh();
+	secondsf refresh_interval() const;
 private:
 	SkDisk *disk_;
+	std::shared_ptr<SmartRefresher> refresher_;
+
+	// Written by the refresher thread, read by the control loop
+	mutable std::mutex mutex_;
+	int temp_;
+	SmartRefresher::clock::time_point timestamp_;
+	string error_;
 };
 #endif /* USE_ATASMART */
 
 
 #ifdef USE_NVML
-class NvmlSensorDriver : public SensorDriver {
+class NvmlContext {
 public:
-	NvmlSensorDriver(string bus_id);
-	virtual ~NvmlSensorDriver();
-	virtual void read_temps() const override;
+	static std::shared_ptr<NvmlContext> get();
+	static std::vector<string> bus_ids(const string &list);
+	NvmlContext(const NvmlContext &) = delete;
+	~NvmlContext();
+
+	nvmlDevice_t device(const string &bus_id) const;
+	std::vector<nvmlDevice_t> devices(const std::vector<string> &bus_ids) const;
+	string name(nvmlDevice_t device) const;
+	nvmlReturn_t temperature(nvmlDevice_t device, unsigned int *temp) const;
+	bool has_load() const;
+	nvmlReturn_t utilization(nvmlDevice_t device, unsigned int *percent) const;
+	nvmlReturn_t power(nvmlDevice_t device, unsigned int *milliwatts, unsigned int *limit) const;
+
+	NvmlContext &operator = (const NvmlContext &) = delete;
+
 private:
-	nvmlDevice_t device_;
-	void *nvml_so_handle_;
+	NvmlContext();
+
+	void *so_handle_;
 
 	// Pointers to dynamically loaded functions from libnvidia-ml.so
 	nvmlReturn_t (*dl_nvmlInit_v2)();
@@ -142,6 +424,37 @@ private:
 	nvmlReturn_t (*dl_nvmlDeviceGetTemperature)(nvmlDevice_t, nvmlTemperatureSensors_t, unsigned int *);
 	nvmlReturn_t (*dl_nvmlShutdown)();
 
+	// Only needed by nv_load, so they may be missing from older drivers
+	nvmlReturn_t (*dl_nvmlDeviceGetUtilizationRates)(nvmlDevice_t, nvmlUtilization_t *);
+	nvmlReturn_t (*dl_nvmlDeviceGetPowerUsage)(nvmlDevice_t, unsigned int *);
+	nvmlReturn_t (*dl_nvmlDeviceGetEnforcedPowerLimit)(nvmlDevice_t, unsigned int *);
+
+	static std::weak_ptr<NvmlContext> instance_;
+	static std::mutex instance_mutex_;
+};
+
+
+class NvmlSensorDriver final : public SensorDriver {
+public:
+	NvmlSensorDriver(string bus_ids);
+	virtual void init() override;
+	virtual void read_temps() const override;
+private:
+	std::vector<string> bus_ids_;
+	std::shared_ptr<NvmlContext> nvml_;
+	std::vector<nvmlDevice_t> devices_;
+};
+
+
+class NvmlLoadDriver final : public LoadDriver {
+public:
+	NvmlLoadDriver(const string &bus_ids);
+	virtual void init() override;
+	virtual float read_load() override;
+private:
+	std::vector<string> bus_ids_;
+	std::shared_ptr<NvmlContext> nvml_;
+	std::vector<nvmlDevice_t> devices_;
 };
 #endif /* USE_NVML */
 
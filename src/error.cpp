@@ -84,10 +84,12 @@ void handle_uncaught()
 				"Backtrace:" << make_backtrace() << flush <<
 				MSG_BUG << flush;
 	}
+	// We're about to abort(), so don't leave anything in the log queue.
+	Logger::instance().stop_writer();
 }
 
 
-SyntaxError::SyntaxError(const string filename, const size_t offset, const string &input)
+SyntaxError::SyntaxError(const string filename, const size_t offset, const string &input, const string &reason)
 {
 	unsigned int line = 1;
 	msg_ += filename + ":";
@@ -99,7 +101,7 @@ SyntaxError::SyntaxError(const string filename, const size_t offset, const strin
 			line_start = i + 1;
 		}
 	}
-	msg_ += std::to_string(line) + ": Syntax error:\n";
+	msg_ += std::to_string(line) + ": " + (reason.empty() ? "Syntax error" : reason) + ":\n";
 	std::string::size_type line_end = input.find('\n', line_start) - line_start;
 	msg_ += input.substr(line_start, line_end) + '\n';
 	msg_ += std::string(offset - line_start, ' ') + "^\n";
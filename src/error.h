@@ -74,7 +74,8 @@ public:
 
 class SyntaxError : public ExpectedError {
 public:
-	SyntaxError(const string filename, const size_t offset, const string &input);
+	// Points at offset in input. Without a reason, it's just a syntax error.
+	SyntaxError(const string filename, const size_t offset, const string &input, const string &reason = "");
 };
 
 
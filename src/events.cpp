@@ -0,0 +1,225 @@
+/********************************************************************
+ * events.cpp: Waiting for timeouts, signals & sensor alarms in the main loop.
+ * (C) 2015, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+
+#include "error.h"
+#include "events.h"
+#include "drivers.h"
+#include "message.h"
+
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <cstring>
+
+namespace thinkfan {
+
+// epoll user data for the fds that aren't alarms
+static const uint32_t TIMER_ID = ~0u;
+static const uint32_t SIGNAL_ID = ~0u - 1;
+static const uint32_t CONTROL_ID = ~0u - 2;
+
+
+/*----------------------------------------------------------------------------
+| EventLoop: All fds are level-triggered. If several are ready at once, a    |
+| signal wins over an alarm, which wins over the control socket, which wins  |
+| over the timer. Nothing is lost that way, since whatever isn't consumed is |
+| reported again by the next wait().                                         |
+----------------------------------------------------------------------------*/
+
+EventLoop::EventLoop(const std::vector<const SensorDriver *> &sensors, int control_fd)
+: epoll_fd_(-1),
+  timer_fd_(-1),
+  signal_fd_(-1),
+  signal_(0),
+  alarm_(-1)
+{
+	epoll_fd_ = ::epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd_ < 0)
+		throw IOerror("epoll_create1: ", errno);
+
+	timer_fd_ = ::timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+	if (timer_fd_ < 0)
+		throw IOerror("timerfd_create: ", errno);
+	add(timer_fd_, EPOLLIN, TIMER_ID);
+
+	sigset_t mask = signals();
+	signal_fd_ = ::signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+	if (signal_fd_ < 0)
+		throw IOerror("signalfd: ", errno);
+	add(signal_fd_, EPOLLIN, SIGNAL_ID);
+
+	if (control_fd >= 0)
+		add(control_fd, EPOLLIN, CONTROL_ID);
+
+	for (const SensorDriver *sensor : sensors)
+		for (const string &path : sensor->alarm_files())
+			watch_alarm(path);
+}
+
+
+EventLoop::~EventLoop()
+{
+	for (int fd : alarm_fds_)
+		::close(fd);
+	if (signal_fd_ >= 0)
+		::close(signal_fd_);
+	if (timer_fd_ >= 0)
+		::close(timer_fd_);
+	if (epoll_fd_ >= 0)
+		::close(epoll_fd_);
+}
+
+
+sigset_t EventLoop::signals()
+{
+	sigset_t rv;
+	sigemptyset(&rv);
+	sigaddset(&rv, SIGHUP);
+	sigaddset(&rv, SIGINT);
+	sigaddset(&rv, SIGTERM);
+	sigaddset(&rv, SIGUSR1);
+	sigaddset(&rv, SIGUSR2);
+	return rv;
+}
+
+
+/* Until an EventLoop reads them, blocked signals just stay pending. So a
+ * SIGTERM that comes in while e.g. the config is reloaded isn't lost. */
+void EventLoop::block_signals()
+{
+	sigset_t mask = signals();
+	int err = pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+	if (err)
+		throw IOerror("pthread_sigmask: ", err);
+}
+
+
+void EventLoop::add(int fd, uint32_t events, uint32_t id)
+{
+	struct epoll_event ev;
+	std::memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.u32 = id;
+	if (::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev))
+		throw IOerror("epoll_ctl: ", errno);
+}
+
+
+/* sysfs attributes signal a change with POLLPRI | POLLERR, until they are
+ * read again from the beginning. */
+static void rearm_alarm(int fd)
+{
+	char buf[16];
+	if (::lseek(fd, 0, SEEK_SET) == 0)
+		while (::read(fd, buf, sizeof(buf)) > 0);
+}
+
+
+void EventLoop::watch_alarm(const string &path)
+{
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	rearm_alarm(fd);
+
+	struct epoll_event ev;
+	std::memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLPRI;
+	ev.data.u32 = alarm_fds_.size();
+	// Regular files (i.e. not sysfs) can't be polled and give EPERM
+	if (::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev)) {
+		::close(fd);
+		return;
+	}
+	alarm_fds_.push_back(fd);
+	alarm_paths_.push_back(path);
+}
+
+
+const string &EventLoop::alarm() const
+{ return alarm_paths_[alarm_]; }
+
+
+EventLoop::Event EventLoop::wait(clock::time_point deadline)
+{
+	std::chrono::nanoseconds t = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline.time_since_epoch());
+	struct itimerspec its;
+	std::memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = std::chrono::duration_cast<std::chrono::seconds>(t).count();
+	its.it_value.tv_nsec = (t - std::chrono::seconds(its.it_value.tv_sec)).count();
+	// A zero it_value would disarm the timer instead of firing right away
+	if (its.it_value.tv_sec <= 0 && its.it_value.tv_nsec <= 0)
+		its.it_value.tv_nsec = 1;
+	// libstdc++'s steady_clock is CLOCK_MONOTONIC, same as the timerfd
+	if (::timerfd_settime(timer_fd_, TFD_TIMER_ABSTIME, &its, nullptr))
+		throw IOerror("timerfd_settime: ", errno);
+
+	struct epoll_event evs[8];
+	for (;;) {
+		int n = ::epoll_wait(epoll_fd_, evs, sizeof(evs) / sizeof(*evs), -1);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			throw IOerror("epoll_wait: ", errno);
+		}
+
+		bool timeout = false;
+		bool control = false;
+		int alarm = -1;
+		for (int i = 0; i < n; ++i) {
+			if (evs[i].data.u32 == SIGNAL_ID) {
+				struct signalfd_siginfo si;
+				if (::read(signal_fd_, &si, sizeof(si)) == sizeof(si)) {
+					signal_ = si.ssi_signo;
+					return SIGNAL;
+				}
+			}
+			else if (evs[i].data.u32 == CONTROL_ID)
+				control = true;
+			else if (evs[i].data.u32 == TIMER_ID) {
+				uint64_t expirations;
+				if (::read(timer_fd_, &expirations, sizeof(expirations)) == sizeof(expirations))
+					timeout = true;
+			}
+			else {
+				alarm = evs[i].data.u32;
+				rearm_alarm(alarm_fds_[alarm]);
+			}
+		}
+
+		if (alarm >= 0) {
+			alarm_ = alarm;
+			return ALARM;
+		}
+		if (control)
+			return CONTROL;
+		if (timeout)
+			return TIMEOUT;
+		// Otherwise a spurious wakeup, e.g. a signal someone else consumed
+	}
+}
+
+
+}
@@ -0,0 +1,78 @@
+/********************************************************************
+ * events.h: Waiting for timeouts, signals & sensor alarms in the main loop.
+ * (C) 2015, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+
+#ifndef THINKFAN_EVENTS_H_
+#define THINKFAN_EVENTS_H_
+
+#include <vector>
+#include <chrono>
+#include <signal.h>
+
+#include "thinkfan.h"
+
+namespace thinkfan {
+
+class SensorDriver;
+
+
+/* Puts the main thread to sleep on an epoll set containing a timerfd for the
+ * next deadline, a signalfd for the signals that control thinkfan, every
+ * hwmon alarm attribute that belongs to a configured sensor, and optionally
+ * the control socket. So a signal, an alarm or a command is acted on right
+ * away instead of after the current sleep.
+ * The signals must have been blocked with block_signals() before any thread
+ * is started, otherwise they may still be delivered to some other thread. */
+class EventLoop {
+public:
+	typedef std::chrono::steady_clock clock;
+	enum Event { TIMEOUT, SIGNAL, ALARM, CONTROL };
+
+	EventLoop(const std::vector<const SensorDriver *> &sensors, int control_fd = -1);
+	EventLoop(const EventLoop &) = delete;
+	~EventLoop();
+
+	Event wait(clock::time_point deadline);
+	int signal() const { return signal_; }
+	const string &alarm() const;
+
+	static void block_signals();
+
+	EventLoop &operator = (const EventLoop &) = delete;
+
+private:
+	void add(int fd, uint32_t events, uint32_t id);
+	void watch_alarm(const string &path);
+	static sigset_t signals();
+
+	int epoll_fd_;
+	int timer_fd_;
+	int signal_fd_;
+	std::vector<int> alarm_fds_;
+	std::vector<string> alarm_paths_;
+	int signal_;
+	int alarm_;
+};
+
+
+}
+
+#endif /* THINKFAN_EVENTS_H_ */
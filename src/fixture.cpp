@@ -0,0 +1,208 @@
+/********************************************************************
+ * fixture.cpp: Fake sysfs/procfs files & a heap allocation counter for
+ *              thinkfan-bench and the tests.
+ * (C) 2015, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "error.h"
+#include "fixture.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <fstream>
+#include <sstream>
+
+
+namespace thinkfan {
+
+std::atomic<unsigned long long> num_allocs(0);
+
+}
+
+
+/* Counts every heap allocation through operator new, in all threads, so the
+ * benchmark & the tests can check that the steady-state control cycle doesn't
+ * do any. The other forms of operator new end up in this one. */
+void *operator new(std::size_t size)
+{
+	thinkfan::num_allocs.fetch_add(1, std::memory_order_relaxed);
+	if (void *p = std::malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept
+{ std::free(p); }
+
+void operator delete(void *p, std::size_t) noexcept
+{ std::free(p); }
+
+
+namespace thinkfan {
+
+
+static void make_dir(const string &path)
+{
+	if (::mkdir(path.c_str(), 0700) && errno != EEXIST)
+		throw IOerror("mkdir(" + path + "): ", errno);
+}
+
+
+static void write_file(const string &path, const string &content)
+{
+	std::ofstream f(path, std::ios_base::out | std::ios_base::trunc);
+	f << content;
+	if (!f.good())
+		throw IOerror("Writing " + path + ": ", errno);
+}
+
+
+/*----------------------------------------------------------------------------
+| Fixture: A directory that looks just enough like /proc/acpi/ibm and an     |
+| hwmon device to make the drivers happy. Temperatures are always written    |
+| with the same width through file descriptors that are kept open, so each   |
+| update costs exactly one pwrite() per file. That way, the benchmark's own  |
+| syscalls can be subtracted from the count.                                 |
+----------------------------------------------------------------------------*/
+
+
+Fixture::Fixture(const string &dir, unsigned int num_hwmon)
+: dir_(dir),
+  num_hwmon_(num_hwmon)
+{
+	make_dir(dir_);
+	make_dir(dir_ + "/proc");
+	make_dir(dir_ + "/proc/acpi");
+	make_dir(tp_dir());
+	make_dir(dir_ + "/hwmon");
+
+	files_.push_back(tp_dir() + "/fan");
+	reset_tp_fan();
+
+	files_.push_back(dir_ + "/hwmon/pwm1");
+	write_file(files_.back(), "0\n");
+	files_.push_back(dir_ + "/hwmon/pwm1_enable");
+	write_file(files_.back(), "2\n");
+
+	files_.push_back(tp_dir() + "/thermal");
+	for (unsigned int i = 0; i < num_hwmon_; ++i)
+		files_.push_back(hwmon_path(i));
+
+	for (unsigned int i = 3; i < files_.size(); ++i) {
+		int fd = ::open(files_[i].c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+		if (fd < 0)
+			throw IOerror("open(" + files_[i] + "): ", errno);
+		temp_fds_.push_back(fd);
+	}
+
+	set_temp(MIN_TEMP);
+}
+
+
+Fixture::~Fixture()
+{
+	for (int fd : temp_fds_)
+		::close(fd);
+	for (const string &f : files_)
+		::unlink(f.c_str());
+	::rmdir((dir_ + "/hwmon").c_str());
+	::rmdir(tp_dir().c_str());
+	::rmdir((dir_ + "/proc/acpi").c_str());
+	::rmdir((dir_ + "/proc").c_str());
+	::rmdir(dir_.c_str());
+}
+
+
+/* Unlike the real thing, the fake fan file takes on whatever is written to it
+ * (e.g. the initial level that a TpFanDriver restores when it goes away). */
+void Fixture::reset_tp_fan()
+{
+	write_file(tp_dir() + "/fan",
+			"status:\t\tenabled\n"
+			"speed:\t\t2000\n"
+			"level:\t\tauto\n"
+			"commands:\tlevel <level> (<level> is 0-7, auto, disengaged, full-speed)\n"
+			"commands:\tenable, disable\n"
+			"commands:\twatchdog <timeout> (<timeout> is 0 (off), 1-120 (seconds))\n");
+}
+
+
+string Fixture::hwmon_path(unsigned int i) const
+{ return dir_ + "/hwmon/temp" + std::to_string(i + 1) + "_input"; }
+
+
+void Fixture::set_temp(int t)
+{
+	char buf[TP_TEMPS * 5 + 32];
+	int len = snprintf(buf, sizeof(buf), "temperatures:");
+	for (unsigned int i = 0; i < TP_TEMPS; ++i)
+		len += snprintf(buf + len, sizeof(buf) - len, " %4d", t);
+	len += snprintf(buf + len, sizeof(buf) - len, "\n");
+	if (::pwrite(temp_fds_[0], buf, len, 0) != len)
+		throw IOerror("Writing " + files_[3] + ": ", errno);
+
+	len = snprintf(buf, sizeof(buf), "%7d\n", t * 1000);
+	for (unsigned int i = 1; i < temp_fds_.size(); ++i)
+		if (::pwrite(temp_fds_[i], buf, len, 0) != len)
+			throw IOerror("Writing " + files_[i + 3] + ": ", errno);
+}
+
+
+/* A PWM fan with num_levels evenly spaced levels, driven by all temperatures.
+ * In complex mode, every temperature gets the same limits, which is the worst
+ * case since nothing can be skipped. */
+string Fixture::write_config(unsigned int num_levels, bool complex)
+{
+	std::ostringstream conf;
+	conf << "pwm_fan " << dir_ << "/hwmon/pwm1\n";
+	conf << "tp_thermal " << tp_dir() << "/thermal\n";
+	for (unsigned int i = 0; i < num_hwmon_; ++i)
+		conf << "hwmon " << hwmon_path(i) << "\n";
+
+	const unsigned int num_temps = TP_TEMPS + num_hwmon_;
+	for (unsigned int i = 0; i < num_levels; ++i) {
+		int pwm = num_levels > 1 ? i * 255 / (num_levels - 1) : 255;
+		int lower = i == 0 ? 0 : BASE_TEMP + int(i) * LEVEL_STEP - 1;
+		int upper = i == num_levels - 1 ? 32767 : BASE_TEMP + int(i + 1) * LEVEL_STEP;
+		if (complex) {
+			conf << "{ " << pwm << "\n  (";
+			for (unsigned int t = 0; t < num_temps; ++t)
+				conf << " " << lower;
+			conf << " )\n  (";
+			for (unsigned int t = 0; t < num_temps; ++t)
+				conf << " " << upper;
+			conf << " )\n}\n";
+		}
+		else
+			conf << "(" << pwm << ", " << lower << ", " << upper << ")\n";
+	}
+
+	files_.push_back(dir_ + "/thinkfan.conf");
+	write_file(files_.back(), conf.str());
+	return files_.back();
+}
+
+
+
+}
@@ -0,0 +1,71 @@
+/********************************************************************
+ * fixture.h: Fake sysfs/procfs files & a heap allocation counter for
+ *            thinkfan-bench and the tests.
+ * (C) 2015, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#ifndef THINKFAN_FIXTURE_H_
+#define THINKFAN_FIXTURE_H_
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "thinkfan.h"
+
+namespace thinkfan {
+
+// Every heap allocation through operator new so far, in all threads
+extern std::atomic<unsigned long long> num_allocs;
+
+// Like most Thinkpads
+static const unsigned int TP_TEMPS = 16;
+
+// Generated fan levels are LEVEL_STEP °C apart, starting at BASE_TEMP.
+static const int BASE_TEMP = 30;
+static const int LEVEL_STEP = 2;
+static const int MIN_TEMP = 20;
+
+
+class Fixture {
+public:
+	Fixture(const string &dir, unsigned int num_hwmon);
+	Fixture(const Fixture &) = delete;
+	~Fixture();
+
+	void set_temp(int t);
+	void reset_tp_fan();
+	unsigned int writes_per_update() const { return temp_fds_.size(); }
+	string write_config(unsigned int num_levels, bool complex);
+	string tp_dir() const { return dir_ + "/proc/acpi/ibm"; }
+	string hwmon_path(unsigned int i) const;
+
+	Fixture &operator = (const Fixture &) = delete;
+
+private:
+	const string dir_;
+	const unsigned int num_hwmon_;
+	std::vector<int> temp_fds_;
+	std::vector<string> files_;
+};
+
+
+}
+
+#endif /* THINKFAN_FIXTURE_H_ */
@@ -0,0 +1,267 @@
+/********************************************************************
+ * hwmon.cpp: Name-based lookup of hwmon attributes.
+ * (C) 2015, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+
+#include "error.h"
+#include "hwmon.h"
+#include "message.h"
+
+#include <fstream>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace thinkfan {
+
+static const string BOOT_ID_FILE("/proc/sys/kernel/random/boot_id");
+
+
+static bool read_line(const string &path, string &line)
+{
+	std::ifstream f(path);
+	return static_cast<bool>(std::getline(f, line));
+}
+
+
+static string kind_prefix(HwmonIndex::Kind kind)
+{ return kind == HwmonIndex::TEMP ? "temp" : "pwm"; }
+
+
+/* Whether s[begin, end) is a number, like the 12 in temp12_input */
+static bool is_index(const string &s, string::size_type begin, string::size_type end)
+{
+	if (begin >= end)
+		return false;
+	for (string::size_type i = begin; i < end; ++i)
+		if (s[i] < '0' || s[i] > '9')
+			return false;
+	return true;
+}
+
+
+/*----------------------------------------------------------------------------
+| HwmonIndex: There's one per process, so a config reload costs no rescan.   |
+| A cached path is only used if its hwmon device still has the same name,    |
+| otherwise (e.g. after a module was reloaded) the tree is scanned again.    |
+| Cache entries are keyed by kind & NAME:LABEL, and the whole cache file is  |
+| ignored if it was written during a different boot.                         |
+----------------------------------------------------------------------------*/
+
+bool HwmonIndex::dirty_ = false;
+
+
+HwmonIndex::HwmonIndex()
+: scanned_(false)
+{
+	read_line(BOOT_ID_FILE, boot_id_);
+	load_cache();
+}
+
+
+HwmonIndex &HwmonIndex::get()
+{
+	static HwmonIndex instance;
+	return instance;
+}
+
+
+/* Without a dirty cache, the index may not even exist, and it isn't created
+ * just to find that out. */
+void HwmonIndex::save()
+{
+	if (!dirty_)
+		return;
+	get().save_cache();
+	dirty_ = false;
+}
+
+
+/* Absolute (and relative) paths have always worked, so only something like
+ * "coretemp:Core 0" is taken as a name. */
+bool HwmonIndex::is_name(const string &path)
+{ return path.length() && path[0] != '/' && path.find(':') != string::npos; }
+
+
+string HwmonIndex::resolve(const string &name, Kind kind)
+{
+	const string key = kind_prefix(kind) + " " + name;
+	const string::size_type colon = name.find(':');
+	const string chip = name.substr(0, colon);
+	const string label = name.substr(colon + 1);
+
+	std::map<string, string>::const_iterator cached = cache_.find(key);
+	if (cached != cache_.end()) {
+		if (valid(cached->second, chip))
+			return cached->second;
+		scanned_ = false;
+	}
+
+	// An index from an earlier lookup may be outdated, so if it has no valid
+	// answer, look once more in a fresh one.
+	const Attribute *found = nullptr;
+	for (bool fresh = false; !found; ) {
+		if (!scanned_) {
+			scan();
+			fresh = true;
+		}
+		found = find(chip, label, kind, name);
+		if (found && !valid(found->path, chip))
+			found = nullptr;
+		if (!found) {
+			if (fresh)
+				throw ConfigError(MSG_HWMON_NOTFOUND(name));
+			scanned_ = false;
+		}
+	}
+
+	log(TF_DBG) << MSG_HWMON_RESOLVED(name, found->path) << flush;
+	cache_[key] = found->path;
+	dirty_ = true;
+	return found->path;
+}
+
+
+const HwmonIndex::Attribute *HwmonIndex::find(const string &chip, const string &label, Kind kind,
+		const string &name) const
+{
+	const Attribute *rv = nullptr;
+	for (const Attribute &attr : attributes_) {
+		if (attr.kind != kind || attr.chip != chip || (attr.label != label && attr.base != label))
+			continue;
+		if (rv)
+			throw ConfigError(MSG_HWMON_AMBIGUOUS(name, rv->path, attr.path));
+		rv = &attr;
+	}
+	return rv;
+}
+
+
+void HwmonIndex::scan()
+{
+	attributes_.clear();
+	scanned_ = true;
+
+	DIR *root = ::opendir(HWMON_ROOT);
+	if (!root)
+		throw IOerror(MSG_HWMON_SCAN(HWMON_ROOT), errno);
+
+	// Sorted, so an ambiguity is always reported the same way
+	std::vector<string> devices;
+	while (struct dirent *ent = ::readdir(root))
+		if (ent->d_name[0] != '.')
+			devices.push_back(string(HWMON_ROOT "/") + ent->d_name);
+	::closedir(root);
+	std::sort(devices.begin(), devices.end());
+
+	for (const string &dev : devices) {
+		string chip;
+		if (!read_line(dev + "/name", chip))
+			continue;
+
+		DIR *dir = ::opendir(dev.c_str());
+		if (!dir)
+			continue;
+		while (struct dirent *ent = ::readdir(dir)) {
+			const string file(ent->d_name);
+			static const string temp("temp"), input("_input"), pwm("pwm");
+			Attribute attr;
+			attr.chip = chip;
+
+			if (!file.compare(0, temp.length(), temp)
+					&& file.length() > input.length()
+					&& !file.compare(file.length() - input.length(), string::npos, input)
+					&& is_index(file, temp.length(), file.length() - input.length())) {
+				attr.kind = TEMP;
+				attr.base = file.substr(0, file.length() - input.length());
+				read_line(dev + "/" + attr.base + "_label", attr.label);
+			}
+			else if (!file.compare(0, pwm.length(), pwm) && is_index(file, pwm.length(), file.length())) {
+				attr.kind = PWM;
+				attr.base = file;
+			}
+			else
+				continue;
+
+			attr.path = dev + "/" + file;
+			attributes_.push_back(attr);
+		}
+		::closedir(dir);
+	}
+}
+
+
+bool HwmonIndex::valid(const string &path, const string &chip) const
+{
+	string name;
+	return read_line(path.substr(0, path.rfind('/')) + "/name", name) && name == chip
+			&& ::access(path.c_str(), F_OK) == 0;
+}
+
+
+/* One line with the boot ID, then one line per entry: key, tab, path. */
+void HwmonIndex::load_cache()
+{
+	std::ifstream f(HWMON_CACHE);
+	string line;
+	if (!std::getline(f, line) || !boot_id_.length() || line != boot_id_)
+		return;
+
+	while (std::getline(f, line)) {
+		string::size_type tab = line.find('\t');
+		if (tab != string::npos)
+			cache_[line.substr(0, tab)] = line.substr(tab + 1);
+	}
+}
+
+
+/* The cache is merely an optimization, so failing to write it isn't an
+ * error. */
+void HwmonIndex::save_cache() const
+{
+	if (!boot_id_.length())
+		return;
+
+	const string path(HWMON_CACHE);
+	const string tmp_path = path + ".tmp";
+	::mkdir(path.substr(0, path.rfind('/')).c_str(), 0755);
+
+	{
+		std::ofstream f(tmp_path, std::ios_base::out | std::ios_base::trunc);
+		f << boot_id_ << "\n";
+		for (const std::pair<const string, string> &entry : cache_)
+			f << entry.first << "\t" << entry.second << "\n";
+		f.close();
+		if (f.fail()) {
+			log(TF_DBG) << MSG_HWMON_CACHE(path) << string(std::strerror(errno)) << flush;
+			std::remove(tmp_path.c_str());
+			return;
+		}
+	}
+	if (std::rename(tmp_path.c_str(), path.c_str()))
+		log(TF_DBG) << MSG_HWMON_CACHE(path) << string(std::strerror(errno)) << flush;
+}
+
+
+}
@@ -0,0 +1,79 @@
+/********************************************************************
+ * hwmon.h: Name-based lookup of hwmon attributes.
+ * (C) 2015, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+
+#ifndef THINKFAN_HWMON_H_
+#define THINKFAN_HWMON_H_
+
+#include <vector>
+#include <map>
+
+#include "thinkfan.h"
+
+namespace thinkfan {
+
+
+/* Resolves a hwmon attribute given as NAME:LABEL, where NAME is the content
+ * of a hwmon device's `name' file and LABEL is either the content of an
+ * attribute's label file (e.g. temp2_label) or the attribute itself (e.g.
+ * temp2 or pwm1). Unlike the hwmonN number, both are stable across reboots.
+ * The sysfs tree is only scanned on the first lookup that misses the cache,
+ * and resolved paths are kept in HWMON_CACHE until the next reboot. New
+ * entries are only written out by save(), once per config. */
+class HwmonIndex {
+public:
+	enum Kind { TEMP, PWM };
+
+	static bool is_name(const string &path);
+	static HwmonIndex &get();
+
+	string resolve(const string &name, Kind kind);
+
+	// Writes the cache if anything has been resolved anew since the last save()
+	static void save();
+
+private:
+	struct Attribute {
+		string chip;
+		string base;
+		string label;
+		string path;
+		Kind kind;
+	};
+
+	HwmonIndex();
+	void scan();
+	const Attribute *find(const string &chip, const string &label, Kind kind, const string &name) const;
+	void load_cache();
+	void save_cache() const;
+	bool valid(const string &path, const string &chip) const;
+
+	std::vector<Attribute> attributes_;
+	bool scanned_;
+	string boot_id_;
+	std::map<string, string> cache_;
+	static bool dirty_;
+};
+
+
+}
+
+#endif /* THINKFAN_HWMON_H_ */
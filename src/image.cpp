@@ -0,0 +1,496 @@
+/********************************************************************
+ * image.cpp: Compiled configs that are loaded without parsing.
+ * (C) 2015, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "error.h"
+#include "image.h"
+#include "config.h"
+#include "message.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <memory>
+#include <vector>
+
+namespace thinkfan {
+
+static const char IMAGE_MAGIC[8] = { 'T', 'F', 'I', 'M', 'A', 'G', 'E', '1' };
+
+static const uint64_t FNV_OFFSET = 0xcbf29ce484222325ull;
+static const uint64_t FNV_PRIME = 0x100000001b3ull;
+
+
+static uint64_t fnv1a(const void *data, size_t len, uint64_t hash = FNV_OFFSET)
+{
+	const unsigned char *p = static_cast<const unsigned char *>(data);
+	for (size_t i = 0; i < len; ++i) {
+		hash ^= p[i];
+		hash *= FNV_PRIME;
+	}
+	return hash;
+}
+
+
+static size_t align8(size_t n)
+{ return (n + 7) & ~size_t(7); }
+
+
+/* What an image remembers about its text config. */
+struct Source {
+	int64_t mtime_ns;
+	uint64_t size;
+	uint64_t hash;
+
+	// Without the hash, if the file can't be read (the parser will complain)
+	bool stat(const string &path);
+	bool hash_file(const string &path);
+};
+
+
+bool Source::stat(const string &path)
+{
+	struct stat st;
+	if (::stat(path.c_str(), &st))
+		return false;
+	mtime_ns = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+	size = uint64_t(st.st_size);
+	return true;
+}
+
+
+bool Source::hash_file(const string &path)
+{
+	int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	char buf[1 << 16];
+	ssize_t len;
+	hash = FNV_OFFSET;
+	while ((len = ::read(fd, buf, sizeof(buf))) > 0)
+		hash = fnv1a(buf, size_t(len), hash);
+	::close(fd);
+	return len == 0;
+}
+
+
+/* The command line options that the parse result depends on, so that an
+ * image isn't loaded under options it wasn't compiled with. */
+static uint32_t current_options()
+{
+	uint32_t rv = 0;
+	if (export_address.length())
+		rv |= IMAGE_OPT_EXPORT;
+	if (!chk_sanity)
+		rv |= IMAGE_OPT_INSANE;
+	return rv;
+}
+
+
+/*----------------------------------------------------------------------------
+| Writing: All sections are collected in memory first. The image is written  |
+| under a temporary name and then renamed into place, so a thinkfan that is  |
+| (re)loading its config at the same time sees either the old or the new     |
+| image, never a partial one.                                                |
+----------------------------------------------------------------------------*/
+
+namespace {
+
+struct ImageBuilder {
+	std::vector<ImageGroup> groups;
+	std::vector<ImageSensor> sensors;
+	std::vector<ImageLoad> loads;
+	std::vector<ImageFan> fans;
+	std::vector<ImageLevel> levels;
+	std::vector<int32_t> ints;
+	string strings;
+
+	uint32_t str(const string &s) {
+		uint32_t rv = uint32_t(strings.size());
+		strings += s;
+		strings += '\0';
+		return rv;
+	}
+
+	uint32_t append(const std::vector<int> &v) {
+		uint32_t rv = uint32_t(ints.size());
+		ints.insert(ints.end(), v.begin(), v.end());
+		return rv;
+	}
+};
+
+
+template<class T> void put(std::vector<char> &buf, uint64_t &offset, const T *data, size_t count)
+{
+	offset = buf.size();
+	const char *p = reinterpret_cast<const char *>(data);
+	buf.insert(buf.end(), p, p + count * sizeof(T));
+	buf.resize(align8(buf.size()), 0);
+}
+
+}
+
+
+void ConfigImage::compile(const string &source)
+{
+	// Before parsing, so an image never claims to be newer than what it contains
+	Source src;
+	if (!src.stat(source) || !src.hash_file(source))
+		throw IOerror(MSG_IMAGE_SOURCE(source), errno);
+
+	std::unique_ptr<Config> config(Config::parse(source, nullptr));
+
+	if (config->fan_specs_.size() != config->fans_.size()
+			|| config->sensor_specs_.size() != config->sensors_.size()
+			|| config->load_specs_.size() != config->loads_.size())
+		throw Bug("ConfigImage::compile(): Specs don't match the drivers.");
+
+	ImageBuilder b;
+	for (const SensorGroup &group : config->groups_)
+		b.groups.push_back({ b.str(group.name), group.rank });
+
+	for (const SensorSpec &spec : config->sensor_specs_) {
+		ImageSensor s = ImageSensor();
+		s.type = spec.type;
+		s.path = b.str(spec.path);
+		s.group = b.str(spec.group);
+		s.trend = spec.trend;
+		s.correction = b.append(spec.correction);
+		s.num_correction = uint32_t(spec.correction.size());
+		s.num_temps = spec.num_temps;
+		s.poll_interval = spec.poll_interval.count();
+		s.timeout = spec.timeout.count();
+		s.horizon = spec.horizon.count();
+		s.stale = spec.stale.count();
+		s.from = b.str(spec.from);
+		b.sensors.push_back(s);
+	}
+
+	for (const LoadSpec &spec : config->load_specs_)
+		b.loads.push_back({ spec.type, b.str(spec.path), spec.gain, 0 });
+
+	for (size_t i = 0; i < config->fans_.size(); ++i) {
+		const FanSpec &spec = config->fan_specs_[i];
+		const FanConfig *fan_cfg = config->fans_[i];
+		ImageFan f = ImageFan();
+		f.type = spec.type;
+		f.path = b.str(spec.path);
+		f.first_level = uint32_t(b.levels.size());
+		f.num_levels = uint32_t(fan_cfg->levels().size());
+		f.ramp = spec.ramp;
+		f.continuous = spec.continuous;
+		f.verify = spec.verify;
+		b.fans.push_back(f);
+
+		for (const Level *level : fan_cfg->levels()) {
+			ImageLevel l;
+			l.str = b.str(level->str());
+			l.num_str = b.str(level->num_str());
+			l.num = level->num();
+			l.complex = dynamic_cast<const ComplexLevel *>(level) != nullptr;
+			l.limits = b.append(level->lower_limit());
+			b.append(level->upper_limit());
+			l.width = uint32_t(level->lower_limit().size());
+			b.levels.push_back(l);
+		}
+	}
+
+	ImageHeader hdr = ImageHeader();
+	std::vector<char> buf(sizeof(hdr), 0);
+	put(buf, hdr.groups, b.groups.data(), b.groups.size());
+	put(buf, hdr.sensors, b.sensors.data(), b.sensors.size());
+	put(buf, hdr.loads, b.loads.data(), b.loads.size());
+	put(buf, hdr.fans, b.fans.data(), b.fans.size());
+	put(buf, hdr.levels, b.levels.data(), b.levels.size());
+	put(buf, hdr.ints, b.ints.data(), b.ints.size());
+	put(buf, hdr.strings, b.strings.data(), b.strings.size());
+
+	std::memcpy(hdr.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+	hdr.version = IMAGE_VERSION;
+	hdr.header_size = sizeof(hdr);
+	hdr.size = buf.size();
+	hdr.checksum = fnv1a(buf.data() + sizeof(hdr), buf.size() - sizeof(hdr));
+	hdr.source_mtime_ns = src.mtime_ns;
+	hdr.source_size = src.size;
+	hdr.source_hash = src.hash;
+	hdr.options = current_options();
+	hdr.num_groups = uint32_t(b.groups.size());
+	hdr.num_sensors = uint32_t(b.sensors.size());
+	hdr.num_loads = uint32_t(b.loads.size());
+	hdr.num_fans = uint32_t(b.fans.size());
+	hdr.num_levels = uint32_t(b.levels.size());
+	hdr.num_ints = uint32_t(b.ints.size());
+	hdr.strings_size = uint32_t(b.strings.size());
+	std::memcpy(buf.data(), &hdr, sizeof(hdr));
+
+	const string image = path(source);
+	const string tmp = image + ".tmp";
+	int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		throw IOerror(MSG_IMAGE_WRITE(tmp), errno);
+	size_t written = 0;
+	while (written < buf.size()) {
+		ssize_t len = ::write(fd, buf.data() + written, buf.size() - written);
+		if (len < 0) {
+			int err = errno;
+			::close(fd);
+			::unlink(tmp.c_str());
+			throw IOerror(MSG_IMAGE_WRITE(tmp), err);
+		}
+		written += size_t(len);
+	}
+	if (::fsync(fd) || ::close(fd) || ::rename(tmp.c_str(), image.c_str())) {
+		int err = errno;
+		::unlink(tmp.c_str());
+		throw IOerror(MSG_IMAGE_WRITE(image), err);
+	}
+
+	log(TF_INF) << MSG_IMAGE_WRITTEN(image) << flush;
+
+	// Nothing has been written to the fans, and a running thinkfan may own
+	// them, so the drivers mustn't reset them.
+	config.release();
+}
+
+
+/*----------------------------------------------------------------------------
+| Loading: The image is mapped read-only, and everything is checked before   |
+| it's used, since it's just a file that anyone with write access to the     |
+| config directory (or a crash while writing it) may have mangled. Anything  |
+| that doesn't fit makes us fall back to parsing the text.                   |
+----------------------------------------------------------------------------*/
+
+namespace {
+
+class Mapping {
+public:
+	Mapping(void *addr, size_t size) : addr_(addr), size_(size) {}
+	Mapping(const Mapping &) = delete;
+	~Mapping() { ::munmap(addr_, size_); }
+	const char *data() const { return static_cast<const char *>(addr_); }
+	size_t size() const { return size_; }
+	Mapping &operator = (const Mapping &) = delete;
+private:
+	void *addr_;
+	size_t size_;
+};
+
+
+template<class T> const T *section(const Mapping &map, uint64_t offset, uint32_t count)
+{
+	if (offset % 8 || offset > map.size() || count > (map.size() - offset) / sizeof(T))
+		return nullptr;
+	return reinterpret_cast<const T *>(map.data() + offset);
+}
+
+
+struct ImageView {
+	const ImageHeader *hdr;
+	const ImageGroup *groups;
+	const ImageSensor *sensors;
+	const ImageLoad *loads;
+	const ImageFan *fans;
+	const ImageLevel *levels;
+	const int32_t *ints;
+	const char *strings;
+
+	bool map(const Mapping &map);
+	bool valid() const;
+	bool str_ok(uint32_t s) const { return s < hdr->strings_size; }
+	bool ints_ok(uint32_t first, uint64_t count) const { return first + count <= hdr->num_ints; }
+	string str(uint32_t s) const { return string(strings + s); }
+};
+
+
+bool ImageView::map(const Mapping &map)
+{
+	if (map.size() < sizeof(ImageHeader))
+		return false;
+	hdr = reinterpret_cast<const ImageHeader *>(map.data());
+	if (std::memcmp(hdr->magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC))
+			|| hdr->version != IMAGE_VERSION
+			|| hdr->header_size != sizeof(ImageHeader)
+			|| hdr->size != map.size())
+		return false;
+
+	groups = section<ImageGroup>(map, hdr->groups, hdr->num_groups);
+	sensors = section<ImageSensor>(map, hdr->sensors, hdr->num_sensors);
+	loads = section<ImageLoad>(map, hdr->loads, hdr->num_loads);
+	fans = section<ImageFan>(map, hdr->fans, hdr->num_fans);
+	levels = section<ImageLevel>(map, hdr->levels, hdr->num_levels);
+	ints = section<int32_t>(map, hdr->ints, hdr->num_ints);
+	strings = section<char>(map, hdr->strings, hdr->strings_size);
+	return groups && sensors && loads && fans && levels && ints && strings;
+}
+
+
+/* Only the references & enums, the rest has been checked by the parser when
+ * the image was compiled. */
+bool ImageView::valid() const
+{
+	if (hdr->strings_size == 0 || strings[hdr->strings_size - 1] != '\0')
+		return false;
+
+	for (const ImageGroup *g = groups; g < groups + hdr->num_groups; ++g)
+		if (!str_ok(g->name))
+			return false;
+
+	for (const ImageSensor *s = sensors; s < sensors + hdr->num_sensors; ++s)
+		if (s->type > SensorSpec::UDP || !str_ok(s->path) || !str_ok(s->group) || !str_ok(s->from)
+				|| s->trend > TemperatureState::TREND_EWMA
+				|| !ints_ok(s->correction, s->num_correction))
+			return false;
+
+	for (const ImageLoad *l = loads; l < loads + hdr->num_loads; ++l)
+		if (l->type > LoadSpec::NVML || !str_ok(l->path))
+			return false;
+
+	for (const ImageFan *f = fans; f < fans + hdr->num_fans; ++f)
+		if (f->type > FanSpec::HWMON || !str_ok(f->path)
+				|| uint64_t(f->first_level) + f->num_levels > hdr->num_levels)
+			return false;
+
+	for (const ImageLevel *l = levels; l < levels + hdr->num_levels; ++l)
+		if (!str_ok(l->str) || !str_ok(l->num_str) || l->width == 0
+				|| (!l->complex && l->width != 1)
+				|| !ints_ok(l->limits, 2 * uint64_t(l->width)))
+			return false;
+
+	return true;
+}
+
+}
+
+
+string ConfigImage::path(const string &source)
+{ return source + ".image"; }
+
+
+Config *ConfigImage::load(const string &source, Config *lender)
+{
+	const string image = path(source);
+	int fd = ::open(image.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno != ENOENT) {
+			string msg = std::strerror(errno);
+			log(TF_WRN) << MSG_IMAGE_OPEN(image) << msg << flush;
+		}
+		return nullptr;
+	}
+
+	struct stat st;
+	void *addr = MAP_FAILED;
+	if (!::fstat(fd, &st) && st.st_size > 0)
+		addr = ::mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (addr == MAP_FAILED) {
+		log(TF_WRN) << MSG_IMAGE_INVALID(image) << flush;
+		return nullptr;
+	}
+	Mapping map(addr, size_t(st.st_size));
+
+	ImageView view;
+	if (!view.map(map)) {
+		log(TF_WRN) << MSG_IMAGE_INVALID(image) << flush;
+		return nullptr;
+	}
+
+	// The cheap comparison first, the source is only read if it looks unchanged
+	Source src;
+	if (!src.stat(source))
+		return nullptr;
+	if (src.mtime_ns != view.hdr->source_mtime_ns || src.size != view.hdr->source_size
+			|| !src.hash_file(source) || src.hash != view.hdr->source_hash) {
+		log(TF_WRN) << MSG_IMAGE_STALE(image, source) << flush;
+		return nullptr;
+	}
+	if (view.hdr->options != current_options()) {
+		log(TF_WRN) << MSG_IMAGE_OPTIONS(image) << flush;
+		return nullptr;
+	}
+
+	if (fnv1a(map.data() + sizeof(ImageHeader), map.size() - sizeof(ImageHeader)) != view.hdr->checksum
+			|| !view.valid()) {
+		log(TF_WRN) << MSG_IMAGE_INVALID(image) << flush;
+		return nullptr;
+	}
+
+	// Same order as in a config that passes the parser: Groups must be known
+	// before their sensors, and levels go to the fan that was added last.
+	std::unique_ptr<Config> rv(new Config(lender));
+
+	for (const ImageGroup *g = view.groups; g < view.groups + view.hdr->num_groups; ++g) {
+		SensorGroup group;
+		group.name = view.str(g->name);
+		group.rank = g->rank;
+		rv->add_group(group);
+	}
+
+	for (const ImageSensor *s = view.sensors; s < view.sensors + view.hdr->num_sensors; ++s) {
+		SensorSpec spec(SensorSpec::Type(s->type), view.str(s->path));
+		spec.group = view.str(s->group);
+		spec.trend = TemperatureState::Trend(s->trend);
+		spec.correction.assign(view.ints + s->correction, view.ints + s->correction + s->num_correction);
+		spec.num_temps = s->num_temps;
+		spec.poll_interval = secondsf(s->poll_interval);
+		spec.timeout = secondsf(s->timeout);
+		spec.horizon = secondsf(s->horizon);
+		spec.stale = secondsf(s->stale);
+		spec.from = view.str(s->from);
+		rv->add_sensor(spec);
+	}
+
+	for (const ImageLoad *l = view.loads; l < view.loads + view.hdr->num_loads; ++l) {
+		LoadSpec spec;
+		spec.type = LoadSpec::Type(l->type);
+		spec.path = view.str(l->path);
+		spec.gain = l->gain;
+		rv->add_load(spec);
+	}
+
+	for (const ImageFan *f = view.fans; f < view.fans + view.hdr->num_fans; ++f) {
+		FanSpec spec(FanSpec::Type(f->type), view.str(f->path));
+		spec.continuous = f->continuous;
+		spec.ramp = f->ramp;
+		spec.verify = f->verify;
+		rv->add_fan(spec);
+
+		// Checked for order & overlaps just like the parser's levels
+		FanConfig *fan_cfg = rv->fans_.back();
+		for (const ImageLevel *l = view.levels + f->first_level; l < view.levels + f->first_level + f->num_levels; ++l) {
+			const int *limits = view.ints + l->limits;
+			if (l->complex)
+				fan_cfg->add_level(std::unique_ptr<const Level>(new ComplexLevel(view.str(l->str), l->num,
+						view.str(l->num_str), limits, l->width)));
+			else
+				fan_cfg->add_level(std::unique_ptr<const Level>(new SimpleLevel(view.str(l->str), l->num,
+						view.str(l->num_str), limits)));
+		}
+	}
+
+	log(TF_INF) << MSG_IMAGE_LOADED(image) << flush;
+	return rv.release();
+}
+
+
+}
@@ -0,0 +1,147 @@
+/********************************************************************
+ * image.h: Compiled configs that are loaded without parsing.
+ * (C) 2015, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#ifndef THINKFAN_IMAGE_H_
+#define THINKFAN_IMAGE_H_
+
+#include <cstdint>
+#include <cstddef>
+
+#include "thinkfan.h"
+
+namespace thinkfan {
+
+class Config;
+
+
+/* Layout of a config image: This header, followed by the sections it points
+ * to, each aligned to 8 bytes:
+ *   ImageGroup groups[num_groups]
+ *   ImageSensor sensors[num_sensors]		(in config order)
+ *   ImageLoad loads[num_loads]
+ *   ImageFan fans[num_fans]
+ *   ImageLevel levels[num_levels]			(of all fans, one after another)
+ *   int32_t ints[num_ints]					(level limits & correction values)
+ *   char strings[strings_size]				(NUL-terminated)
+ * Strings are referenced by their offset into strings, and limits &
+ * corrections by their index into ints. The checksum (64-bit FNV-1a) covers
+ * everything after the header. All values are in host byte order. */
+struct ImageHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t header_size;
+	uint64_t size;
+	uint64_t checksum;
+	int64_t source_mtime_ns;	// Of the text config it was compiled from
+	uint64_t source_size;
+	uint64_t source_hash;		// FNV-1a of the text config
+	uint32_t num_groups;
+	uint32_t num_sensors;
+	uint32_t num_loads;
+	uint32_t num_fans;
+	uint32_t num_levels;
+	uint32_t num_ints;
+	uint32_t strings_size;
+	uint32_t options;			// IMAGE_OPT_*, as given when it was compiled
+	uint64_t groups;			// Offsets from the start of the file
+	uint64_t sensors;
+	uint64_t loads;
+	uint64_t fans;
+	uint64_t levels;
+	uint64_t ints;
+	uint64_t strings;
+};
+
+struct ImageGroup {
+	uint32_t name;
+	uint32_t rank;
+};
+
+struct ImageSensor {
+	uint32_t type;				// SensorSpec::Type
+	uint32_t path;				// As in the config, i.e. a hwmon name isn't resolved
+	uint32_t group;				// Empty if none
+	uint32_t trend;
+	uint32_t correction;
+	uint32_t num_correction;
+	uint32_t num_temps;			// Only for udp
+	float poll_interval;
+	float timeout;
+	float horizon;
+	float stale;				// Only for udp
+	uint32_t from;				// Only for udp
+};
+
+struct ImageLoad {
+	uint32_t type;				// LoadSpec::Type
+	uint32_t path;
+	float gain;
+	uint32_t reserved;
+};
+
+struct ImageFan {
+	uint32_t type;				// FanSpec::Type
+	uint32_t path;
+	uint32_t first_level;
+	uint32_t num_levels;
+	float ramp;
+	uint8_t continuous;
+	uint8_t verify;
+	uint8_t reserved[2];
+};
+
+struct ImageLevel {
+	uint32_t str;				// What is written to the fan
+	uint32_t num_str;
+	int32_t num;
+	uint32_t complex;
+	uint32_t limits;			// width lower limits, followed by width upper limits
+	uint32_t width;
+};
+
+constexpr uint32_t IMAGE_VERSION = 3;
+
+// Command line options that change what the parser accepts
+constexpr uint32_t IMAGE_OPT_EXPORT = 1 << 0;		// --export, may have no fans
+constexpr uint32_t IMAGE_OPT_INSANE = 1 << 1;		// -D
+
+
+/* A config that has been parsed once and is then loaded by read_config()
+ * without the parser, as long as the text config and the options that affect
+ * parsing haven't changed since. The checks on the whole config still run. The image lives next to the text config, under the
+ * same name plus ".image". The drivers are still made from what the image
+ * says, so hwmon names are resolved & sensors are opened as usual. */
+class ConfigImage {
+public:
+	static string path(const string &source);
+
+	// Parses & checks the text config (even if there's a valid image) and
+	// writes its image.
+	static void compile(const string &source);
+
+	// Returns nullptr if there's no image, or if it doesn't match the source
+	static Config *load(const string &source, Config *lender);
+};
+
+
+}
+
+#endif /* THINKFAN_IMAGE_H_ */
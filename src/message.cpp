@@ -24,6 +24,15 @@
 #include "message.h"
 #include <syslog.h>
 #include <iostream>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <system_error>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
 
 
 namespace thinkfan {
@@ -59,11 +68,90 @@ LogLevel &operator++(LogLevel &l)
 }
 
 
+constexpr size_t LogRing::size;
+
+
+LogRing::LogRing()
+: buf_(new char[size]),
+  head_(0),
+  tail_(0),
+  dropped_(0)
+{}
+
+
+void LogRing::copy_in(size_t pos, const void *src, size_t len)
+{
+	size_t offset = pos & (size - 1);
+	size_t first = std::min(len, size - offset);
+	std::memcpy(buf_.get() + offset, src, first);
+	std::memcpy(buf_.get(), static_cast<const char *>(src) + first, len - first);
+}
+
+
+void LogRing::copy_out(size_t pos, void *dst, size_t len) const
+{
+	size_t offset = pos & (size - 1);
+	size_t first = std::min(len, size - offset);
+	std::memcpy(dst, buf_.get() + offset, first);
+	std::memcpy(static_cast<char *>(dst) + first, buf_.get(), len - first);
+}
+
+
+bool LogRing::push(LogLevel lvl, const std::string &msg)
+{
+	const size_t head = head_.load(std::memory_order_relaxed);
+	const size_t tail = tail_.load(std::memory_order_acquire);
+
+	// A message that doesn't even fit into the empty ring is truncated.
+	Header hdr { lvl, static_cast<unsigned int>(std::min(msg.length(), size - sizeof(Header))) };
+	const size_t needed = sizeof(Header) + hdr.len;
+
+	if (unlikely(size - (head - tail) < needed)) {
+		dropped_.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	copy_in(head, &hdr, sizeof(hdr));
+	copy_in(head + sizeof(hdr), msg.data(), hdr.len);
+	head_.store(head + needed, std::memory_order_release);
+	return true;
+}
+
+
+bool LogRing::pop(LogLevel &lvl, std::string &msg)
+{
+	const size_t tail = tail_.load(std::memory_order_relaxed);
+	const size_t head = head_.load(std::memory_order_acquire);
+	if (tail == head)
+		return false;
+
+	Header hdr;
+	copy_out(tail, &hdr, sizeof(hdr));
+	lvl = static_cast<LogLevel>(hdr.lvl);
+	msg.resize(hdr.len);
+	copy_out(tail + sizeof(hdr), &msg[0], hdr.len);
+	tail_.store(tail + sizeof(hdr) + hdr.len, std::memory_order_release);
+	return true;
+}
+
+
+unsigned int LogRing::take_dropped()
+{ return dropped_.exchange(0, std::memory_order_relaxed); }
+
+
+
 Logger::Logger()
 : syslog_(false),
   log_lvl_(DEFAULT_LOG_LVL),
-  msg_lvl_(DEFAULT_LOG_LVL)
-{}
+  msg_lvl_(DEFAULT_LOG_LVL),
+  enabled_(true),
+  wakeup_fd_(-1),
+  stop_(false)
+{
+	// Messages are assembled in here. Since clear() keeps the capacity, this
+	// doesn't allocate again unless we get some really long message.
+	msg_pfx_.reserve(1024);
+}
 
 
 Logger &Logger::instance()
@@ -98,6 +186,7 @@ Logger &log(LogLevel lvl)
 Logger::~Logger()
 {
 	flush();
+	stop_writer();
 	if (syslog_) closelog();
 }
 
@@ -109,23 +198,125 @@ void Logger::enable_syslog()
 }
 
 
-Logger &Logger::flush()
+/* Hand all further messages to a background thread, so a stalled syslog
+ * or a slow terminal can't hold up the control loop. Must be called after
+ * forking since threads don't survive a fork(). */
+void Logger::start_writer()
 {
-	if (msg_pfx_.length() == 0) return *this;
-	if (msg_lvl_ <= log_lvl_) {
-		if (syslog_) {
+	if (writer_.joinable())
+		return;
+
+	wakeup_fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wakeup_fd_ < 0) {
+		string msg = std::strerror(errno);
+		level(TF_WRN) << MSG_LOG_SYNC("eventfd(): " + msg) << thinkfan::flush;
+		return;
+	}
+
+	// The writer inherits a fully blocked signal mask, so our signal handler
+	// only ever runs on the control thread.
+	sigset_t all, old;
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+
+	stop_.store(false);
+	try {
+		writer_ = std::thread(&Logger::writer_loop, this);
+	} catch (std::system_error &e) {
+		::close(wakeup_fd_);
+		wakeup_fd_ = -1;
+		pthread_sigmask(SIG_SETMASK, &old, nullptr);
+		level(TF_WRN) << MSG_LOG_SYNC(e.what()) << thinkfan::flush;
+		return;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, nullptr);
+}
+
+
+// Write out everything that's still queued and go back to logging synchronously.
+void Logger::stop_writer()
+{
+	if (!writer_.joinable())
+		return;
+
+	stop_.store(true, std::memory_order_release);
+	wake_writer();
+	writer_.join();
+	::close(wakeup_fd_);
+	wakeup_fd_ = -1;
+}
+
+
+void Logger::wake_writer()
+{
+	// Can't block since the eventfd is non-blocking. The only possible error
+	// is a counter overflow, and then the writer is awake anyways.
+	const uint64_t one = 1;
+	ssize_t rv = ::write(wakeup_fd_, &one, sizeof(one));
+	(void)rv;
+}
+
+
+void Logger::writer_loop()
+{
+	LogLevel lvl;
+	string msg;
+	msg.reserve(1024);
+	struct pollfd pfd = { wakeup_fd_, POLLIN, 0 };
+
+	while (true) {
+		// Anything pushed before stop_writer() is seen by the pop() below.
+		bool stopping = stop_.load(std::memory_order_acquire);
+
+		while (ring_.pop(lvl, msg))
+			write(lvl, msg);
+
+		unsigned int dropped = ring_.take_dropped();
+		if (unlikely(dropped > 0))
+			write(TF_WRN, "WARNING: " MSG_LOG_DROPPED(dropped));
+
+		if (stopping)
+			break;
+
+		if (::poll(&pfd, 1, -1) > 0) {
+			uint64_t count;
+			ssize_t rv = ::read(wakeup_fd_, &count, sizeof(count));
+			(void)rv;
+		}
+	}
+}
+
+
+void Logger::write(LogLevel lvl, const string &msg) const
+{
+	if (syslog_) {
 #pragma GCC diagnostic push
 #pragma GCC diagnostic ignored "-Wformat-security"
-			// I think we can safely do this because thinkfan doesn't receive
-			// any data from unprivileged processes.
-			syslog(msg_lvl_, msg_pfx_.c_str());
+		// I think we can safely do this because thinkfan doesn't receive
+		// any data from unprivileged processes.
+		syslog(lvl, msg.c_str());
 #pragma GCC diagnostic pop
+	}
+	else {
+		std::cerr << msg << std::endl;
+	}
+}
+
+
+Logger &Logger::flush()
+{
+	if (msg_pfx_.length() == 0) return *this;
+	if (msg_lvl_ <= log_lvl_) {
+		if (writer_.joinable()) {
+			// Never waits for the writer. If the ring is full, the message is
+			// lost and the writer reports how many were dropped.
+			ring_.push(msg_lvl_, msg_pfx_);
+			wake_writer();
 		}
-		else {
-			std::cerr << msg_pfx_ << std::endl;
-		}
+		else
+			write(msg_lvl_, msg_pfx_);
 	}
-	msg_pfx_ = "";
+	msg_pfx_.clear();
 
 	return *this;
 }
@@ -134,10 +325,18 @@ Logger &Logger::flush()
 Logger &Logger::level(const LogLevel &lvl)
 {
 	flush();
+
+	// Messages that would be filtered out anyway aren't even formatted
+	enabled_ = lvl <= log_lvl_;
+	if (!enabled_) {
+		msg_lvl_ = lvl;
+		return *this;
+	}
+
 	if (!syslog_ && msg_lvl_ != lvl && lvl >= log_lvl_ && msg_lvl_ >= log_lvl_)
 		msg_pfx_ = "\n";
 	else
-		msg_pfx_ = "";
+		msg_pfx_.clear();
 
 	if (lvl == TF_WRN)
 		msg_pfx_ += "WARNING: ";
@@ -149,20 +348,36 @@ Logger &Logger::level(const LogLevel &lvl)
 }
 
 
+void Logger::append(long long i)
+{
+	char buf[24];
+	int len = snprintf(buf, sizeof(buf), "%lld", i);
+	msg_pfx_.append(buf, len);
+}
+
+
+void Logger::append(double d)
+{
+	char buf[64];
+	int len = snprintf(buf, sizeof(buf), "%f", d);
+	msg_pfx_.append(buf, std::min<int>(len, sizeof(buf) - 1));
+}
+
+
 Logger &Logger::operator<<( const std::string &msg)
-{ msg_pfx_ += msg; return *this; }
+{ if (enabled_) msg_pfx_ += msg; return *this; }
 
 Logger &Logger::operator<< (const int i)
-{ msg_pfx_ += std::to_string(i); return *this; }
+{ if (enabled_) append(i); return *this; }
 
 Logger &Logger::operator<< (const unsigned int i)
-{ msg_pfx_ += std::to_string(i); return *this; }
+{ if (enabled_) append(i); return *this; }
 
 Logger &Logger::operator<< (const float &i)
-{ msg_pfx_ += std::to_string(i); return *this; }
+{ if (enabled_) append(i); return *this; }
 
 Logger &Logger::operator<< (const char *msg)
-{ msg_pfx_ += msg; return *this; }
+{ if (enabled_) msg_pfx_ += msg; return *this; }
 
 Logger &Logger::operator<< (Logger & (*pf_flush)(Logger &))
 { return pf_flush(*this); }
@@ -170,6 +385,8 @@ Logger &Logger::operator<< (Logger & (*pf_flush)(Logger &))
 
 Logger &Logger::operator<< (const TemperatureState &ts)
 {
+	if (!enabled_) return *this;
+
 	msg_pfx_ += "Temperatures(bias): ";
 
 	std::vector<float>::const_iterator bias_it;
@@ -177,10 +394,28 @@ Logger &Logger::operator<< (const TemperatureState &ts)
 
 	for (temp_it = ts.get().cbegin(), bias_it = ts.biases().cbegin();
 			temp_it != ts.get().cend() && bias_it != ts.biases().cend();
-			++temp_it, ++bias_it)
-		msg_pfx_ += std::to_string(*temp_it) + "(" + std::to_string(int(*bias_it)) + "), ";
+			++temp_it, ++bias_it) {
+		append(*temp_it);
+		msg_pfx_ += '(';
+		append(int(*bias_it));
+		msg_pfx_ += "), ";
+	}
 
 	msg_pfx_.pop_back(); msg_pfx_.pop_back();
+
+	if (ts.grouped()) {
+		msg_pfx_ += ", groups: ";
+		for (int t : ts.columns()) {
+			append(t);
+			msg_pfx_ += ", ";
+		}
+		msg_pfx_.pop_back(); msg_pfx_.pop_back();
+	}
+
+	if (ts.feedforward()) {
+		msg_pfx_ += ", feedforward: ";
+		append(ts.feedforward());
+	}
 	return *this;
 }
 
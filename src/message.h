@@ -26,6 +26,8 @@
 #include <string>
 #include <exception>
 #include <memory>
+#include <atomic>
+#include <thread>
 
 #include "thinkfan.h"
 
@@ -50,6 +52,37 @@ LogLevel &operator++(LogLevel &l);
 
 class ExpectedError;
 
+
+/* Lock-free ring buffer of log records for exactly one producer (the control
+ * thread, which is why drivers that are read on a poller thread must not log)
+ * and one consumer (the log writer thread). A record is a small
+ * binary header followed by the message text, wrapping around at the end of
+ * the buffer. push() never blocks: When the ring is full, the record is
+ * dropped and counted instead. */
+class LogRing {
+public:
+	LogRing();
+	bool push(LogLevel lvl, const std::string &msg);
+	bool pop(LogLevel &lvl, std::string &msg);
+	unsigned int take_dropped();
+
+	static constexpr size_t size = 1 << 16;
+private:
+	struct Header {
+		int lvl;
+		unsigned int len;
+	};
+
+	void copy_in(size_t pos, const void *src, size_t len);
+	void copy_out(size_t pos, void *dst, size_t len) const;
+
+	std::unique_ptr<char[]> buf_;
+	std::atomic<size_t> head_;
+	std::atomic<size_t> tail_;
+	std::atomic<unsigned int> dropped_;
+};
+
+
 class Logger {
 private:
 	Logger();
@@ -57,6 +90,8 @@ private:
 public:
 	~Logger();
 	void enable_syslog();
+	void start_writer();
+	void stop_writer();
 	Logger &level(const LogLevel &lvl);
 	Logger &flush();
 	static Logger &instance();
@@ -74,9 +109,11 @@ public:
 
 	template<class ListT>
 	Logger &operator<< (const ListT &l) {
+		if (!enabled_) return *this;
 		msg_pfx_ += "(";
 		for (auto elem : l) {
-			msg_pfx_ += std::to_string(elem) + ", ";
+			append(elem);
+			msg_pfx_ += ", ";
 		}
 		msg_pfx_.pop_back(); msg_pfx_.pop_back();
 		msg_pfx_ += ")";
@@ -84,11 +121,29 @@ public:
 	}
 
 private:
+	// Format numbers in place, without a temporary std::string
+	void append(long long i);
+	void append(double d);
+	void append(int i) { append(static_cast<long long>(i)); }
+	void append(unsigned int i) { append(static_cast<long long>(i)); }
+	void append(float f) { append(static_cast<double>(f)); }
+
+	void write(LogLevel lvl, const std::string &msg) const;
+	void wake_writer();
+	void writer_loop();
+
 	bool syslog_;
 	LogLevel log_lvl_;
 	LogLevel msg_lvl_;
+	bool enabled_;
 	std::string msg_pfx_;
 	std::exception_ptr exception_;
+
+	// Used only once start_writer() has been called
+	LogRing ring_;
+	std::thread writer_;
+	int wakeup_fd_;
+	std::atomic<bool> stop_;
 };
 
 Logger &flush(Logger &l);
@@ -110,12 +165,25 @@ template<class ErrT> void error(const std::string &msg) {
 #define DND_DISK_HELP ""
 #endif
 
+#ifdef USE_IO_URING
+#define IO_URING_HELP \
+ "\n --io-uring" \
+ "\n     Without -j: Read all due sensors with a single io_uring submission."
+#else
+#define IO_URING_HELP ""
+#endif
+
 #define MSG_TITLE "thinkfan " VERSION ": A minimalist fan control program"
 
 #define MSG_USAGE \
- "Usage: thinkfan [-hnqzD [-b BIAS] [-c CONFIG] [-s SECONDS] [-p [SECONDS]]]" \
+ "Usage: thinkfan [-hnqzD [-b BIAS] [-c CONFIG] [-s SECONDS] [-p [SECONDS]]" \
+ "\n                [-j THREADS [-t SECONDS]] [-m FILE] [-r FILE]" \
+ "\n                [--export HOST:PORT [--node NAME]] [--state FILE]" \
+ "\n                [--control SOCKET] [--io-uring] [--startup-profile]]" \
+ "\n       thinkfan [-c CONFIG] [-b BIAS] [-s SECONDS] --replay FILE" \
+ "\n       thinkfan [-c CONFIG] --compile-config" \
  "\n -h  This help message" \
- "\n -s  Maximum cycle time in seconds (Integer. Default: 5)" \
+ "\n -s  Maximum cycle time in seconds (Floating point, 0.1 ~ 15. Default: 5)" \
  "\n -b  Floating point number (-10 to 30) to control rising temperature" \
  "\n     exaggeration (see README). Default: 5.0" \
  "\n -c  Load different configuration file (default: /etc/thinkfan.conf)" \
@@ -124,6 +192,34 @@ template<class ErrT> void error(const std::string &msg) {
  "\n -v  Enable verbose logging (e.g. log temperatures continuously)." \
  "\n -p  Use the pulsing-fan workaround (for worn out fans). Takes an optional" \
  "\n     floating-point argument (0 ~ 10s) as depulsing duration. Default 0.5s." \
+ "\n -j  Read sensors in parallel using THREADS worker threads (Default: 0," \
+ "\n     i.e. read them one after another)." \
+ "\n -t  With -j: Time in seconds (floating point) a sensor may take before its" \
+ "\n     previous reading is used instead. Default: 0.5" \
+ "\n -m  Write metrics (temperatures, fan levels, timings) to FILE every 10" \
+ "\n     seconds, in the Prometheus text format." \
+ "\n -r, --record" \
+ "\n     Record temperatures and fan levels to a binary trace FILE." \
+ "\n --replay" \
+ "\n     Run the temperatures recorded in FILE through CONFIG and report what" \
+ "\n     it would have done with the fans. No fans are touched." \
+ "\n --export" \
+ "\n     Send all temperatures to the thinkfan at HOST:PORT (UDP) every cycle," \
+ "\n     for use in its udp sensors. The config may then have no fans at all." \
+ "\n --node" \
+ "\n     With --export: The NAME this node reports as. Default: the hostname." \
+ "\n --state" \
+ "\n     Publish the current state in FILE (e.g. /run/thinkfan/state) for" \
+ "\n     monitoring. See thinkfan(1)." \
+ "\n --control" \
+ "\n     Accept commands like status, bias or force on the Unix SOCKET (e.g." \
+ "\n     /run/thinkfan/control). Connect and send help for a list." \
+ "\n --startup-profile" \
+ "\n     Log how long each driver took to start up, once the fans are set." \
+ "\n --compile-config" \
+ "\n     Check CONFIG and write it to CONFIG.image, which is then loaded instead" \
+ "\n     of parsing CONFIG for as long as CONFIG doesn't change." \
+ IO_URING_HELP \
  DND_DISK_HELP \
  "\n -D  DANGEROUS mode: Disable all sanity checks. May result in undefined" \
  "\n     behaviour!\n"
@@ -142,8 +238,104 @@ template<class ErrT> void error(const std::string &msg) {
 #define MSG_RUNNING PID_FILE " already exists. Either thinkfan is " \
 	"already running, or it was killed by SIGKILL. If you're sure thinkfan" \
 	" is not running, delete " PID_FILE " manually."
+#define MSG_CONF_TREND(value) "Invalid trend: " + value + ". Must be one of jump, derivative or ewma."
+#define MSG_CONF_CONTINUOUS_PWM(path) "Continuous control is only possible with a pwm_fan, not with " + path + "."
+#define MSG_CONF_CONTINUOUS_LVL(lvl) "Continuous control needs a PWM value between 0 and 255, not " + lvl + "."
+#define MSG_CONF_CONTROL(value) "Invalid fan control mode: " + value + ". Must be either stepped or continuous."
+#define MSG_CONF_GAIN(value) "Invalid gain: " + value + ". Must be a number of degrees between 0 and 100."
+#define MSG_CONF_VERIFY(value) "Invalid argument to `verify': " + value + ". Must be either yes or no."
+#define MSG_CONF_RAMP(value) "Invalid ramp: " + value + ". Must be a number of PWM steps per second between 0.1 and 255."
+#define MSG_HWMON_NOTFOUND(name) "No hwmon attribute matches " + name + "."
+#define MSG_HWMON_AMBIGUOUS(name, a, b) "Both " + a + " and " + b + " match " + name \
+	+ ". Please use an absolute path instead."
+#define MSG_HWMON_RESOLVED(name, path) "Resolved " + name + " to " + path + "."
+#define MSG_HWMON_SCAN(path) "Can't scan " + string(path) + ": "
+#define MSG_HWMON_CACHE(path) "Can't write hwmon cache " + path + ": "
+#define MSG_UDP_PATH(path) "Invalid udp sensor: " + path + ". Expected NODE@HOST:PORT or NODE@[HOST]:PORT."
+#define MSG_UDP_ADDR(addr) "Invalid address: " + addr + ". Expected HOST:PORT or [HOST]:PORT."
+#define MSG_UDP_WILDCARD(addr) "Won't listen on " + addr + ": That's all interfaces. Give the local address the peers send to."
+#define MSG_UDP_FROM(path) path + ": Missing `from', the address(es) of the node."
+#define MSG_UDP_RESOLVE(host, msg) "Can't resolve " + host + ": " + msg
+#define MSG_UDP_BIND(addr) "Can't listen on " + addr + ": "
+#define MSG_UDP_AWAIT(n) "Waiting for " + std::to_string(n) + " udp peer(s) to report..."
+#define MSG_UDP_COUNT(path, n, expected) path << ": Received " << n << " temperatures, expected " \
+	<< expected << ". Ignoring its datagrams."
+#define MSG_UDP_STALE(path, s, t) path << ": Nothing received for " << s << " seconds. Assuming " \
+	<< t << " °C until it reports again."
+#define MSG_UDP_RECOVERED(path) path << ": Receiving temperatures again."
+#define MSG_EXPORT_NODE(node) "Invalid node name: \"" + node + "\". Must be 1 to 255 characters without `@'."
+#define MSG_EXPORT_CONNECT(dest) "Can't export to " + dest + ": "
+#define MSG_EXPORT_TEMPS(n) "Can't export " + std::to_string(n) + " temperatures, the maximum is 255."
+#define MSG_EXPORT_SEND(dest) "Sending temperatures to " << dest << " failed: "
+#define MSG_EXPORT_RECOVERED(dest) "Sending temperatures to " << dest << " works again."
+#define MSG_CONF_GROUP_UNKNOWN(name) "Unknown sensor group: " + name + ". It must be defined before the sensors in it."
+#define MSG_CONF_GROUP_DUP(name) "Sensor group " + name + " is defined twice."
+#define MSG_CONF_GROUP_MISSING(path) "Sensor " + path + " is in no group. Once there are sensor groups, every sensor must be in one."
+#define MSG_CONF_GROUP_SIZE(name, size, rank) "Sensor group " + name + " has " + std::to_string(size) \
+	+ " temperature(s), but needs at least " + std::to_string(std::max(rank, 1u)) + "."
+#define MSG_CONF_GROUP_AGGREGATE(value) "Invalid aggregate: " + value + ". Must be max, mean or a rank between 1 and 255."
+#define MSG_CONF_GROUPS_SIMPLE(path) "Sensor groups only apply to complex levels. " + path \
+	+ " has simple levels, so it uses the highest temperature."
+#define MSG_CONF_UDP_OPTION(path) "The `temps', `stale' and `from' options are only valid for udp sensors, not " + path + "."
+#define MSG_CONF_UDP_TEMPS(value) "Invalid argument to `temps': " + value + ". Must be a number between 1 and 255."
+#define MSG_SENSOR_ALARM(path) "Alarm on " + path + ", checking all sensors now."
 #define MSG_SENSOR_LOST "A sensor has vanished! Exiting since there's no " \
 	"safe way of handling this."
+#define MSG_SENSOR_NO_READING(path) path + ": No first reading within the timeout. Can't control the fans without it."
+#define MSG_SENSOR_STALE(path) path << ": Sensor read timed out. Using its last known temperature(s)."
+#define MSG_SENSOR_RECOVERED(path) path << ": Sensor is responding again."
+#define MSG_URING_UNAVAILABLE(reason) "io_uring is unavailable (" + reason + "), reading sensors one by one."
+#define MSG_URING_FAILED(reason) "Batched sensor read failed (" + reason + "), reading sensors one by one from now on."
+#define MSG_CONTROL_OPEN(path) "Can't create control socket " + path + ": "
+#define MSG_CONTROL_PATH(path) "Control socket path too long: " + path
+#define MSG_CONTROL_NOT_SOCKET(path) "Won't replace " + path + " with the control socket: It exists and isn't a socket."
+#define MSG_CONTROL_LINE "Line too long."
+#define MSG_CONTROL_UNKNOWN "Unknown command. Try help."
+#define MSG_CONTROL_FAN "No such fan. Fans are numbered from 0, in config order."
+#define MSG_CONTROL_LEVEL "No such level. Levels are numbered from 0, in config order."
+#define MSG_CONTROL_SECONDS(max) "SECONDS must be between 1 and " + std::to_string(max) + "."
+#define MSG_CONTROL_BIAS(b) "Bias set to " + b + " through the control socket."
+#define MSG_CONTROL_FORCE(fan, level, secs) fan + ": Forcing " + level + " for " + std::to_string(secs) \
+	+ "s through the control socket."
+#define MSG_CONTROL_HELP \
+ "status                     Temperatures, biases and fan levels\n" \
+ "bias BIAS                  Set the bias like -b does (-10 to 30)\n" \
+ "force FAN LEVEL [SECONDS]  Hold FAN at LEVEL for SECONDS (default 60, at most\n" \
+ "                           3600). Both are numbered from 0, in config order.\n" \
+ "release [FAN]              End the forced level of FAN, or of all fans\n" \
+ "reload                     Reload the config, like SIGHUP\n" \
+ "reinit                     Re-initialize all fans, like SIGUSR2\n"
+#define MSG_STATE_OPEN(path) "Can't create state file " + path + ": "
+#define MSG_IMAGE_SOURCE(path) "Can't read " + path
+#define MSG_IMAGE_OPEN(path) "Can't open config image " + path + ": "
+#define MSG_IMAGE_WRITE(path) "Can't write config image " + path
+#define MSG_IMAGE_INVALID(path) path + " is not a valid config image. Parsing the config instead."
+#define MSG_IMAGE_STALE(path, source) source + " has changed since " + path \
+	+ " was compiled. Parsing the config instead. Use --compile-config to update the image."
+#define MSG_IMAGE_OPTIONS(path) path + " was compiled with different options (--export or -D). " \
+	"Parsing the config instead."
+#define MSG_IMAGE_LOADED(path) "Loaded compiled config from " + path + "."
+#define MSG_IMAGE_WRITTEN(path) "Compiled config written to " + path + "."
+#define MSG_IMAGE_INSANE "--compile-config can't be combined with -D, since the checks it skips " \
+	"when the image is loaded must have passed."
+
+#define MSG_STARTUP_DRIVER(kind, path, construct) string(kind) + " " + path + ": construct " + construct
+#define MSG_STARTUP_INIT(init) ", init " + init
+#define MSG_STARTUP_TOTAL(parse, init, first) "Startup: config " + parse + ", driver init " + init \
+	+ " (in parallel), first control cycle " + first
+#define MSG_TRACE_OPEN(path) "Can't open trace file " + path + ": "
+#define MSG_TRACE_FORMAT(path) path + " is not a thinkfan trace file, or it is incomplete."
+#define MSG_TRACE_RESTART(path) "The trace in " + path + " was recorded with a different number of " \
+	"temperatures or fans. Starting a new trace."
+#define MSG_REPLAY_TEMPS(path, n_trace, n_conf) "The trace in " + path + " has " + std::to_string(n_trace) \
+	+ " temperatures, but the config has " + std::to_string(n_conf) + "."
+#define MSG_REPLAY_LOADS "Can't replay a config with loads: The trace doesn't contain them."
+#define MSG_REPLAY_CONTINUOUS(path) "Can't replay " + path + ": Only stepped control can be replayed."
+#define MSG_REPLAY_EMPTY(path) "The trace in " + path + " is empty."
+#define MSG_REPLAY_RECORDED(n) "The recording config made " + std::to_string(n) + " level change(s)."
+#define MSG_METRICS_OPEN(path) "Can't write metrics to " + path + ": "
+#define MSG_LOG_DROPPED(n) "Logging can't keep up: " + std::to_string(n) + " message(s) were dropped."
+#define MSG_LOG_SYNC(msg) string("Failed to start log writer thread: ") + msg + ". Logging synchronously."
 
 #define TRACKER_URL "https://github.com/vmatare/thinkfan/issues"
 #define MSG_BUG "This is probably a bug. Please consider reporting this at " TRACKER_URL ". Thanks."
@@ -152,7 +344,16 @@ template<class ErrT> void error(const std::string &msg) {
 #define MSG_SENSOR_DEFAULT "Using default temperature inputs in " DEFAULT_SENSOR "."
 #define MSG_T_GET(file) string("Failed to read temperature(s) from ") + file + ": "
 #define MSG_T_INVALID(s, d) s + ": Invalid temperature: " + std::to_string(d)
+#define MSG_T_FORMAT(found, expected) "Expected " + std::to_string(expected) \
+	+ " temperature(s), but found " + std::to_string(found)
+#define MSG_T_GARBAGE "Unexpected data after temperature value(s)"
+#define MSG_T_OVERLONG(size) "More than " + std::to_string(size) + " bytes of temperature(s), can't read all of it"
+#define MSG_T_TP_FORMAT "Unknown file format, expected `temperatures:' and a list of numbers"
 #define MSG_SENSOR_INIT(file) string(__func__) + ": Initializing sensor in " + file + ": "
+#define MSG_LOAD_INIT(file) string(__func__) + ": Initializing load source in " + file + ": "
+#define MSG_LOAD_GET(file) string("Failed to read load from ") + file + ": "
+#define MSG_LOAD_FORMAT(file) MSG_LOAD_GET(file) + "Unknown file format."
+#define MSG_LOAD_NVML_UNSUPP "This NVML driver can't report GPU utilization & power."
 
 
 #define MSG_FAN_MODOPTS \
@@ -160,6 +361,9 @@ template<class ErrT> void error(const std::string &msg) {
 #define MSG_FAN_CTRL(str, fan) string(__func__) + ": Writing \"" + str + "\" to " + fan + ": "
 #define MSG_FAN_INIT(fan) string(__func__) + ": Initializing fan control in " + fan + ": "
 #define MSG_FAN_RESET(fan) string(__func__) + ": Resetting fan control in " + fan + ": "
+#define MSG_FAN_READBACK(fan) string(__func__) + ": Reading back the state of " + fan + ": "
+#define MSG_FAN_FORCE_END(fan) fan + ": Forced level has ended, back to automatic control."
+#define MSG_FAN_DRIFT(fan, value) fan + " has drifted off \"" + value + "\". Re-initializing it."
 #define MSG_FAN_EPERM(fan) string(__func__) + ": No permission to write to " + fan \
 	+ ". Thinkfan needs to be run as root!"
 
@@ -168,12 +372,15 @@ template<class ErrT> void error(const std::string &msg) {
 	"rising temperatures may be dangerous!"
 #define MSG_OPT_S_1(t) "A sleeptime of " + std::to_string(t) + " seconds doesn't make much " \
  "sense."
-#define MSG_OPT_S "option -s requires an int argument!"
+#define MSG_OPT_S "option -s requires a numeric argument!"
 #define MSG_OPT_S_INVAL(x) string("invalid argument to option -s: ") + x
 #define MSG_OPT_B "bias must be between -10 and 30!"
 #define MSG_OPT_B_NOARG "option -b requires an argument!"
 #define MSG_OPT_B_INVAL(x) string("invalid argument to option -b: ") + x
 #define MSG_OPT_P(x) string("invalid argument to option -p: ") + x
+#define MSG_OPT_J_INVAL(x) string("invalid argument to option -j: ") + x
+#define MSG_OPT_T_INVAL(x) string("invalid argument to option -t: ") + x
+#define MSG_OPT_T "sensor timeout must be between 0.01 and 60 seconds!"
 
 
 #define MSG_CONF_DEFAULT_FAN "Using default fan control in " DEFAULT_FAN "."
@@ -194,7 +401,8 @@ template<class ErrT> void error(const std::string &msg) {
 	"UPPER limit. That doesn't make sense."
 #define MSG_CONF_OVERLAP "LOWER limit doesn't overlap with previous UPPER" \
 	" limit."
-#define MSG_CONF_FAN "Thinkfan can't use more than one fan."
+#define MSG_CONF_FAN(path) "Fan " + path + " is specified more than once."
+#define MSG_CONF_FAN_NOLEVELS(path) "No fan levels specified for fan " + path + "."
 #define MSG_CONF_LVLORDER "Fan levels are not ordered correctly."
 #define MSG_CONF_PARSE "Syntax error"
 #define MSG_CONF_LVL0 "The LOWER limit of the first fan level cannot con" \
@@ -204,7 +412,14 @@ template<class ErrT> void error(const std::string &msg) {
 	" number of temperatures"
 #define MSG_CONF_LONG_LIMIT "You have configured more temperature limits " \
 	"than sensors. That doesn't make sense"
+#define MSG_CONF_NVML_BUSID(ids) "Invalid list of PCI bus IDs: \"" + ids + "\". Expected e.g. " \
+	"0000:01:00.0,0000:02:00.0"
+#define MSG_CONF_REUSED(n) "Keeping " + std::to_string(n) + " unchanged driver(s) from the running config."
 #define MSG_CONF_LIMITLEN "Inconsistent limit length"
+#define MSG_CONF_LIMITCOUNT(lvl, n, num_temps) "Fan level \"" + lvl + "\" has " \
+	+ std::to_string(n) + " limits, but there are " + std::to_string(num_temps) + " temperatures."
+#define MSG_CONF_SECONDS(option, value) "Invalid argument to `" + option + "': " + value \
+	+ ". Expected a number of seconds between 0.01 and 3600."
 #define MSG_CONF_CORRECTION_LEN(path, clen, ntemp) string("Sensor ") + path + " has " \
 	+ std::to_string(ntemp) + " temperatures," \
 	" but you have " + std::to_string(clen) + " correction values for it."
@@ -212,6 +427,8 @@ template<class ErrT> void error(const std::string &msg) {
 	"contact your distribution's package maintainer."
 #define MSG_CONF_NVML_UNSUPP "NVML support is not compiled in. Recompile with -DUSE_NVML or " \
 	"contact your distribution's package maintainer."
+#define MSG_CONF_STATIC_UNSUPP(path) path + ": This thinkfan was built for a fixed set of drivers " \
+	"(STATIC_SENSORS and STATIC_FANS), which doesn't include this one."
 #define MSG_TEMP_COUNT(t_conf, t_found) "Your config requires at least " << t_conf << " temperatures, " \
 	"but only " << t_found << " temperatures were found."
 #define MSG_CONF_MAXLVL(n) "You're using a PWM fan, but your highest fan level is only " + std::to_string(n) \
@@ -0,0 +1,274 @@
+/********************************************************************
+ * metrics.cpp: Export of internal state & timings for monitoring.
+ * (C) 2015, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "error.h"
+#include "metrics.h"
+#include "config.h"
+#include "drivers.h"
+#include "message.h"
+
+#include <fstream>
+#include <cstdio>
+#include <cerrno>
+#include <signal.h>
+#include <pthread.h>
+
+namespace thinkfan {
+
+// The node_exporter textfile collector re-reads its files on every scrape,
+// so there's no point in writing them much more often than that.
+static const std::chrono::seconds METRICS_INTERVAL(10);
+
+
+/*----------------------------------------------------------------------------
+| Histogram: Each bucket counts only the observations that fall into it. The |
+| cumulative counts required by the exposition format are summed up when the |
+| histogram is written out.                                                  |
+----------------------------------------------------------------------------*/
+
+constexpr unsigned int Histogram::num_buckets;
+
+const uint64_t Histogram::bounds_ns_[Histogram::num_buckets] = {
+	10000, 50000,
+	100000, 500000,
+	1000000, 5000000,
+	10000000, 50000000,
+	100000000, 500000000,
+	1000000000, 5000000000
+};
+
+
+Histogram::Histogram()
+: sum_ns_(0)
+{
+	for (std::atomic<uint64_t> &c : counts_)
+		c.store(0, std::memory_order_relaxed);
+}
+
+
+void Histogram::observe(clock::duration d)
+{
+	uint64_t ns = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(d).count());
+	unsigned int i = 0;
+	while (i < num_buckets && ns > bounds_ns_[i])
+		++i;
+	counts_[i].fetch_add(1, std::memory_order_relaxed);
+	sum_ns_.fetch_add(ns, std::memory_order_relaxed);
+}
+
+
+void Histogram::write(std::ostream &out, const string &name, const string &labels) const
+{
+	const string sep = labels.length() ? "," : "";
+	uint64_t count = 0;
+	for (unsigned int i = 0; i < num_buckets; ++i) {
+		count += counts_[i].load(std::memory_order_relaxed);
+		out << name << "_bucket{" << labels << sep << "le=\"" << bounds_ns_[i] / 1e9 << "\"} "
+			<< count << "\n";
+	}
+	count += counts_[num_buckets].load(std::memory_order_relaxed);
+	out << name << "_bucket{" << labels << sep << "le=\"+Inf\"} " << count << "\n";
+
+	const string braced = labels.length() ? "{" + labels + "}" : "";
+	out << name << "_sum" << braced << " " << sum_ns_.load(std::memory_order_relaxed) / 1e9 << "\n";
+	out << name << "_count" << braced << " " << count << "\n";
+}
+
+
+FanMetrics::FanMetrics(const string &path)
+: path(path),
+  level_idx(0),
+  level_changes(0)
+{}
+
+
+void FanMetrics::set_level(unsigned int idx, bool changed)
+{
+	level_idx.store(idx, std::memory_order_relaxed);
+	if (changed)
+		level_changes.fetch_add(1, std::memory_order_relaxed);
+}
+
+
+SensorMetrics::SensorMetrics(const string &path)
+: path(path)
+{}
+
+
+static string escape_label(const string &value)
+{
+	string rv;
+	for (char c : value) {
+		if (c == '\\' || c == '"')
+			rv += '\\';
+		if (c == '\n')
+			rv += "\\n";
+		else
+			rv += c;
+	}
+	return rv;
+}
+
+
+/*----------------------------------------------------------------------------
+| MetricsExporter: Owns the metrics for the currently running config. On a   |
+| config reload, attach() sets up fresh metrics for the new config, so all   |
+| counters start from zero again (which is how Prometheus expects a counter  |
+| reset to look).                                                            |
+----------------------------------------------------------------------------*/
+
+MetricsExporter::MetricsExporter(const string &path)
+: path_(path),
+  tmp_path_(path + ".tmp"),
+  cycle_(new Histogram()),
+  stop_(false)
+{
+	// Fail early if we can't write the file at all. Later errors are silently
+	// retried because they can't be logged from the writer thread.
+	{
+		std::ofstream f(tmp_path_);
+		if (!f.is_open())
+			throw IOerror(MSG_METRICS_OPEN(tmp_path_), errno);
+	}
+	std::remove(tmp_path_.c_str());
+
+	thread_ = std::thread(&MetricsExporter::run, this);
+}
+
+
+MetricsExporter::~MetricsExporter()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		stop_ = true;
+	}
+	cv_.notify_all();
+	thread_.join();
+
+	// Don't leave around metrics that look like they're current.
+	std::remove(path_.c_str());
+}
+
+
+void MetricsExporter::attach(const Config &config)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	cycle_.reset(new Histogram());
+
+	sensors_.clear();
+	temp_labels_.clear();
+	for (const SensorDriver *sensor : config.sensors()) {
+		sensors_.emplace_back(new SensorMetrics(sensor->path()));
+		for (unsigned int i = 0; i < sensor->num_temps(); ++i)
+			temp_labels_.push_back("sensor=\"" + escape_label(sensor->path())
+					+ "\",index=\"" + std::to_string(i) + "\"");
+	}
+
+	fans_.clear();
+	for (const FanConfig *fan_cfg : config.fans())
+		fans_.emplace_back(new FanMetrics(fan_cfg->fan()->path()));
+
+	temps_.reset(new std::atomic<int>[temp_labels_.size()]);
+	biases_.reset(new std::atomic<float>[temp_labels_.size()]);
+	for (size_t i = 0; i < temp_labels_.size(); ++i) {
+		temps_[i].store(0, std::memory_order_relaxed);
+		biases_[i].store(0, std::memory_order_relaxed);
+	}
+}
+
+
+void MetricsExporter::publish(const TemperatureState &ts)
+{
+	const size_t n = std::min(temp_labels_.size(), ts.get().size());
+	for (size_t i = 0; i < n; ++i) {
+		temps_[i].store(ts.get()[i], std::memory_order_relaxed);
+		biases_[i].store(ts.biases()[i], std::memory_order_relaxed);
+	}
+}
+
+
+void MetricsExporter::run()
+{
+	// Signals are for the main thread only
+	sigset_t mask;
+	sigfillset(&mask);
+	sigdelset(&mask, SIGSEGV);
+	pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (!cv_.wait_for(lock, METRICS_INTERVAL, [this] { return stop_; }))
+		write_file();
+}
+
+
+bool MetricsExporter::write_file() const
+{
+	std::ofstream out(tmp_path_, std::ios_base::out | std::ios_base::trunc);
+	if (!out.is_open())
+		return false;
+
+	out << "# HELP thinkfan_temperature_celsius Last temperature reading, with correction applied.\n"
+		"# TYPE thinkfan_temperature_celsius gauge\n";
+	for (size_t i = 0; i < temp_labels_.size(); ++i)
+		out << "thinkfan_temperature_celsius{" << temp_labels_[i] << "} "
+			<< temps_[i].load(std::memory_order_relaxed) << "\n";
+
+	out << "# HELP thinkfan_temperature_bias_celsius Bias added to a temperature while it is rising.\n"
+		"# TYPE thinkfan_temperature_bias_celsius gauge\n";
+	for (size_t i = 0; i < temp_labels_.size(); ++i)
+		out << "thinkfan_temperature_bias_celsius{" << temp_labels_[i] << "} "
+			<< biases_[i].load(std::memory_order_relaxed) << "\n";
+
+	out << "# HELP thinkfan_fan_level_index Position of the current level in the fan's level list.\n"
+		"# TYPE thinkfan_fan_level_index gauge\n";
+	for (const std::unique_ptr<FanMetrics> &fan : fans_)
+		out << "thinkfan_fan_level_index{fan=\"" << escape_label(fan->path) << "\"} "
+			<< fan->level_idx.load(std::memory_order_relaxed) << "\n";
+
+	out << "# HELP thinkfan_fan_level_changes_total Number of fan level changes.\n"
+		"# TYPE thinkfan_fan_level_changes_total counter\n";
+	for (const std::unique_ptr<FanMetrics> &fan : fans_)
+		out << "thinkfan_fan_level_changes_total{fan=\"" << escape_label(fan->path) << "\"} "
+			<< fan->level_changes.load(std::memory_order_relaxed) << "\n";
+
+	out << "# HELP thinkfan_fan_set_speed_seconds Time taken to write a new fan level.\n"
+		"# TYPE thinkfan_fan_set_speed_seconds histogram\n";
+	for (const std::unique_ptr<FanMetrics> &fan : fans_)
+		fan->set_speed.write(out, "thinkfan_fan_set_speed_seconds", "fan=\"" + escape_label(fan->path) + "\"");
+
+	out << "# HELP thinkfan_sensor_read_seconds Time taken to read a sensor.\n"
+		"# TYPE thinkfan_sensor_read_seconds histogram\n";
+	for (const std::unique_ptr<SensorMetrics> &sensor : sensors_)
+		sensor->read_temps.write(out, "thinkfan_sensor_read_seconds", "sensor=\"" + escape_label(sensor->path) + "\"");
+
+	out << "# HELP thinkfan_cycle_seconds Time taken by one iteration of the control loop, not counting sleep.\n"
+		"# TYPE thinkfan_cycle_seconds histogram\n";
+	cycle_->write(out, "thinkfan_cycle_seconds", "");
+
+	out.close();
+	if (out.fail())
+		return false;
+	return std::rename(tmp_path_.c_str(), path_.c_str()) == 0;
+}
+
+
+}
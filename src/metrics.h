@@ -0,0 +1,125 @@
+/********************************************************************
+ * metrics.h: Export of internal state & timings for monitoring.
+ * (C) 2015, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#ifndef THINKFAN_METRICS_H_
+#define THINKFAN_METRICS_H_
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <ostream>
+#include <vector>
+#include <cstdint>
+
+#include "thinkfan.h"
+
+namespace thinkfan {
+
+class Config;
+
+
+/* Latency histogram with fixed buckets from 10µs to 5s. It is written by
+ * exactly one thread and may be read concurrently, so all counters are
+ * relaxed atomics and observe() never takes a lock. */
+class Histogram {
+public:
+	typedef std::chrono::steady_clock clock;
+
+	Histogram();
+	void observe(clock::duration d);
+	void write(std::ostream &out, const string &name, const string &labels) const;
+
+	static constexpr unsigned int num_buckets = 12;
+private:
+	static const uint64_t bounds_ns_[num_buckets];
+	std::atomic<uint64_t> counts_[num_buckets + 1];
+	std::atomic<uint64_t> sum_ns_;
+};
+
+
+class FanMetrics {
+public:
+	FanMetrics(const string &path);
+	void set_level(unsigned int idx, bool changed);
+
+	const string path;
+	Histogram set_speed;
+	std::atomic<unsigned int> level_idx;
+	std::atomic<uint64_t> level_changes;
+};
+
+
+struct SensorMetrics {
+	SensorMetrics(const string &path);
+
+	const string path;
+	Histogram read_temps;
+};
+
+
+/* Periodically writes all metrics to a file in the Prometheus text
+ * exposition format, for use with e.g. the node_exporter textfile
+ * collector. The file is replaced atomically by a rename(), so a reader
+ * never sees a partial write.
+ * All updates are done by the control thread (or a poller thread for the
+ * sensor that it reads) without taking a lock. Only attach(), i.e. setting
+ * up for a new config, locks out the writer thread. */
+class MetricsExporter {
+public:
+	MetricsExporter(const string &path);
+	MetricsExporter(const MetricsExporter &) = delete;
+	~MetricsExporter();
+
+	void attach(const Config &config);
+	void publish(const TemperatureState &ts);
+
+	Histogram &cycle() { return *cycle_; }
+	SensorMetrics &sensor(unsigned int idx) { return *sensors_[idx]; }
+	FanMetrics &fan(unsigned int idx) { return *fans_[idx]; }
+
+	MetricsExporter &operator = (const MetricsExporter &) = delete;
+
+private:
+	void run();
+	bool write_file() const;
+
+	const string path_;
+	const string tmp_path_;
+
+	std::unique_ptr<Histogram> cycle_;
+	std::vector<std::unique_ptr<SensorMetrics>> sensors_;
+	std::vector<std::unique_ptr<FanMetrics>> fans_;
+	std::unique_ptr<std::atomic<int>[]> temps_;
+	std::unique_ptr<std::atomic<float>[]> biases_;
+	std::vector<string> temp_labels_;
+
+	mutable std::mutex mutex_;
+	std::condition_variable cv_;
+	bool stop_;
+	std::thread thread_;
+};
+
+
+}
+
+#endif /* THINKFAN_METRICS_H_ */
@@ -22,306 +22,606 @@
 #include "error.h"
 #include "parser.h"
 #include "config.h"
+#include "message.h"
 #include <memory>
+#include <limits>
+#include <cctype>
+#include <cstring>
 
 namespace thinkfan {
 
 using namespace std;
 
 
-static const RegexParser separator_parser("^([[:space:]]*,)|([[:space:]]+)", 0);
-static const CommentParser comment_parser;
-static const RegexParser space_parser("^[[:space:]]*", 0, true, true);
+/*----------------------------------------------------------------------------
+| Scanner primitives: Everything below is built from these. Note that        |
+| is_space includes newlines, while is_blank only matches spaces and tabs.   |
+----------------------------------------------------------------------------*/
+
+static inline bool is_space(char c)
+{ return std::isspace(static_cast<unsigned char>(c)); }
+
+static inline bool is_blank(char c)
+{ return c == ' ' || c == '\t'; }
 
+static inline bool is_digit(char c)
+{ return c >= '0' && c <= '9'; }
 
-RegexParser::RegexParser(const string expr, const unsigned int data_idx, bool bol_only, bool match_nl)
-: data_idx_(data_idx),
-  re_str(expr),
-  bol_only_(bol_only && expr[0] == '^')
+
+static void skip_space(const char *&input)
 {
-	this->expr_ = (regex_t *) malloc(sizeof(regex_t));
-	if (regcomp(this->expr_, expr.c_str(), REG_EXTENDED | (match_nl ? 0 : REG_NEWLINE))) {
-		throw ParserMisdefinition();
-	}
+	while (is_space(*input))
+		++input;
 }
 
 
-RegexParser::~RegexParser()
+static void skip_blank(const char *&input)
 {
-	regfree(expr_);
-	free(expr_);
+	while (is_blank(*input))
+		++input;
 }
 
 
-string *RegexParser::_parse(const char *&input) const
+// A separator is either a comma (possibly preceded by whitespace) or just whitespace.
+static bool skip_separator(const char *&input)
 {
-	regmatch_t matches[data_idx_ + 1];
-	string *rv = nullptr;
-
-	int err;
-	if (!(err = regexec(this->expr_, input, this->data_idx_ + 1, matches, 0))) {
-		int so = matches[data_idx_].rm_so;
-		int eo = matches[data_idx_].rm_eo;
-		if (so != -1 && (!bol_only_ || matches[0].rm_so == 0)) {
-			rv = new string(input, so, eo - so);
-			input += matches->rm_eo;
-		}
+	const char *p = input;
+	skip_space(p);
+	if (*p == ',')
+		++p;
+	if (p == input)
+		return false;
+	input = p;
+	return true;
+}
+
+
+static char closing_bracket(char opening)
+{
+	switch (opening) {
+	case '(':
+		return ')';
+	case '{':
+		return '}';
+	default:
+		return 0;
+	}
+}
+
+
+static bool scan_int(const char *&input, int &result)
+{
+	const char *p = input;
+	skip_space(p);
+
+	bool negative = false;
+	if (*p == '-') {
+		negative = true;
+		++p;
 	}
-	else if (err == REG_ESPACE) {
-		delete rv;
-		throw ParserOOM();
+	if (!is_digit(*p))
+		return false;
+
+	// Accumulate negatively so INT_MIN can be represented
+	long long value = 0;
+	while (is_digit(*p)) {
+		value = value * 10 - (*p++ - '0');
+		if (value < std::numeric_limits<int>::min())
+			return false;
 	}
-	return rv;
+	if (!negative) {
+		value = -value;
+		if (value > std::numeric_limits<int>::max())
+			return false;
+	}
+
+	result = static_cast<int>(value);
+	input = p;
+	return true;
 }
 
 
-CommentParser::CommentParser()
-: comment_parser_("^[[:space:]]*#(.*)$", 1)
-{}
+static const CommentParser comment_parser;
+static const IntListParser int_list_parser;
+static const QuotedStringParser quoted_string_parser;
+static const TupleParser tuple_parser;
+static const TupleParser correction_parser(false);
 
 
-string *CommentParser::_parse(const char *&input) const
+// Skip any amount of whitespace and comments.
+static void skip_comments(const char *&input)
 {
-	space_parser.match(input);
-	string *rv = comment_parser_.parse(input);
-	space_parser.match(input);
-	return rv;
+	do skip_space(input);
+	while (comment_parser.match(input));
+}
+
+
+bool CommentParser::_parse(const char *&input, string &result) const
+{
+	skip_space(input);
+	if (*input != '#')
+		return false;
+
+	const char *start = ++input;
+	while (*input && *input != '\n')
+		++input;
+	result.assign(start, input);
+	skip_space(input);
+	return true;
+}
+
+
+static secondsf parse_seconds(const string &option, const string &value)
+{
+	float rv;
+	size_t invalid;
+	try {
+		rv = std::stof(value, &invalid);
+	} catch (std::invalid_argument &e) {
+		throw ConfigError(MSG_CONF_SECONDS(option, value));
+	} catch (std::out_of_range &e) {
+		throw ConfigError(MSG_CONF_SECONDS(option, value));
+	}
+	if (invalid < value.length() || rv < 0.01f || rv > 3600)
+		throw ConfigError(MSG_CONF_SECONDS(option, value));
+	return secondsf(rv);
 }
 
 
-KeywordParser::KeywordParser(const string keyword)
-: RegexParser("^[[:space:]]*" + keyword + "[[:space:]]+([^[:space:]]+|\"[^\"]+\")", 1)
+KeywordParser::KeywordParser(const string &keyword)
+: keyword_(keyword)
 {}
 
 
-FanDriver *FanParser::_parse(const char *&input) const
+/* A keyword, followed by whitespace and a value. The value is either a
+ * double-quoted string on a single line (quotes are stripped), or anything
+ * up to the next whitespace. */
+bool KeywordParser::_parse(const char *&input, string &result) const
 {
-	FanDriver *fan = nullptr;
-	unique_ptr<string> path;
+	skip_space(input);
+	if (strncmp(input, keyword_.c_str(), keyword_.length()) != 0
+			|| !is_space(input[keyword_.length()]))
+		return false;
+	input += keyword_.length();
+	skip_space(input);
+
+	if (*input == '"') {
+		const char *end = input + 1;
+		while (*end && *end != '"' && *end != '\n')
+			++end;
+		if (*end == '"' && end > input + 1) {
+			result.assign(input + 1, end);
+			input = end + 1;
+			return true;
+		}
+	}
+
+	const char *start = input;
+	while (*input && !is_space(*input))
+		++input;
+	if (input == start)
+		return false;
+	result.assign(start, input);
+	return true;
+}
+
 
-	if ((path = unique_ptr<string>(KeywordParser("fan").parse(input))))
+FanParser::FanParser()
+: kw_fan_("fan"),
+  kw_tp_fan_("tp_fan"),
+  kw_pwm_fan_("pwm_fan"),
+  kw_control_("control"),
+  kw_ramp_("ramp"),
+  kw_verify_("verify")
+{}
+
+
+bool FanParser::_parse(const char *&input, FanSpec &result) const
+{
+	if (kw_fan_.parse(input, result.path))
 		throw ConfigError(MSG_CONF_FAN_DEPRECATED);
-	else if ((path = unique_ptr<string>(KeywordParser("tp_fan").parse(input))))
-		fan = new TpFanDriver(*path);
-	else if ((path = unique_ptr<string>(KeywordParser("pwm_fan").parse(input))))
-		fan = new HwmonFanDriver(*path);
+	else if (kw_tp_fan_.parse(input, result.path))
+		result.type = FanSpec::TPACPI;
+	else if (kw_pwm_fan_.parse(input, result.path))
+		result.type = FanSpec::HWMON;
+	else
+		return false;
+
+	string value;
+	while (true) {
+		if (kw_control_.parse(input, value)) {
+			if (value == "continuous")
+				result.continuous = true;
+			else if (value == "stepped")
+				result.continuous = false;
+			else
+				throw ConfigError(MSG_CONF_CONTROL(value));
+		}
+		else if (kw_ramp_.parse(input, value)) {
+			size_t invalid = 0;
+			try {
+				result.ramp = std::stof(value, &invalid);
+			} catch (std::logic_error &e) {
+				throw ConfigError(MSG_CONF_RAMP(value));
+			}
+			if (invalid < value.length() || !(result.ramp >= 0.1f && result.ramp <= 255))
+				throw ConfigError(MSG_CONF_RAMP(value));
+		}
+		else if (kw_verify_.parse(input, value)) {
+			if (value == "yes")
+				result.verify = true;
+			else if (value == "no")
+				result.verify = false;
+			else
+				throw ConfigError(MSG_CONF_VERIFY(value));
+		}
+		else
+			break;
+	}
 
-	return fan;
+	return true;
 }
 
 
-SensorDriver *SensorParser::_parse(const char *&input) const
-{
-	SensorDriver *sensor = nullptr;
-	unique_ptr<string> path;
+SensorParser::SensorParser()
+: kw_sensor_("sensor"),
+  kw_tp_thermal_("tp_thermal"),
+  kw_hwmon_("hwmon"),
+  kw_atasmart_("atasmart"),
+  kw_nv_thermal_("nv_thermal"),
+  kw_udp_("udp"),
+  kw_poll_("poll"),
+  kw_timeout_("timeout"),
+  kw_trend_("trend"),
+  kw_horizon_("horizon"),
+  kw_temps_("temps"),
+  kw_stale_("stale"),
+  kw_from_("from"),
+  kw_group_("group")
+{}
+
 
-	if ((path = unique_ptr<string>(KeywordParser("sensor").parse(input))))
+bool SensorParser::_parse(const char *&input, SensorSpec &result) const
+{
+	if (kw_sensor_.parse(input, result.path))
 		throw ConfigError(MSG_CONF_SENSOR_DEPRECATED);
-	else if ((path = unique_ptr<string>(KeywordParser("tp_thermal").parse(input))))
-		sensor = new TpSensorDriver(*path);
-	else if ((path = unique_ptr<string>(KeywordParser("hwmon").parse(input))))
-		sensor = new HwmonSensorDriver(*path);
-	else if ((path = unique_ptr<string>(KeywordParser("atasmart").parse(input)))) {
+	else if (kw_tp_thermal_.parse(input, result.path))
+		result.type = SensorSpec::TPACPI;
+	else if (kw_hwmon_.parse(input, result.path))
+		result.type = SensorSpec::HWMON;
+	else if (kw_atasmart_.parse(input, result.path)) {
 #ifdef USE_ATASMART
-		sensor = new AtasmartSensorDriver(*path);
+		result.type = SensorSpec::ATASMART;
 #else
 		error<SystemError>(MSG_CONF_ATASMART_UNSUPP);
+		return false;
 #endif /* USE_ATASMART */
 	}
-	else if ((path = unique_ptr<string>(KeywordParser("nv_thermal").parse(input)))) {
+	else if (kw_nv_thermal_.parse(input, result.path)) {
 #ifdef USE_NVML
-		sensor = new NvmlSensorDriver(*path);
+		result.type = SensorSpec::NVML;
 #else
 		error<SystemError>(MSG_CONF_NVML_UNSUPP);
+		return false;
 #endif /* USE_NVML */
 	}
-
-	if (sensor) {
-		unique_ptr<string> list_inner;
-		if ((list_inner = unique_ptr<string>(BracketParser("(", ")", false).parse(input)))
-				|| (list_inner = unique_ptr<string>(BracketParser("{", "}", false).parse(input)))) {
-			const char *list_inner_c = list_inner->c_str();
-			unique_ptr<vector<int>> correction(TupleParser().parse(list_inner_c));
-			if (correction) sensor->set_correction(*correction);
+	else if (kw_udp_.parse(input, result.path))
+		result.type = SensorSpec::UDP;
+	else
+		return false;
+
+	// The correction has to be on the same line, otherwise it's a fan level.
+	correction_parser.parse(input, result.correction);
+
+	string value;
+	while (true) {
+		if (kw_poll_.parse(input, value))
+			result.poll_interval = parse_seconds("poll", value);
+		else if (kw_timeout_.parse(input, value))
+			result.timeout = parse_seconds("timeout", value);
+		else if (kw_trend_.parse(input, value)) {
+			if (value == "jump")
+				result.trend = TemperatureState::TREND_JUMP;
+			else if (value == "derivative")
+				result.trend = TemperatureState::TREND_DERIVATIVE;
+			else if (value == "ewma")
+				result.trend = TemperatureState::TREND_EWMA;
+			else
+				throw ConfigError(MSG_CONF_TREND(value));
+		}
+		else if (kw_horizon_.parse(input, value))
+			result.horizon = parse_seconds("horizon", value);
+		else if (kw_temps_.parse(input, value)) {
+			if (result.type != SensorSpec::UDP)
+				throw ConfigError(MSG_CONF_UDP_OPTION(result.path));
+			size_t invalid = 0;
+			unsigned long n = 0;
+			try {
+				n = std::stoul(value, &invalid);
+			} catch (std::logic_error &e) {
+				throw ConfigError(MSG_CONF_UDP_TEMPS(value));
+			}
+			if (invalid < value.length() || n < 1 || n > 255)
+				throw ConfigError(MSG_CONF_UDP_TEMPS(value));
+			result.num_temps = static_cast<unsigned int>(n);
+		}
+		else if (kw_stale_.parse(input, value)) {
+			if (result.type != SensorSpec::UDP)
+				throw ConfigError(MSG_CONF_UDP_OPTION(result.path));
+			result.stale = parse_seconds("stale", value);
+		}
+		else if (kw_from_.parse(input, value)) {
+			if (result.type != SensorSpec::UDP)
+				throw ConfigError(MSG_CONF_UDP_OPTION(result.path));
+			result.from = value;
 		}
+		else if (kw_group_.parse(input, value))
+			result.group = value;
+		else
+			break;
 	}
 
-	return sensor;
+	return true;
 }
 
 
-IntListParser::IntListParser()
-: int_parser_("^[[:space:]]*([[:digit:]]+)", 1)
+LoadParser::LoadParser()
+: kw_cpu_load_("cpu_load"),
+  kw_nv_load_("nv_load"),
+  kw_gain_("gain")
 {}
 
-vector<int> *IntListParser::_parse(const char *&input) const
-{
-	vector<int> *rv = new vector<int>();
-	string *s_int;
-
-	while ((s_int = int_parser_.parse(input))) {
-		const char *cs_int = s_int->c_str();
-		rv->push_back(strtol(cs_int, nullptr, 0));
-		delete s_int;
 
-		string *s_sep;
-		if (!(s_sep = separator_parser.parse(input))) break;
-		delete s_sep;
+bool LoadParser::_parse(const char *&input, LoadSpec &result) const
+{
+	if (kw_cpu_load_.parse(input, result.path))
+		result.type = LoadSpec::CPU;
+	else if (kw_nv_load_.parse(input, result.path)) {
+#ifdef USE_NVML
+		result.type = LoadSpec::NVML;
+#else
+		error<SystemError>(MSG_CONF_NVML_UNSUPP);
+		return false;
+#endif /* USE_NVML */
+	}
+	else
+		return false;
+
+	string value;
+	if (kw_gain_.parse(input, value)) {
+		size_t invalid = 0;
+		try {
+			result.gain = std::stof(value, &invalid);
+		} catch (std::logic_error &e) {
+			throw ConfigError(MSG_CONF_GAIN(value));
+		}
+		if (invalid < value.length() || !(result.gain >= 0 && result.gain <= 100))
+			throw ConfigError(MSG_CONF_GAIN(value));
 	}
 
-	if (rv->size() > 0) return rv;
-	delete rv;
-	return nullptr;
+	return true;
 }
 
 
-BracketParser::BracketParser(const string opening, const string closing, bool nl)
-: RegexParser(
-		(nl ? "^[[:space:]]*" : "^[[:blank:]]*")
-			+ (opening == "(" || opening == "{" ? "\\(" : opening)
-			+ "([^"
-			+ (opening != closing ? opening + closing : opening)
-			+ "]*)"
-			+ (closing == ")" ? "\\)" : closing),
-		1, true, nl
-) {}
+GroupParser::GroupParser()
+: kw_sensor_group_("sensor_group"),
+  kw_aggregate_("aggregate")
+{}
 
 
-vector<int> *TupleParser::_parse(const char *&input) const
+bool GroupParser::_parse(const char *&input, SensorGroup &result) const
 {
-	string *list_inner = nullptr;
-	if (!((list_inner = (BracketParser("(", ")").parse(input)))
-			|| (list_inner = (BracketParser("{", "}").parse(input))))) {
-		return nullptr;
+	if (!kw_sensor_group_.parse(input, result.name))
+		return false;
+
+	string value;
+	if (kw_aggregate_.parse(input, value)) {
+		if (value == "max")
+			result.rank = 1;
+		else if (value == "mean")
+			result.rank = 0;
+		else {
+			size_t invalid = 0;
+			unsigned long rank = 0;
+			try {
+				rank = std::stoul(value, &invalid);
+			} catch (std::logic_error &e) {
+				throw ConfigError(MSG_CONF_GROUP_AGGREGATE(value));
+			}
+			if (invalid < value.length() || rank < 1 || rank > 255)
+				throw ConfigError(MSG_CONF_GROUP_AGGREGATE(value));
+			result.rank = static_cast<unsigned int>(rank);
+		}
 	}
-	const char *list_inner_c = list_inner->c_str();
 
-	vector<int> *rv = IntListParser().parse(list_inner_c);
-	delete list_inner;
-	return rv;
+	return true;
 }
 
 
-SimpleLevel *SimpleLevelParser::_parse(const char *&input) const
+/* One or more integers separated by separators. A trailing separator is
+ * consumed as well. */
+bool IntListParser::_parse(const char *&input, vector<int> &result) const
 {
-	SimpleLevel *rv = nullptr;
-	string *list_inner = nullptr;
-	if (!((list_inner = (BracketParser("(", ")").parse(input)))
-			|| (list_inner = (BracketParser("{", "}").parse(input))))) {
-		return nullptr;
+	int value;
+	while (scan_int(input, value)) {
+		result.push_back(value);
+		if (!skip_separator(input))
+			break;
 	}
 
-	vector<int> *ints = nullptr;
-	string *lvl_str = nullptr;
-	string *sep = nullptr;
-	const char *list_inner_c = list_inner->c_str();
-
-	comment_parser.match(list_inner_c);
-
-	if (!((ints = IntListParser().parse(list_inner_c))
-			|| ((lvl_str = BracketParser("\"", "\"").parse(list_inner_c))
-					&& (sep = separator_parser.parse(list_inner_c))
-					&& (ints = IntListParser().parse(list_inner_c))))) {
-		delete lvl_str;
-		delete list_inner;
-		delete sep;
-		return nullptr;
-	}
+	return result.size() > 0;
+}
 
-	delete list_inner;
-	delete sep;
 
-	if (lvl_str && ints->size() == 2)
-		rv = new SimpleLevel(*lvl_str, (*ints)[0], (*ints)[1]);
-	else if (ints->size() == 3)
-		rv = new SimpleLevel((*ints)[0], (*ints)[1], (*ints)[2]);
+bool QuotedStringParser::_parse(const char *&input, string &result) const
+{
+	skip_space(input);
+	if (*input != '"')
+		return false;
+
+	const char *start = ++input;
+	while (*input && *input != '"')
+		++input;
+	if (*input != '"')
+		return false;
+	result.assign(start, input++);
+	return true;
+}
 
-	delete lvl_str;
-	delete ints;
 
-	return rv;
-}
+TupleParser::TupleParser(bool nl)
+: nl_(nl)
+{}
 
 
-ComplexLevel *ComplexLevelParser::_parse(const char *&input) const
+/* An integer list enclosed in round or curly braces. If nl_ is false, the
+ * opening bracket must be on the current line. */
+bool TupleParser::_parse(const char *&input, vector<int> &result) const
 {
-	ComplexLevel *rv = nullptr;
-	unique_ptr<string> lvl_str;
-	unique_ptr<vector<int>> lower_lim, upper_lim, lvl_int;
-
-	unique_ptr<string> opening_bracket(RegexParser("^(\\(|\\{)").parse(input));
-	if (!opening_bracket)
-		return nullptr;
-	string closing_bracket;
-	if (*opening_bracket == "(")
-		closing_bracket = "^\\)";
+	if (nl_)
+		skip_space(input);
 	else
-		closing_bracket = "^\\}";
-	comment_parser.match(input);
+		skip_blank(input);
 
-	if (!((lvl_str = unique_ptr<string>(BracketParser("\"", "\"").parse(input)))
-			|| ((lvl_int = unique_ptr<vector<int>>(IntListParser().parse(input))) && lvl_int->size() == 1)))
-		return nullptr;
-	comment_parser.match(input);
+	char closing = closing_bracket(*input);
+	if (!closing)
+		return false;
+	++input;
 
-	TupleParser tp;
-	RegexParser sep_parser("^[[:space:]]+|^[[:space:]]*,?[[:space:]]*", 0, true, true);
-	comment_parser.match(input);
-	sep_parser.match(input);
-	comment_parser.match(input);
+	if (!int_list_parser.parse(input, result))
+		return false;
+	skip_space(input);
 
-	lower_lim = unique_ptr<vector<int>>(tp.parse(input));
-	comment_parser.match(input);
-	sep_parser.match(input);
-	comment_parser.match(input);
+	if (*input != closing)
+		return false;
+	++input;
+	return true;
+}
 
-	upper_lim = unique_ptr<vector<int>>(tp.parse(input));
-	space_parser.match(input);
-	comment_parser.match(input);
 
-	if (!(lower_lim && upper_lim)) return nullptr;
+bool SimpleLevelParser::_parse(const char *&input, unique_ptr<SimpleLevel> &result) const
+{
+	skip_space(input);
+	char closing = closing_bracket(*input);
+	if (!closing)
+		return false;
+	++input;
+	skip_comments(input);
+
+	vector<int> ints;
+	string lvl_str;
+	bool quoted = false;
+	if (int_list_parser.parse(input, ints)) {
+		if (ints.size() != 3)
+			return false;
+	}
+	else if ((quoted = quoted_string_parser.parse(input, lvl_str))) {
+		if (!(skip_separator(input)
+				&& int_list_parser.parse(input, ints)
+				&& ints.size() == 2))
+			return false;
+	}
+	else
+		return false;
 
-	unique_ptr<string> bracket_closed(RegexParser(closing_bracket).parse(input));
-	if (!bracket_closed)
-		return nullptr;
+	skip_comments(input);
+	if (*input != closing)
+		return false;
+	++input;
 
-	if (lvl_str) rv = new ComplexLevel(*lvl_str, *lower_lim, *upper_lim);
-	else if (lvl_int) rv = new ComplexLevel(lvl_int->at(0), *lower_lim, *upper_lim);
+	if (quoted)
+		result.reset(new SimpleLevel(lvl_str, ints[0], ints[1]));
+	else
+		result.reset(new SimpleLevel(ints[0], ints[1], ints[2]));
 
-	return rv;
+	return true;
+}
+
+
+bool ComplexLevelParser::_parse(const char *&input, unique_ptr<ComplexLevel> &result) const
+{
+	char closing = closing_bracket(*input);
+	if (!closing)
+		return false;
+	++input;
+	skip_comments(input);
+
+	string lvl_str;
+	vector<int> lvl_int;
+	if (!(quoted_string_parser.parse(input, lvl_str)
+			|| (int_list_parser.parse(input, lvl_int) && lvl_int.size() == 1)))
+		return false;
+	skip_comments(input);
+	skip_separator(input);
+	skip_comments(input);
+
+	vector<int> lower_lim, upper_lim;
+	if (!tuple_parser.parse(input, lower_lim))
+		return false;
+	skip_comments(input);
+	skip_separator(input);
+	skip_comments(input);
+
+	if (!tuple_parser.parse(input, upper_lim))
+		return false;
+	skip_comments(input);
+
+	if (*input != closing)
+		return false;
+	++input;
+
+	if (lvl_int.size())
+		result.reset(new ComplexLevel(lvl_int[0], lower_lim, upper_lim));
+	else
+		result.reset(new ComplexLevel(lvl_str, lower_lim, upper_lim));
+
+	return true;
 }
 
 
 ConfigParser::ConfigParser()
 : parser_fan(),
-  parser_sensor()
+  parser_sensor(),
+  parser_load(),
+  parser_group()
 {}
 
 
-Config *ConfigParser::_parse(const char *&input) const
+unique_ptr<Config> ConfigParser::parse_config(const char *&input, Config *lender, bool offline) const
 {
 	// Use smart pointers here since we may cause an exception (rv->add_*()...)
-	unique_ptr<Config> rv(new Config());
-	RegexParser space_parser_("^[[:space:]]+", 0, true, true);
+	unique_ptr<Config> rv(new Config(lender, offline));
+	FanSpec fan;
+	SensorSpec sensor;
+	LoadSpec load;
+	SensorGroup group;
+	unique_ptr<SimpleLevel> simple_lvl;
+	unique_ptr<ComplexLevel> complex_lvl;
 
 	bool some_match;
 	do {
-		some_match = comment_parser.match(input)
-				|| space_parser_.match(input)
-				|| rv->add_fan(unique_ptr<FanDriver>(parser_fan.parse(input)))
-				|| rv->add_sensor(unique_ptr<SensorDriver>(parser_sensor.parse(input)))
-				|| rv->add_level(unique_ptr<SimpleLevel>(parser_simple_lvl.parse(input)))
-				|| rv->add_level(unique_ptr<ComplexLevel>(parser_complex_lvl.parse(input)));
+		const char *start = input;
+		skip_space(input);
+		some_match = input > start
+				|| comment_parser.match(input)
+				|| (parser_fan.parse(input, fan) && rv->add_fan(fan))
+				|| (parser_sensor.parse(input, sensor) && rv->add_sensor(sensor))
+				|| (parser_load.parse(input, load) && rv->add_load(load))
+				|| (parser_group.parse(input, group) && rv->add_group(group))
+				|| (parser_simple_lvl.parse(input, simple_lvl) && rv->add_level(std::move(simple_lvl)))
+				|| (parser_complex_lvl.parse(input, complex_lvl) && rv->add_level(std::move(complex_lvl)));
 	} while(*input != 0 && some_match);
 
 	if (*input != 0 && !some_match) return nullptr;
 
-	return rv.release();
-}
-
+	return rv;
 }
 
 
+bool ConfigParser::_parse(const char *&input, unique_ptr<Config> &result) const
+{
+	result = parse_config(input);
+	return static_cast<bool>(result);
+}
 
-
-
+}
@@ -22,10 +22,9 @@
 #ifndef THINKFAN_PARSER_H_
 #define THINKFAN_PARSER_H_
 
-#include <regex.h>
 #include <vector>
 #include <string>
-#include <string.h>
+#include <memory>
 #include "drivers.h"
 
 namespace thinkfan {
@@ -35,139 +34,186 @@ using namespace std;
 class SimpleLevel;
 class ComplexLevel;
 class Config;
+struct FanSpec;
+struct SensorSpec;
+struct LoadSpec;
+struct SensorGroup;
 static const string tpacpi_path = "/proc/acpi/ibm";
 
+
+/* All parsers are plain scanners over the NUL-terminated config buffer.
+ * They have no state besides what's given to their constructor, so the
+ * whole grammar is built once and can be reused for any number of configs.
+ * On success, parse() advances input past the match and stores the result,
+ * otherwise it leaves both untouched. */
 template<typename ResultT>
 class Parser {
 public:
-	typedef ResultT* ResultT_;
-
 	Parser() {}
 
 	virtual ~Parser() = default;
 
-	const char *get_max_addr() const
-	{ return max_addr_; }
-
-	ResultT *parse(const char *&input) const {
+	bool parse(const char *&input, ResultT &result) const {
 		const char *start = input;
-		ResultT *rv = _parse(input);
-		if (input > max_addr_) max_addr_ = input;
-		if (!rv) input = start;
-		return rv;
+		ResultT rv;
+		if (!_parse(input, rv)) {
+			input = start;
+			return false;
+		}
+		result = std::move(rv);
+		return true;
 	}
 
 	bool match(const char *&input) const {
-		ResultT *result = parse(input);
-		if (result) {
-			delete result;
-			return true;
-		}
-		return false;
+		ResultT result;
+		return parse(input, result);
 	}
 
 protected:
-	virtual ResultT *_parse(const char *&input) const = 0;
-
-private:
-	static const char *max_addr_;
+	virtual bool _parse(const char *&input, ResultT &result) const = 0;
 };
 
-template<typename ResultT>
-const char *Parser<ResultT>::max_addr_ = nullptr;
 
+class CommentParser : public Parser<string> {
+public:
+	CommentParser() {}
+protected:
+	virtual bool _parse(const char *&input, string &result) const override;
+};
 
-class RegexParser : public Parser<string> {
+
+class KeywordParser : public Parser<string> {
 private:
-	regex_t *expr_;
-	unsigned int data_idx_;
-	string re_str;
-	bool bol_only_;
+	const string keyword_;
 public:
-	RegexParser(const string expr, const unsigned int data_idx = 0,
-			bool bol_only = true, bool match_nl = false);
-	virtual ~RegexParser();
-	virtual string *_parse(const char *&input) const override;
+	KeywordParser(const string &keyword);
+protected:
+	virtual bool _parse(const char *&input, string &result) const override;
 };
 
 
-class CommentParser : public Parser<string> {
+class FanParser : public Parser<FanSpec> {
 private:
-	RegexParser comment_parser_;
+	const KeywordParser kw_fan_;
+	const KeywordParser kw_tp_fan_;
+	const KeywordParser kw_pwm_fan_;
+	const KeywordParser kw_control_;
+	const KeywordParser kw_ramp_;
+	const KeywordParser kw_verify_;
 public:
-	CommentParser();
-	virtual string *_parse(const char *&input) const override;
+	FanParser();
+protected:
+	virtual bool _parse(const char *&input, FanSpec &result) const override;
 };
 
 
-class KeywordParser : public RegexParser {
+class SensorParser : public Parser<SensorSpec> {
+private:
+	const KeywordParser kw_sensor_;
+	const KeywordParser kw_tp_thermal_;
+	const KeywordParser kw_hwmon_;
+	const KeywordParser kw_atasmart_;
+	const KeywordParser kw_nv_thermal_;
+	const KeywordParser kw_udp_;
+	const KeywordParser kw_poll_;
+	const KeywordParser kw_timeout_;
+	const KeywordParser kw_trend_;
+	const KeywordParser kw_horizon_;
+	const KeywordParser kw_temps_;
+	const KeywordParser kw_stale_;
+	const KeywordParser kw_from_;
+	const KeywordParser kw_group_;
 public:
-	KeywordParser(const std::string keyword);
+	SensorParser();
+protected:
+	virtual bool _parse(const char *&input, SensorSpec &result) const override;
 };
 
 
-class FanParser : public Parser<FanDriver> {
+class LoadParser : public Parser<LoadSpec> {
+private:
+	const KeywordParser kw_cpu_load_;
+	const KeywordParser kw_nv_load_;
+	const KeywordParser kw_gain_;
 public:
-	virtual FanDriver *_parse(const char *&input) const override;
+	LoadParser();
+protected:
+	virtual bool _parse(const char *&input, LoadSpec &result) const override;
 };
 
 
-class SensorParser : public Parser<SensorDriver> {
+class GroupParser : public Parser<SensorGroup> {
+private:
+	const KeywordParser kw_sensor_group_;
+	const KeywordParser kw_aggregate_;
 public:
-	virtual SensorDriver *_parse(const char *&input) const override;
+	GroupParser();
+protected:
+	virtual bool _parse(const char *&input, SensorGroup &result) const override;
 };
 
 
-class IntListParser : public Parser<std::vector<int>> {
-private:
-	RegexParser int_parser_;
+class IntListParser : public Parser<vector<int>> {
 public:
-	IntListParser();
-	virtual std::vector<int> *_parse(const char *&input) const override;
+	IntListParser() {}
+protected:
+	virtual bool _parse(const char *&input, vector<int> &result) const override;
 };
 
 
-class BracketParser : public RegexParser {
+class QuotedStringParser : public Parser<string> {
 public:
-	BracketParser(const std::string opening, const std::string closing, bool nl = true);
+	QuotedStringParser() {}
+protected:
+	virtual bool _parse(const char *&input, string &result) const override;
 };
 
 
 class TupleParser : public Parser<vector<int>> {
+private:
+	bool nl_;
 public:
-	TupleParser() {};
-	virtual vector<int> *_parse(const char *&input) const override;
+	TupleParser(bool nl = true);
+protected:
+	virtual bool _parse(const char *&input, vector<int> &result) const override;
 };
 
 
-class SimpleLevelParser : public Parser<SimpleLevel> {
+class SimpleLevelParser : public Parser<unique_ptr<SimpleLevel>> {
 public:
 	SimpleLevelParser() {}
-	virtual SimpleLevel *_parse(const char *&input) const override;
+protected:
+	virtual bool _parse(const char *&input, unique_ptr<SimpleLevel> &result) const override;
 };
 
 
-class ComplexLevelParser : public Parser<ComplexLevel> {
+class ComplexLevelParser : public Parser<unique_ptr<ComplexLevel>> {
 public:
 	ComplexLevelParser() {}
-	virtual ComplexLevel *_parse(const char *&input) const override;
+protected:
+	virtual bool _parse(const char *&input, unique_ptr<ComplexLevel> &result) const override;
 };
 
 
-class ConfigParser : public Parser<Config> {
+class ConfigParser : public Parser<unique_ptr<Config>> {
 private:
 	const FanParser parser_fan;
 	const SensorParser parser_sensor;
+	const LoadParser parser_load;
+	const GroupParser parser_group;
 	const SimpleLevelParser parser_simple_lvl;
 	const ComplexLevelParser parser_complex_lvl;
 public:
 	ConfigParser();
 
-	Config *parse_config(const char *&input)
-	{ return parse(input); }
+	// Unlike parse(), this leaves input where parsing stopped on failure,
+	// so syntax errors can be reported at the right position. Drivers that
+	// are unchanged are taken over from the lender, if any. An offline config
+	// has no drivers (see Config::read_offline()).
+	unique_ptr<Config> parse_config(const char *&input, Config *lender = nullptr, bool offline = false) const;
 
 protected:
-	virtual Config *_parse(const char *&input) const override;
+	virtual bool _parse(const char *&input, unique_ptr<Config> &result) const override;
 };
 
 
@@ -0,0 +1,430 @@
+/********************************************************************
+ * poller.cpp: Sequential or concurrent polling of all sensor drivers.
+ * (C) 2015, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "error.h"
+#include "poller.h"
+#include "drivers.h"
+#include "message.h"
+#include "metrics.h"
+#include "probes.h"
+
+#include <signal.h>
+#include <cstring>
+
+namespace thinkfan {
+
+
+/*----------------------------------------------------------------------------
+| SensorPoller: Reads the sensors that are due and merges all temperatures   |
+| into temp_state in config order. A sensor either has its own polling       |
+| interval, or it is read on every main cycle (i.e. after the adaptive       |
+| sleeptime). The cached reading of a sensor that isn't due is reused as-is. |
+| Without worker threads, due sensors are simply read one after another.     |
+| With --io-uring, all due hwmon & tp_thermal reads are submitted at once    |
+| instead, and the poller waits for all of them in the same syscall.         |
+| With worker threads, they are read in parallel and each one has to         |
+| deliver before its timeout. A sensor that is late keeps its previous       |
+| reading (marked stale) and is not re-queued until its pending read has     |
+| returned, so a stalled driver can never block the control loop. Without a  |
+| previous reading, that's an error. A worker that is still stuck in a read  |
+| when the poller goes away (on reload or exit) is left behind, along with   |
+| its driver, rather than waited for.                                        |
+----------------------------------------------------------------------------*/
+
+template<class DurationT>
+static SensorPoller::clock::duration to_clock(DurationT d)
+{ return std::chrono::duration_cast<SensorPoller::clock::duration>(d); }
+
+
+SensorPoller::Slot::Slot(const SensorDriver *sensor, Histogram *latency)
+: sensor(sensor),
+  driver(sensor),
+  latency(latency),
+  interval(to_clock(sensor->poll_interval())),
+  timeout(to_clock(sensor->timeout() > secondsf(0) ? sensor->timeout() : sensor_timeout)),
+  next_due(clock::time_point::min()),
+  state(IDLE),
+  temps(sensor->num_temps(), 0),
+  valid(false),
+  fresh(false),
+  stale(false),
+  batch_idx(-1)
+{}
+
+
+bool SensorPoller::Slot::due(clock::time_point now, bool cycle) const
+{
+	if (interval == clock::duration::zero())
+		return cycle;
+	return next_due <= now;
+}
+
+
+void SensorPoller::Slot::schedule(clock::time_point now)
+{
+	if (interval == clock::duration::zero())
+		return;
+
+	// Keep a fixed cadence, unless we've fallen behind by more than one interval.
+	next_due += interval;
+	if (next_due <= now)
+		next_due = now + interval;
+}
+
+
+/* Doesn't touch the slot, since a worker may still be in here when the
+ * poller is gone. Only pays for the clock reads if someone is actually
+ * interested. */
+static SensorPoller::clock::duration read_sensor(const SensorDriver *sensor, const SensorDispatch &driver,
+		bool timed)
+{
+	typedef SensorPoller::clock clock;
+	TF_PROBE1(sensor__read__start, sensor->path().c_str());
+	auto end = probe_end([sensor] { TF_PROBE1(sensor__read__end, sensor->path().c_str()); });
+	if (!timed) {
+		driver.read_temps();
+		return clock::duration::zero();
+	}
+	clock::time_point start = clock::now();
+	driver.read_temps();
+	return clock::now() - start;
+}
+
+
+void SensorPoller::Slot::read() const
+{
+	clock::duration elapsed = read_sensor(sensor, driver, latency);
+	if (latency)
+		latency->observe(elapsed);
+}
+
+
+SensorPoller::SensorPoller(const std::vector<const SensorDriver *> &sensors, unsigned int num_threads,
+		MetricsExporter *metrics)
+: shared_(std::make_shared<Shared>()),
+  queued_(0)
+{
+	shared_->stop = false;
+	unsigned int num_temps = 0;
+	for (unsigned int i = 0; i < sensors.size(); ++i) {
+		slots_.push_back(Slot(sensors[i], metrics ? &metrics->sensor(i).read_temps : nullptr));
+		num_temps += sensors[i]->num_temps();
+	}
+	due_.reserve(slots_.size());
+	samples_.resize(num_temps, 0);
+	fresh_.resize(num_temps, 0);
+
+	if (num_threads > slots_.size())
+		num_threads = slots_.size();
+	reading_.resize(num_threads, nullptr);
+	for (unsigned int i = 0; i < num_threads; ++i)
+		workers_.push_back(std::thread(&SensorPoller::work, this, i, shared_));
+
+#ifdef USE_IO_URING
+	// Worker threads already overlap the reads, so batching is only for the
+	// sequential case. With a single sensor there's nothing to gain.
+	if (uring_reads && workers_.empty()) {
+		std::vector<const SensorDriver *> batched;
+		for (Slot &slot : slots_) {
+			int fd;
+			char *buf;
+			size_t size;
+			if (slot.driver.read_request(fd, buf, size)) {
+				slot.batch_idx = int(batched.size());
+				batched.push_back(slot.sensor);
+				batch_slots_.push_back(&slot);
+			}
+		}
+		if (batched.size() >= 2)
+			batch_ = UringBatch::make(batched);
+		if (!batch_) {
+			for (Slot &slot : slots_)
+				slot.batch_idx = -1;
+			batch_slots_.clear();
+		}
+	}
+#endif
+}
+
+
+SensorPoller::~SensorPoller()
+{
+	{
+		std::lock_guard<std::mutex> lock(shared_->mutex);
+		shared_->stop = true;
+
+		// Those idle or about to be will stop right away. One that is still
+		// reading may never return, so it's detached and its driver marked
+		// stuck, which keeps the Config from deleting it.
+		for (unsigned int i = 0; i < workers_.size(); ++i) {
+			if (reading_[i]) {
+				reading_[i]->sensor->set_stuck(true);
+				workers_[i].detach();
+			}
+		}
+	}
+	work_cv_.notify_all();
+	for (std::thread &t : workers_)
+		if (t.joinable())
+			t.join();
+}
+
+
+void SensorPoller::work(unsigned int idx, std::shared_ptr<Shared> shared)
+{
+	// Signals are for the main thread only
+	sigset_t mask;
+	sigfillset(&mask);
+	sigdelset(&mask, SIGSEGV);
+	pthread_sigmask(SIG_BLOCK, &mask, nullptr);
+
+	std::unique_lock<std::mutex> lock(shared->mutex);
+	while (true) {
+		work_cv_.wait(lock, [this, &shared] { return shared->stop || queued_ > 0; });
+		if (shared->stop) return;
+
+		Slot *slot = nullptr;
+		for (Slot &s : slots_) {
+			if (s.state == QUEUED) {
+				slot = &s;
+				break;
+			}
+		}
+		slot->state = RUNNING;
+		--queued_;
+		reading_[idx] = slot;
+		const SensorDriver *sensor = slot->sensor;
+		const SensorDispatch driver = slot->driver;
+		Histogram *latency = slot->latency;
+		lock.unlock();
+
+		clock::duration elapsed;
+		std::exception_ptr error;
+		try {
+			elapsed = read_sensor(sensor, driver, latency);
+		} catch (...) {
+			error = std::current_exception();
+		}
+
+		lock.lock();
+		if (unlikely(shared->stop)) {
+			// Given up on, so the poller (& the slot) may be gone. The driver
+			// is still there since it's marked stuck, this is the last time
+			// it's touched.
+			sensor->set_stuck(false);
+			return;
+		}
+		reading_[idx] = nullptr;
+		if (latency && !error)
+			latency->observe(elapsed);
+		slot->error = error;
+		slot->state = DONE;
+		done_cv_.notify_all();
+	}
+}
+
+
+void SensorPoller::read_temps(bool cycle)
+{
+	const clock::time_point now = clock::now();
+
+	if (workers_.empty()) {
+#ifdef USE_IO_URING
+		if (batch_)
+			batch_->clear();
+#endif
+		for (Slot &slot : slots_) {
+			slot.fresh = false;
+			if (slot.due(now, cycle)) {
+#ifdef USE_IO_URING
+				// Collected until all due reads are queued. A sensor whose file
+				// isn't open right now is read by itself.
+				int fd;
+				char *buf;
+				size_t size;
+				if (slot.batch_idx >= 0 && slot.driver.read_request(fd, buf, size)) {
+					batch_->add(unsigned(slot.batch_idx), fd);
+					continue;
+				}
+#endif
+				slot.read();
+				slot.temps = slot.sensor->temps();
+				slot.valid = slot.fresh = true;
+				set_stale(slot, slot.sensor->outdated());
+				slot.schedule(now);
+			}
+		}
+#ifdef USE_IO_URING
+		if (batch_ && !batch_->queued().empty())
+			read_batch(now);
+#endif
+		merge();
+		return;
+	}
+
+	std::unique_lock<std::mutex> lock(shared_->mutex);
+
+	due_.clear();
+	for (Slot &slot : slots_) {
+		slot.fresh = false;
+		// A late reading from a previous cycle is better than nothing, but the
+		// sensor stays stale until a read completes before its deadline.
+		if (slot.state == DONE)
+			collect(slot);
+		if (slot.due(now, cycle)) {
+			if (slot.state == IDLE) {
+				slot.state = QUEUED;
+				++queued_;
+			}
+			slot.schedule(now);
+			due_.push_back(&slot);
+		}
+	}
+	work_cv_.notify_all();
+
+	for (Slot *slot : due_) {
+		done_cv_.wait_until(lock, now + slot->timeout, [slot] { return slot->state == DONE; });
+
+		if (likely(slot->state == DONE)) {
+			collect(*slot);
+			set_stale(*slot, slot->sensor->outdated());
+		}
+		else if (unlikely(!slot->valid))
+			// Without a previous reading, there's nothing to fall back to
+			throw SystemError(MSG_SENSOR_NO_READING(slot->sensor->path()));
+		else
+			set_stale(*slot, true);
+	}
+	lock.unlock();
+
+	merge();
+}
+
+
+#ifdef USE_IO_URING
+/* All batched reads complete together, so each of them is accounted with the
+ * latency of the whole batch. If the ring breaks, the reads are redone one by
+ * one, and the poller stays sequential from then on. */
+void SensorPoller::read_batch(clock::time_point now)
+{
+	TF_PROBE1(sensor__batch__start, unsigned(batch_->queued().size()));
+	const clock::time_point start = clock::now();
+	const bool ok = batch_->submit();
+	const int err = errno;
+	const clock::duration elapsed = clock::now() - start;
+	TF_PROBE2(sensor__batch__end, unsigned(batch_->queued().size()), int(ok));
+	if (unlikely(!ok)) {
+		string msg = std::strerror(err);
+		log(TF_WRN) << MSG_URING_FAILED(msg) << flush;
+	}
+
+	for (unsigned int idx : batch_->queued()) {
+		Slot &slot = *batch_slots_[idx];
+		if (likely(ok)) {
+			slot.driver.read_done(batch_->result(idx));
+			if (slot.latency)
+				slot.latency->observe(elapsed);
+		}
+		else
+			slot.read();
+		slot.temps = slot.sensor->temps();
+		slot.valid = slot.fresh = true;
+		set_stale(slot, slot.sensor->outdated());
+		slot.schedule(now);
+	}
+
+	if (unlikely(!ok)) {
+		for (Slot *slot : batch_slots_)
+			slot->batch_idx = -1;
+		batch_slots_.clear();
+		batch_.reset();
+	}
+}
+#endif
+
+
+void SensorPoller::collect(Slot &slot)
+{
+	slot.state = IDLE;
+	if (unlikely(static_cast<bool>(slot.error))) {
+		std::exception_ptr error = slot.error;
+		slot.error = nullptr;
+		std::rethrow_exception(error);
+	}
+	slot.temps = slot.sensor->temps();
+	slot.valid = slot.fresh = true;
+}
+
+
+/* A sensor is stale while its reads miss their deadline, or while its driver
+ * only has an old value. That's logged here rather than by the driver, since
+ * a driver may be read on a worker thread, and the Logger only takes messages
+ * from the control thread. */
+void SensorPoller::set_stale(Slot &slot, bool stale)
+{
+	if (likely(stale == slot.stale))
+		return;
+	slot.stale = stale;
+	if (stale)
+		log(TF_WRN) << MSG_SENSOR_STALE(slot.sensor->path()) << flush;
+	else
+		log(TF_INF) << MSG_SENSOR_RECOVERED(slot.sensor->path()) << flush;
+}
+
+
+/* Gather all readings into one sample vector for TemperatureState::update().
+ * Without a valid reading from every sensor, the TemperatureState remains
+ * incomplete. */
+void SensorPoller::merge()
+{
+	std::vector<int>::iterator sample = samples_.begin();
+	std::vector<unsigned char>::iterator fresh = fresh_.begin();
+	for (const Slot &slot : slots_) {
+		const unsigned int n = slot.sensor->num_temps();
+		if (unlikely(!slot.valid || slot.temps.size() != n))
+			return;
+		if (slot.fresh)
+			std::copy(slot.temps.begin(), slot.temps.end(), sample);
+		std::fill(fresh, fresh + n, slot.fresh);
+		sample += n;
+		fresh += n;
+	}
+
+	temp_state.update(samples_, fresh_,
+			std::chrono::duration<double>(clock::now().time_since_epoch()).count());
+}
+
+
+SensorPoller::clock::time_point SensorPoller::next_due() const
+{
+	clock::time_point rv = clock::time_point::max();
+	for (const Slot &slot : slots_)
+		if (slot.interval != clock::duration::zero())
+			rv = std::min(rv, slot.next_due);
+	return rv;
+}
+
+
+bool SensorPoller::stale(unsigned int sensor_idx) const
+{ return slots_[sensor_idx].stale; }
+
+
+}
@@ -0,0 +1,118 @@
+/********************************************************************
+ * poller.h: Sequential or concurrent polling of all sensor drivers.
+ * (C) 2015, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#ifndef THINKFAN_POLLER_H_
+#define THINKFAN_POLLER_H_
+
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+#include "thinkfan.h"
+#include "dispatch.h"
+
+namespace thinkfan {
+
+class SensorDriver;
+class MetricsExporter;
+class Histogram;
+#ifdef USE_IO_URING
+class UringBatch;
+#endif
+
+
+class SensorPoller {
+public:
+	typedef std::chrono::steady_clock clock;
+
+	SensorPoller(const std::vector<const SensorDriver *> &sensors, unsigned int num_threads,
+			MetricsExporter *metrics = nullptr);
+	SensorPoller(const SensorPoller &) = delete;
+	~SensorPoller();
+
+	void read_temps(bool cycle);
+	clock::time_point next_due() const;
+	bool stale(unsigned int sensor_idx) const;
+
+	SensorPoller &operator = (const SensorPoller &) = delete;
+
+private:
+	enum SlotState { IDLE, QUEUED, RUNNING, DONE };
+
+	struct Slot {
+		Slot(const SensorDriver *sensor, Histogram *latency);
+		bool due(clock::time_point now, bool cycle) const;
+		void schedule(clock::time_point now);
+		void read() const;
+
+		const SensorDriver *sensor;
+		SensorDispatch driver;	// How to call it in the hot path
+		Histogram *latency;
+		clock::duration interval;
+		clock::duration timeout;
+		clock::time_point next_due;
+		SlotState state;
+		std::exception_ptr error;
+		std::vector<int> temps;
+		bool valid;
+		bool fresh;
+		bool stale;
+		int batch_idx;
+	};
+
+	// What a worker needs once it returns from a read that the poller has
+	// given up on, i.e. after the poller may have been destroyed.
+	struct Shared {
+		std::mutex mutex;
+		bool stop;
+	};
+
+	void work(unsigned int idx, std::shared_ptr<Shared> shared);
+	void collect(Slot &slot);
+	void set_stale(Slot &slot, bool stale);
+	void merge();
+#ifdef USE_IO_URING
+	void read_batch(clock::time_point now);
+#endif
+
+	std::vector<Slot> slots_;
+	std::vector<int> samples_;
+	std::vector<unsigned char> fresh_;
+	std::vector<Slot *> due_;
+	std::vector<std::thread> workers_;
+	std::vector<Slot *> reading_;			// Per worker, what it's reading
+	std::shared_ptr<Shared> shared_;
+	std::condition_variable work_cv_;
+	std::condition_variable done_cv_;
+	unsigned int queued_;
+#ifdef USE_IO_URING
+	std::unique_ptr<UringBatch> batch_;
+	std::vector<Slot *> batch_slots_;
+#endif
+};
+
+
+}
+
+#endif /* THINKFAN_POLLER_H_ */
@@ -0,0 +1,91 @@
+/********************************************************************
+ * probes.h: USDT probes for tracing the control loop.
+ * (C) 2015, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#ifndef THINKFAN_PROBES_H_
+#define THINKFAN_PROBES_H_
+
+/* Static probes for bpftrace, perf or SystemTap, e.g.
+ *   bpftrace -e 'usdt:/usr/sbin/thinkfan:thinkfan:sensor__read__start { ... }'
+ * A probe that isn't attached is a single nop. Its arguments only have to be
+ * where a tracer can find them, nothing is copied or formatted for it.
+ * Without sys/sdt.h (i.e. USE_SDT), the probes compile to nothing at all:
+ *
+ *   cycle__start(int main_cycle)
+ *   cycle__end(int main_cycle, int shortened)
+ *   sensor__read__start(const char *path)
+ *   sensor__read__end(const char *path)
+ *   sensor__batch__start(unsigned int num_sensors)		(--io-uring)
+ *   sensor__batch__end(unsigned int num_sensors, int ok)
+ *   level__change(const char *fan, unsigned int old_level, unsigned int new_level, int tmax)
+ *   fan__set__start(const char *fan, const char *value)	(also with continuous PWM)
+ *   fan__set__end(const char *fan)
+ *
+ * Levels are numbered from 0, in config order. An end probe also fires when
+ * the code between start and end throws, so that a tracer that matches each
+ * start with its end doesn't lose track of the failures. */
+
+#include <utility>
+
+#ifdef USE_SDT
+
+#include <sys/sdt.h>
+
+#define TF_PROBE1(name, a) DTRACE_PROBE1(thinkfan, name, a)
+#define TF_PROBE2(name, a, b) DTRACE_PROBE2(thinkfan, name, a, b)
+#define TF_PROBE4(name, a, b, c, d) DTRACE_PROBE4(thinkfan, name, a, b, c, d)
+
+#else
+
+// Not evaluated, but still "used", so arguments that exist only for a probe
+// don't cause warnings
+#define TF_PROBE1(name, a) do { (void)sizeof(a); } while (0)
+#define TF_PROBE2(name, a, b) do { (void)sizeof(a); (void)sizeof(b); } while (0)
+#define TF_PROBE4(name, a, b, c, d) \
+	do { (void)sizeof(a); (void)sizeof(b); (void)sizeof(c); (void)sizeof(d); } while (0)
+
+#endif /* USE_SDT */
+
+
+namespace thinkfan {
+
+/* Fires an end probe from its destructor, i.e. whichever way the scope is
+ * left, e.g.
+ *   auto end = probe_end([&] { TF_PROBE1(foo__end, x); });
+ * Without USE_SDT, nothing is left of it. */
+template<class F> class ProbeEnd {
+public:
+	explicit ProbeEnd(F &&fire) : fire_(std::move(fire)), armed_(true) {}
+	ProbeEnd(ProbeEnd &&other) : fire_(std::move(other.fire_)), armed_(other.armed_) { other.armed_ = false; }
+	ProbeEnd(const ProbeEnd &) = delete;
+	~ProbeEnd() { if (armed_) fire_(); }
+
+	ProbeEnd &operator = (const ProbeEnd &) = delete;
+private:
+	F fire_;
+	bool armed_;
+};
+
+template<class F> ProbeEnd<F> probe_end(F fire)
+{ return ProbeEnd<F>(std::move(fire)); }
+
+}
+
+#endif /* THINKFAN_PROBES_H_ */
@@ -0,0 +1,195 @@
+/********************************************************************
+ * state.cpp: Lock-free snapshot of the daemon state in a shared file.
+ * (C) 2015, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "error.h"
+#include "state.h"
+#include "config.h"
+#include "poller.h"
+#include "message.h"
+
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <cstring>
+
+namespace thinkfan {
+
+static const char STATE_MAGIC[8] = { 'T', 'F', 'S', 'T', 'A', 'T', 'E', '1' };
+
+
+/*----------------------------------------------------------------------------
+| StatePublisher: The file is only ever created under a temporary name and   |
+| then renamed into place, so a reader never sees a partial header. If the   |
+| number of temperatures or fans changes, a new file replaces the old one,   |
+| and the old mapping is marked as replaced for whoever still reads it.      |
+| Between the two increments of seq, the fields are written without any      |
+| ordering among themselves. A reader that gets the same even seq before and |
+| after copying them has therefore seen one consistent update.               |
+----------------------------------------------------------------------------*/
+
+StatePublisher::StatePublisher(const string &path)
+: path_(path),
+  tmp_path_(path + ".tmp"),
+  map_(nullptr),
+  map_size_(0),
+  header_(nullptr),
+  temps_(nullptr),
+  fans_(nullptr),
+  cycles_(0),
+  stale_events_(0),
+  reload_errors_(0),
+  first_(true)
+{}
+
+
+StatePublisher::~StatePublisher()
+{
+	if (map_)
+		::unlink(path_.c_str());
+	unmap();
+}
+
+
+void StatePublisher::unmap()
+{
+	if (map_) {
+		__atomic_store_n(&header_->replaced, 1, __ATOMIC_RELEASE);
+		::munmap(map_, map_size_);
+		map_ = nullptr;
+		header_ = nullptr;
+		temps_ = nullptr;
+		fans_ = nullptr;
+		map_size_ = 0;
+	}
+}
+
+
+void StatePublisher::attach(const Config &config)
+{
+	const unsigned int num_temps = config.num_temps();
+	const unsigned int num_fans = config.fans().size();
+	stale_.assign(config.sensors().size(), 0);
+	// The fans may be different ones now, so don't count their level changes
+	first_ = true;
+
+	if (map_ && header_->num_temps == num_temps && header_->num_fans == num_fans)
+		return;
+
+	const size_t size = sizeof(StateHeader) + num_temps * sizeof(StateTemp) + num_fans * sizeof(StateFan);
+	int fd = ::open(tmp_path_.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		throw IOerror(MSG_STATE_OPEN(tmp_path_), errno);
+	if (::ftruncate(fd, size)) {
+		int err = errno;
+		::close(fd);
+		throw IOerror(MSG_STATE_OPEN(tmp_path_), err);
+	}
+	void *addr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	int err = errno;
+	::close(fd);
+	if (addr == MAP_FAILED)
+		throw IOerror(MSG_STATE_OPEN(tmp_path_), err);
+
+	StateHeader *header = static_cast<StateHeader *>(addr);
+	std::memcpy(header->magic, STATE_MAGIC, sizeof(STATE_MAGIC));
+	header->version = STATE_VERSION;
+	header->size = size;
+	header->num_temps = num_temps;
+	header->num_fans = num_fans;
+	header->pid = ::getpid();
+
+	if (::rename(tmp_path_.c_str(), path_.c_str())) {
+		err = errno;
+		::munmap(addr, size);
+		throw IOerror(MSG_STATE_OPEN(path_), err);
+	}
+
+	unmap();
+	map_ = static_cast<char *>(addr);
+	map_size_ = size;
+	header_ = header;
+	temps_ = reinterpret_cast<StateTemp *>(map_ + sizeof(StateHeader));
+	fans_ = reinterpret_cast<StateFan *>(map_ + sizeof(StateHeader) + num_temps * sizeof(StateTemp));
+}
+
+
+void StatePublisher::publish(const TemperatureState &ts, const Config &config, const SensorPoller &poller)
+{
+	typedef FanConfig::clock clock;
+
+	// Both are vDSO calls, so this doesn't enter the kernel.
+	struct timespec now_ts;
+	::clock_gettime(CLOCK_REALTIME, &now_ts);
+	const int64_t now_ns = int64_t(now_ts.tv_sec) * 1000000000 + now_ts.tv_nsec;
+	const clock::time_point now = clock::now();
+	auto to_realtime = [now, now_ns] (clock::time_point t) {
+		return now_ns - std::chrono::duration_cast<std::chrono::nanoseconds>(now - t).count();
+	};
+
+	uint32_t stale_sensors = 0;
+	for (unsigned int i = 0; i < stale_.size(); ++i) {
+		const bool stale = poller.stale(i);
+		if (stale && !stale_[i])
+			++stale_events_;
+		stale_[i] = stale;
+		stale_sensors += stale;
+	}
+
+	const uint64_t seq = header_->seq;
+	__atomic_store_n(&header_->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	header_->time_ns = now_ns;
+	header_->cycles = ++cycles_;
+	header_->bias = bias_level * 10;
+	header_->feedforward = ts.feedforward();
+	header_->stale_sensors = stale_sensors;
+	header_->stale_events = stale_events_;
+	header_->reload_errors = reload_errors_;
+
+	const std::vector<int> &temps = ts.get();
+	const std::vector<float> &biases = ts.biases();
+	for (unsigned int i = 0; i < header_->num_temps; ++i) {
+		temps_[i].temp = temps[i];
+		temps_[i].bias = biases[i];
+	}
+
+	for (unsigned int i = 0; i < header_->num_fans; ++i) {
+		const FanConfig *fan_cfg = config.fans()[i];
+		StateFan &fan = fans_[i];
+		const int32_t level = fan_cfg->cur_lvl_idx();
+		if (level != fan.level && !first_)
+			++fan.level_changes;
+		fan.level = level;
+		fan.value = fan_cfg->continuous() ? fan_cfg->cur_pwm() : fan_cfg->cur_lvl()->num();
+		const clock::time_point last_write = fan_cfg->fan()->last_write();
+		fan.last_write_ns = last_write == clock::time_point() ? 0 : to_realtime(last_write);
+		fan.forced_until_ns = fan_cfg->forced() && fan_cfg->forced_until() > now
+				? to_realtime(fan_cfg->forced_until()) : 0;
+	}
+
+	__atomic_store_n(&header_->seq, seq + 2, __ATOMIC_RELEASE);
+	first_ = false;
+}
+
+
+}
@@ -0,0 +1,114 @@
+/********************************************************************
+ * state.h: Lock-free snapshot of the daemon state in a shared file.
+ * (C) 2015, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#ifndef THINKFAN_STATE_H_
+#define THINKFAN_STATE_H_
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+#include "thinkfan.h"
+
+namespace thinkfan {
+
+class Config;
+class SensorPoller;
+
+
+/* Layout of the state file: This header, followed by `num_temps' StateTemp
+ * and `num_fans' StateFan records. All values are in host byte order, times
+ * are CLOCK_REALTIME in ns. Readers map the file read-only and use seq like
+ * a seqlock: Wait until it's even, copy what's needed, and retry if seq has
+ * changed in the meantime. Once `replaced' is set, the file has been
+ * superseded (after a config reload changed its layout) or removed (thinkfan
+ * has exited), so it has to be opened again. */
+struct StateHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t size;
+	uint32_t num_temps;
+	uint32_t num_fans;
+	uint32_t pid;
+	uint32_t replaced;
+	uint64_t seq;
+	int64_t time_ns;			// Last update
+	uint64_t cycles;			// Control loop iterations since startup
+	float bias;					// As given with -b
+	int32_t feedforward;		// Added to all temperatures, in °C
+	uint32_t stale_sensors;		// Currently using their last known temperature(s)
+	uint32_t stale_events;		// Sensor timeouts since startup
+	uint32_t reload_errors;		// Config reloads that failed since startup
+	uint32_t reserved;
+};
+
+struct StateTemp {
+	int32_t temp;				// With correction values applied
+	float bias;
+};
+
+struct StateFan {
+	int32_t level;				// Index into the fan's level list
+	int32_t value;				// That level's number, or the PWM value in continuous mode
+	int64_t last_write_ns;		// 0 if nothing has been written yet
+	int64_t forced_until_ns;	// 0 if the fan isn't forced to its level
+	uint64_t level_changes;
+};
+
+constexpr uint32_t STATE_VERSION = 1;
+
+
+/* Publishes the daemon state once per control cycle, as a few plain stores
+ * into a shared mapping. So any number of readers can poll it without
+ * talking to the daemon, and without ever holding it up. */
+class StatePublisher {
+public:
+	StatePublisher(const string &path);
+	StatePublisher(const StatePublisher &) = delete;
+	~StatePublisher();
+
+	void attach(const Config &config);
+	void publish(const TemperatureState &ts, const Config &config, const SensorPoller &poller);
+	void reload_failed() { ++reload_errors_; }
+
+	StatePublisher &operator = (const StatePublisher &) = delete;
+
+private:
+	void unmap();
+
+	const string path_;
+	const string tmp_path_;
+	char *map_;
+	size_t map_size_;
+	StateHeader *header_;
+	StateTemp *temps_;
+	StateFan *fans_;
+	uint64_t cycles_;
+	uint32_t stale_events_;
+	uint32_t reload_errors_;
+	bool first_;
+	std::vector<unsigned char> stale_;
+};
+
+
+}
+
+#endif /* THINKFAN_STATE_H_ */
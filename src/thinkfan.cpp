@@ -34,12 +34,23 @@
 #include <memory>
 #include <thread>
 #include <cmath>
+#include <algorithm>
+#include <limits>
 
 #include <unistd.h>
 
 #include "thinkfan.h"
 #include "config.h"
 #include "message.h"
+#include "poller.h"
+#include "metrics.h"
+#include "trace.h"
+#include "udp.h"
+#include "events.h"
+#include "state.h"
+#include "control.h"
+#include "image.h"
+#include "probes.h"
 
 
 namespace thinkfan {
@@ -47,14 +58,34 @@ namespace thinkfan {
 bool chk_sanity(true);
 bool quiet(false);
 bool daemonize(true);
-seconds sleeptime(5);
-seconds tmp_sleeptime = sleeptime;
+milliseconds sleeptime(5000);
+milliseconds tmp_sleeptime = sleeptime;
+unsigned int num_threads(0);
+#ifdef USE_IO_URING
+bool uring_reads(false);
+#endif
+secondsf sensor_timeout(0.5);
 float bias_level(1.5);
 int opt;
 float depulse = 0;
 std::string config_file = CONFIG_DEFAULT;
 TemperatureState temp_state(0);
 std::unique_ptr<PidFileHolder> pid_file;
+std::string metrics_file;
+std::unique_ptr<MetricsExporter> metrics;
+std::string trace_file;
+std::string replay_file;
+std::unique_ptr<TraceRecorder> trace;
+std::string export_address;
+std::string export_node;
+std::unique_ptr<UdpExporter> exporter;
+std::string state_file;
+std::unique_ptr<StatePublisher> state;
+std::string control_path;
+std::unique_ptr<ControlSocket> control;
+bool startup_profile(false);
+bool compile_config(false);
+Config::clock::duration startup_parse(0);
 
 volatile int interrupted(0);
 
@@ -66,6 +97,19 @@ bool dnd_disk = false;
 
 
 void sig_handler(int signum) {
+	switch(signum) {
+	case SIGSEGV:
+		// Let's hope memory isn't too fucked up to get through with this ;)
+		throw Bug("Segmentation fault.");
+		break;
+	}
+}
+
+
+/* All other signals arrive through the EventLoop, i.e. in normal program
+ * context, so they may log & do whatever they like. */
+static void handle_signal(int signum)
+{
 	switch(signum) {
 	case SIGHUP:
 	case SIGINT:
@@ -75,10 +119,6 @@ void sig_handler(int signum) {
 	case SIGUSR1:
 		log(TF_INF) << temp_state << flush;
 		break;
-	case SIGSEGV:
-		// Let's hope memory isn't too fucked up to get through with this ;)
-		throw Bug("Segmentation fault.");
-		break;
 	case SIGUSR2:
 		interrupted = signum;
 		log(TF_INF) << "Received SIGUSR2: Re-initializing fan control." << flush;
@@ -87,70 +127,229 @@ void sig_handler(int signum) {
 }
 
 
+static void log_level(LogLevel lvl, const Config &config, const FanConfig *fan_cfg)
+{
+	Logger &l = log(lvl) << temp_state << " -> ";
+	if (config.fans().size() > 1)
+		l << fan_cfg->fan()->path() << ": ";
+	if (fan_cfg->continuous())
+		l << "pwm " << fan_cfg->cur_pwm() << flush;
+	else
+		l << fan_cfg->cur_lvl()->str() << flush;
+}
 
-void run(const Config &config)
+
+/* The highest load, in degrees to add to all temperatures */
+static void read_loads(const Config &config)
+{
+	float degrees = 0;
+	for (LoadDriver *load : config.loads())
+		degrees = std::max(degrees, load->gain() * load->read_load());
+	temp_state.set_feedforward(degrees);
+}
+
+
+/* Read the first set of temperatures and set the initial fan levels. */
+void init_control(const Config &config, SensorPoller &poller)
 {
 	tmp_sleeptime = sleeptime;
 
 	temp_state.restart();
-	for (const SensorDriver *sensor : config.sensors())
-		sensor->read_temps();
+	read_loads(config);
+	// Give udp peers a chance to report before their temperatures count. Only
+	// on startup: After a reload, this would keep signals & the control
+	// socket waiting for up to the stale timeout. Unchanged peers have kept
+	// their readings anyway, and a new one runs the fans up until it reports.
+	static bool started = false;
+	if (!started)
+		UdpListener::await_all();
+	started = true;
+	poller.read_temps(true);
 	temp_state.first_run();
 
-	// Set initial fan level
-	std::vector<const Level *>::const_iterator cur_lvl = config.levels().begin();
-	config.fan()->init();
-	while (cur_lvl != config.levels().end() && (*cur_lvl)->up())
-		cur_lvl++;
-	log(TF_NOT) << temp_state << " -> " <<
-			(*cur_lvl)->str() << flush;
-	config.fan()->set_speed(*cur_lvl);
+	for (unsigned int i = 0; i < config.fans().size(); ++i) {
+		FanConfig *fan_cfg = config.fans()[i];
+		fan_cfg->init_fanspeed();
+		log_level(TF_NOT, config, fan_cfg);
+		if (metrics)
+			metrics->fan(i).set_level(fan_cfg->cur_lvl_idx(), false);
+	}
+}
 
-	while (likely(!interrupted)) {
-		temp_state.restart();
-
-		for (const SensorDriver *sensor : config.sensors())
-			sensor->read_temps();
-		if (unlikely(!temp_state.complete()))
-			throw SystemError(MSG_SENSOR_LOST);
-
-		if (unlikely((*cur_lvl)->up())) {
-			while (cur_lvl != config.levels().end() && (*cur_lvl)->up())
-				cur_lvl++;
-			log(TF_INF) << temp_state << " -> " <<
-					(*cur_lvl)->str() << flush;
-			config.fan()->set_speed(*cur_lvl);
+
+/* One iteration of the control loop, without the sleep: Read whatever sensors
+ * are due and set all fans accordingly. A main cycle also re-adapts the
+ * sleeptime and pings the fan watchdog. Returns true if tmp_sleeptime was
+ * shortened, i.e. the next main cycle should come earlier. */
+bool control_cycle(const Config &config, SensorPoller &poller, bool cycle)
+{
+	typedef SensorPoller::clock clock;
+	clock::time_point start = metrics ? clock::now() : clock::time_point();
+	TF_PROBE1(cycle__start, int(cycle));
+	bool shortened = false;
+	auto end = probe_end([&] { TF_PROBE2(cycle__end, int(cycle), int(shortened)); });
+
+	temp_state.restart();
+
+	// Before the temperatures, so it takes effect in this very cycle
+	read_loads(config);
+	UdpListener::receive_all();
+	poller.read_temps(cycle);
+	if (unlikely(!temp_state.complete()))
+		throw SystemError(MSG_SENSOR_LOST);
+
+	shortened = temp_state.adapt_sleeptime(cycle);
+
+	for (unsigned int i = 0; i < config.fans().size(); ++i) {
+		FanConfig *fan_cfg = config.fans()[i];
+		clock::time_point fan_start = metrics ? clock::now() : start;
+		unsigned int old_lvl = fan_cfg->cur_lvl_idx();
+		bool changed = fan_cfg->set_fanspeed(cycle);
+		if (metrics) {
+			// Only a level change actually calls FanDriver::set_speed()
+			if (changed)
+				metrics->fan(i).set_speed.observe(clock::now() - fan_start);
+			metrics->fan(i).set_level(fan_cfg->cur_lvl_idx(), changed);
 		}
-		else if (unlikely((*cur_lvl)->down())) {
-			while (cur_lvl != config.levels().begin() && (*cur_lvl)->down())
-				cur_lvl--;
-			log(TF_INF) << temp_state << " -> " <<
-					(*cur_lvl)->str() << flush;
-			config.fan()->set_speed(*cur_lvl);
-			tmp_sleeptime = sleeptime;
+		if (unlikely(changed)) {
+			TF_PROBE4(level__change, fan_cfg->fan()->path().c_str(), old_lvl, fan_cfg->cur_lvl_idx(),
+					*temp_state.tmax);
+			log_level(TF_INF, config, fan_cfg);
 		}
-		else {
-			config.fan()->ping_watchdog_and_depulse(*cur_lvl);
+	}
 #ifdef DEBUG
-			log(TF_DBG) << temp_state << flush;
+	log(TF_DBG) << temp_state << flush;
 #endif
+
+	if (metrics) {
+		metrics->publish(temp_state);
+		metrics->cycle().observe(clock::now() - start);
+	}
+	if (trace)
+		trace->record(temp_state, config);
+	if (exporter)
+		exporter->send(temp_state);
+	if (state)
+		state->publish(temp_state, config, poller);
+
+	return shortened;
+}
+
+
+static string format_ms(Config::clock::duration d)
+{
+	char buf[32];
+	snprintf(buf, sizeof(buf), "%.3f ms", std::chrono::duration<double, std::milli>(d).count());
+	return buf;
+}
+
+
+/* The --startup-profile report: What each driver took to construct & init(),
+ * and how long it took until the fans had their first level. */
+static void log_startup_profile(const Config &config, Config::clock::duration first_cycle)
+{
+	for (const Config::DriverTiming &t : config.timings()) {
+		string line = MSG_STARTUP_DRIVER(t.kind, t.path, format_ms(t.construct));
+		if (string(t.kind) != "fan")
+			line += MSG_STARTUP_INIT(format_ms(t.init));
+		log(TF_NOT) << line << flush;
+	}
+	log(TF_NOT) << MSG_STARTUP_TOTAL(format_ms(startup_parse), format_ms(config.init_time()),
+			format_ms(first_cycle)) << flush;
+}
+
+
+void run(const Config &config)
+{
+	typedef SensorPoller::clock clock;
+
+	// Must be attached before the poller picks up its sensor metrics
+	if (metrics)
+		metrics->attach(config);
+	SensorPoller poller(config.sensors(), num_threads, metrics.get());
+	if (trace)
+		trace->attach(config);
+	if (exporter)
+		exporter->attach(config);
+	if (state)
+		state->attach(config);
+	EventLoop events(config.sensors(), control ? control->fd() : -1);
+
+	clock::time_point init_start = clock::now();
+	init_control(config, poller);
+	if (startup_profile) {
+		log_startup_profile(config, clock::now() - init_start);
+		startup_profile = false;
+	}
+
+	clock::time_point next_cycle = clock::now();
+
+	while (likely(!interrupted)) {
+		clock::time_point now = clock::now();
+
+		// Sensors without a poll interval (and watchdog/depulsing) follow the
+		// adaptive cycle, everything else follows its own schedule.
+		bool cycle = now >= next_cycle;
+
+		if (unlikely(control_cycle(config, poller, cycle)))
+			next_cycle = std::min(next_cycle, now + tmp_sleeptime);
+
+		if (cycle) {
+			next_cycle += tmp_sleeptime;
+			if (next_cycle <= now)
+				next_cycle = now + tmp_sleeptime;
 		}
 
-		std::this_thread::sleep_for(sleeptime);
+		// An absolute deadline doesn't drift by the time the sensor reads take
+		switch (events.wait(std::min(next_cycle, poller.next_due()))) {
+		case EventLoop::SIGNAL:
+			handle_signal(events.signal());
+			break;
+		case EventLoop::ALARM:
+			// Don't wait for the next main cycle to look at all sensors
+			log(TF_INF) << MSG_SENSOR_ALARM(events.alarm()) << flush;
+			next_cycle = clock::now();
+			break;
+		case EventLoop::CONTROL:
+			// Apply a new bias or forced level right away
+			if (control->handle(config))
+				next_cycle = clock::now();
+			break;
+		case EventLoop::TIMEOUT:
+			break;
+		}
 	}
 }
 
 
 int set_options(int argc, char **argv)
 {
-	const char *optstring = "c:s:b:p::hqDznv"
+	// Long options without a short equivalent
+	enum { OPT_REPLAY = 256, OPT_EXPORT, OPT_NODE, OPT_STATE, OPT_CONTROL, OPT_IO_URING, OPT_STARTUP_PROFILE,
+		OPT_COMPILE_CONFIG };
+	static const struct option longopts[] = {
+		{ "record", required_argument, nullptr, 'r' },
+		{ "replay", required_argument, nullptr, OPT_REPLAY },
+		{ "export", required_argument, nullptr, OPT_EXPORT },
+		{ "node", required_argument, nullptr, OPT_NODE },
+		{ "state", required_argument, nullptr, OPT_STATE },
+		{ "control", required_argument, nullptr, OPT_CONTROL },
+		{ "startup-profile", no_argument, nullptr, OPT_STARTUP_PROFILE },
+		{ "compile-config", no_argument, nullptr, OPT_COMPILE_CONFIG },
+#ifdef USE_IO_URING
+		{ "io-uring", no_argument, nullptr, OPT_IO_URING },
+#endif
+		{ nullptr, 0, nullptr, 0 }
+	};
+
+	const char *optstring = "c:s:b:p::j:t:m:r:hqDznv"
 #ifdef USE_ATASMART
 			"d";
 #else
 	;
 #endif
 	opterr = 0;
-	while ((opt = getopt(argc, argv, optstring)) != -1) {
+	while ((opt = getopt_long(argc, argv, optstring, longopts, nullptr)) != -1) {
 		switch(opt) {
 		case 'h':
 			log(TF_INF) << MSG_TITLE << flush << MSG_USAGE << flush;
@@ -183,18 +382,18 @@ int set_options(int argc, char **argv)
 			if (optarg) {
 				try {
 					size_t invalid;
-					int s;
+					float s;
 					string arg(optarg);
-					s = std::stoul(arg, &invalid);
+					s = std::stof(arg, &invalid);
 					if (invalid < arg.length())
 						throw InvocationError(MSG_OPT_S_INVAL(optarg));
 					if (s > 15)
 						throw InvocationError(MSG_OPT_S_15(s));
 					else if (s < 0)
 						throw InvocationError("Negative sleep time? Seriously?");
-					else if (s < 1)
+					else if (s < 0.1f)
 						throw InvocationError(MSG_OPT_S_1(s));
-					sleeptime = seconds(static_cast<unsigned int>(s));
+					sleeptime = milliseconds(std::lround(s * 1000));
 				} catch (std::invalid_argument &e) {
 					throw InvocationError(MSG_OPT_S_INVAL(optarg));
 				} catch (std::out_of_range &e) {
@@ -234,12 +433,77 @@ int set_options(int argc, char **argv)
 			}
 			else depulse = 0.5f;
 			break;
+		case 'j':
+			try {
+				size_t invalid;
+				string arg(optarg);
+				unsigned long j = std::stoul(arg, &invalid);
+				if (invalid < arg.length() || j > 256)
+					throw InvocationError(MSG_OPT_J_INVAL(optarg));
+				num_threads = j;
+			} catch (std::invalid_argument &e) {
+				throw InvocationError(MSG_OPT_J_INVAL(optarg));
+			} catch (std::out_of_range &e) {
+				throw InvocationError(MSG_OPT_J_INVAL(optarg));
+			}
+			break;
+		case 't':
+			try {
+				size_t invalid;
+				string arg(optarg);
+				float t = std::stof(arg, &invalid);
+				if (invalid < arg.length())
+					throw InvocationError(MSG_OPT_T_INVAL(optarg));
+				if (t < 0.01f || t > 60)
+					error<InvocationError>(MSG_OPT_T);
+				sensor_timeout = secondsf(t);
+			} catch (std::invalid_argument &e) {
+				throw InvocationError(MSG_OPT_T_INVAL(optarg));
+			} catch (std::out_of_range &e) {
+				throw InvocationError(MSG_OPT_T_INVAL(optarg));
+			}
+			break;
+		case 'm':
+			metrics_file = optarg;
+			break;
+		case 'r':
+			trace_file = optarg;
+			break;
+		case OPT_REPLAY:
+			replay_file = optarg;
+			break;
+		case OPT_EXPORT:
+			export_address = optarg;
+			break;
+		case OPT_NODE:
+			export_node = optarg;
+			break;
+		case OPT_STATE:
+			state_file = optarg;
+			break;
+		case OPT_CONTROL:
+			control_path = optarg;
+			break;
+		case OPT_STARTUP_PROFILE:
+			startup_profile = true;
+			break;
+		case OPT_COMPILE_CONFIG:
+			compile_config = true;
+			break;
+#ifdef USE_IO_URING
+		case OPT_IO_URING:
+			uring_reads = true;
+			break;
+#endif
 		default:
-			throw InvocationError(string("Unknown option: -") + static_cast<char>(optopt));
+			if (optopt)
+				throw InvocationError(string("Unknown option: -") + static_cast<char>(optopt));
+			else
+				throw InvocationError(string("Unknown option: ") + argv[optind - 1]);
 		}
 	}
 	if (depulse > 0)
-		log(TF_INF) << MSG_DEPULSE(depulse, sleeptime.count()) << flush;
+		log(TF_INF) << MSG_DEPULSE(depulse, secondsf(sleeptime).count()) << flush;
 
 	return 0;
 }
@@ -267,71 +531,229 @@ PidFileHolder::~PidFileHolder()
 }
 
 
+/*----------------------------------------------------------------------------
+| TemperatureState: update() is written as one branch-free loop over plain   |
+| arrays, so the compiler can vectorize it. Samples that aren't fresh leave  |
+| their temperature and bias untouched. The default trend applies a bias of  |
+| bias_level times any jump of more than 2°C, which then decays by 20% plus  |
+| one degree per update. The predictive trends instead set the bias to the   |
+| rise they expect within the sensor's horizon, from the derivative of the   |
+| last two samples (TREND_DERIVATIVE) or from an exponentially smoothed      |
+| derivative (TREND_EWMA). Fans may thus ramp up before a spike arrives.     |
+| A predicted fall is never applied, since that could only delay cooling.    |
+----------------------------------------------------------------------------*/
+
 TemperatureState::TemperatureState(unsigned int num_temps)
 : temps_(num_temps, 0),
   biases_(num_temps, 0),
   biased_temps_(num_temps, 0),
-  temp_(temps_.begin()),
-  bias_(biases_.begin()),
-  biased_temp_(biased_temps_.begin()),
-  tmax(0)
+  control_temps_(num_temps, 0),
+  predict_(num_temps, 0),
+  smooth_(num_temps, 0),
+  horizon_(num_temps, 0),
+  slopes_(num_temps, 0),
+  last_sample_(num_temps, 0),
+  feedforward_(0),
+  complete_(false),
+  rising_(false),
+  falling_(false),
+  tmax(biased_temps_.begin())
 {}
 
 
-void TemperatureState::restart()
+TemperatureState::TemperatureState(const std::vector<const SensorDriver *> &sensors)
+: TemperatureState(0u)
 {
-	temp_ = temps_.begin();
-	bias_ = biases_.begin();
-	biased_temp_ = biased_temps_.begin();
+	for (const SensorDriver *sensor : sensors) {
+		unsigned int n = sensor->num_temps();
+		predict_.insert(predict_.end(), n, sensor->trend() != TREND_JUMP);
+		smooth_.insert(smooth_.end(), n, sensor->trend() == TREND_EWMA);
+		horizon_.insert(horizon_.end(), n, sensor->horizon().count());
+	}
+	const size_t n = predict_.size();
+	temps_.resize(n, 0);
+	biases_.resize(n, 0);
+	biased_temps_.resize(n, 0);
+	control_temps_.resize(n, 0);
+	slopes_.resize(n, 0);
+	last_sample_.resize(n, 0);
 	tmax = biased_temps_.begin();
 }
 
 
-void TemperatureState::add_temp(int t)
+TemperatureState::TemperatureState(const Config &config)
+: TemperatureState(config.sensors())
 {
-	int diff = t - *temp_;
-	*temp_ = t;
+	if (config.groups().empty())
+		return;
+
+	group_of_.assign(config.temp_groups().begin(), config.temp_groups().end());
+	group_size_.assign(config.groups().size(), 0);
+	for (unsigned int g : group_of_)
+		++group_size_[g];
+
+	for (const SensorGroup &group : config.groups()) {
+		group_rank_.push_back(group.rank);
+		top_offset_.push_back(top_.size());
+		top_.resize(top_.size() + group.rank);
+	}
+	sums_.resize(config.groups().size());
+	group_temps_.resize(config.groups().size());
+}
 
-	if (unlikely(diff > 2)) {
-		// Apply bias_ if temperature changed quickly
-		float tmp_bias = (float)diff * bias_level;
 
-		*bias_ = int(tmp_bias);
-		if (tmp_sleeptime > seconds(2))
-			tmp_sleeptime = seconds(2);
+void TemperatureState::restart()
+{
+	tmax = biased_temps_.begin();
+	complete_ = false;
+	rising_ = false;
+	falling_ = false;
+}
+
+
+static inline int round_int(float f)
+{ return int(f + (f < 0 ? -0.5f : 0.5f)); }
+
+
+/* The body of TemperatureState::update(). It's written so that GCC can
+ * if-convert & vectorize the whole loop (which needs -fno-trapping-math), and
+ * it takes plain restrict pointers since GCC ignores restrict on locals.
+ * A sample that isn't fresh is multiplied out rather than branched around:
+ * Its diff is 0 and its weight fm is 0. Returns the highest biased temperature,
+ * rising gets the highest rise (or predicted rise), falling the lowest diff. */
+static int update_temps(unsigned int n, const int *__restrict__ samples, const unsigned char *__restrict__ fresh,
+		double now, float jump_level, int feedforward, int *__restrict__ temps, float *__restrict__ biases,
+		int *__restrict__ biased, int *__restrict__ control, float *__restrict__ slopes,
+		double *__restrict__ last, const int *__restrict__ predict, const float *__restrict__ smooth,
+		const float *__restrict__ horizon, int &rising, int &falling)
+{
+	int max = std::numeric_limits<int>::min();
+	int max_rise = 0, min_diff = 0;
+
+	for (unsigned int i = 0; i < n; ++i) {
+		const int is_fresh = fresh[i] != 0;
+		const float fm = is_fresh;
+		const int t = temps[i];
+		const int diff = is_fresh * (samples[i] - t);
+		const float b = biases[i];
+		const int p = predict[i];
+		const float h = horizon[i];
+
+		// TREND_JUMP
+		const float mag = std::fabs(b) * 0.8f - 1;
+		const float decayed = mag > 0 ? std::copysign(mag, b) : 0;
+		const float jump = diff > 2 ? diff * jump_level : (diff < 0 ? 0 : decayed);
+
+		// TREND_DERIVATIVE & TREND_EWMA: With smooth == 0, alpha is 1 and the
+		// slope is just the derivative.
+		const float old_slope = slopes[i];
+		const float dt = std::max(float(now - last[i]), 0.001f);
+		const float raw = diff / dt;
+		const float alpha = fm * (1 - smooth[i] * h / (dt + h));
+		const float slope = old_slope + alpha * (raw - old_slope);
+		const float predicted = std::max(0.0f, slope * h);
+
+		const float bias = b + fm * ((p ? predicted : jump) - b);
+		const int temp = t + diff;
+		const int rounded = round_int(bias);
+
+		temps[i] = temp;
+		biases[i] = bias;
+		slopes[i] = slope;
+		last[i] += fm * (now - last[i]);
+		biased[i] = temp + rounded + feedforward;
+		// Complex levels don't see the jump bias, but they do see a prediction
+		control[i] = temp + p * rounded + feedforward;
+
+		max = std::max(max, temp + rounded + feedforward);
+		max_rise = std::max(max_rise, is_fresh * (p ? round_int(predicted) : diff));
+		min_diff = std::min(min_diff, diff);
 	}
-	else {
-		if (unlikely(diff < 0)) {
-			// Return to normal operation if temperature dropped
-			tmp_sleeptime = sleeptime;
-			*bias_ = 0;
-		}
-		else {
-			// Slowly return to normal sleeptime
-			if (unlikely(tmp_sleeptime < sleeptime)) tmp_sleeptime++;
-			// slowly reduce the bias_
-			if (unlikely(*bias_ != 0)) {
-				if (std::abs(*bias_) < 0.5)
-					*bias_ = 0;
-				else
-					*bias_ -= 1 + *bias_/5 ;
-			}
+
+	rising = max_rise;
+	falling = min_diff;
+	return max;
+}
+
+
+/* now is in seconds, on any clock that doesn't jump. */
+void TemperatureState::update(const std::vector<int> &samples, const std::vector<unsigned char> &fresh, double now)
+{
+	const unsigned int n = temps_.size();
+	if (unlikely(samples.size() != n || fresh.size() != n))
+		return;
+
+	int rising, falling;
+	int max = update_temps(n, samples.data(), fresh.data(), now, bias_level, feedforward_,
+			temps_.data(), biases_.data(), biased_temps_.data(), control_temps_.data(),
+			slopes_.data(), last_sample_.data(), predict_.data(), smooth_.data(), horizon_.data(),
+			rising, falling);
+
+	rising_ = rising > 2;
+	falling_ = falling < 0;
+	tmax = std::find(biased_temps_.begin(), biased_temps_.end(), max);
+	if (!group_of_.empty())
+		aggregate();
+	complete_ = true;
+}
+
+
+/* Reduce the control temperatures to one per sensor group, in a single pass.
+ * A group with rank k keeps its k highest temperatures sorted in top_, which
+ * is cheap since k is small. */
+void TemperatureState::aggregate()
+{
+	std::fill(top_.begin(), top_.end(), std::numeric_limits<int>::min());
+	std::fill(sums_.begin(), sums_.end(), 0);
+
+	for (unsigned int i = 0; i < group_of_.size(); ++i) {
+		const unsigned int g = group_of_[i];
+		const int t = control_temps_[i];
+		sums_[g] += t;
+
+		const unsigned int k = group_rank_[g];
+		int *top = top_.data() + top_offset_[g];
+		if (k && t > top[k - 1]) {
+			unsigned int j = k - 1;
+			for (; j > 0 && top[j - 1] < t; --j)
+				top[j] = top[j - 1];
+			top[j] = t;
 		}
 	}
 
-	*biased_temp_ = *temp_ + *bias_;
+	for (unsigned int g = 0; g < group_temps_.size(); ++g) {
+		if (group_rank_[g])
+			group_temps_[g] = top_[top_offset_[g] + group_rank_[g] - 1];
+		else
+			group_temps_[g] = round_int(float(sums_[g]) / group_size_[g]);
+	}
+}
 
-	if (*biased_temp_ > *tmax)
-		tmax = biased_temp_;
 
-	++temp_;
-	++bias_;
-	++biased_temp_;
+/* Shorten the cycle time while temperatures are rising quickly, and return to
+ * the normal sleeptime in steps once they've calmed down. Returns true if the
+ * cycle time was shortened, i.e. if the next cycle has to come earlier. */
+bool TemperatureState::adapt_sleeptime(bool cycle)
+{
+	if (unlikely(rising_)) {
+		milliseconds fast = std::min<milliseconds>(seconds(2), sleeptime / 2);
+		if (tmp_sleeptime > fast) {
+			tmp_sleeptime = fast;
+			return true;
+		}
+	}
+	else if (cycle && unlikely(tmp_sleeptime < sleeptime)) {
+		if (falling_)
+			tmp_sleeptime = sleeptime;
+		else
+			tmp_sleeptime = std::min(tmp_sleeptime + sleeptime / 5, sleeptime);
+	}
+	return false;
 }
 
 
 bool TemperatureState::complete() const
-{ return temp_ == temps_.end(); }
+{ return complete_; }
 
 
 const std::vector<int> &TemperatureState::get() const
@@ -342,16 +764,51 @@ const std::vector<float> &TemperatureState::biases() const
 { return biases_; }
 
 
+const std::vector<int> &TemperatureState::biased() const
+{ return biased_temps_; }
+
+
+const std::vector<int> &TemperatureState::control() const
+{ return control_temps_; }
+
+
+/* What complex levels are compared against: One temperature per sensor group
+ * if there are any, otherwise each control temperature. */
+const std::vector<int> &TemperatureState::columns() const
+{ return group_of_.empty() ? control_temps_ : group_temps_; }
+
+
+bool TemperatureState::grouped() const
+{ return !group_of_.empty(); }
+
+
+int TemperatureState::feedforward() const
+{ return feedforward_; }
+
+
+/* Degrees added to all temperatures from the next update() on, i.e. before
+ * they have actually risen. */
+void TemperatureState::set_feedforward(float degrees)
+{ feedforward_ = round_int(degrees); }
+
+
 void TemperatureState::first_run()
 {
-	biases_.clear();
-	biases_.resize(temps_.size(), 0);
-	biased_temps_ = temps_;
+	std::fill(biases_.begin(), biases_.end(), 0);
+	std::fill(slopes_.begin(), slopes_.end(), 0);
+	for (size_t i = 0; i < temps_.size(); ++i)
+		biased_temps_[i] = control_temps_[i] = temps_[i] + feedforward_;
+	tmax = std::max_element(biased_temps_.begin(), biased_temps_.end());
+	if (!group_of_.empty())
+		aggregate();
 }
 
 }
 
 
+// thinkfan-bench links this file, but brings its own main()
+#ifndef THINKFAN_BENCH
+
 int main(int argc, char **argv) {
 	using namespace thinkfan;
 
@@ -366,14 +823,8 @@ int main(int argc, char **argv) {
 	memset(&handler, 0, sizeof(handler));
 	handler.sa_handler = sig_handler;
 
-	// Install signal handler only after FanControl object has been created
-	// since it is used by the handler.
-	if (sigaction(SIGHUP, &handler, NULL)
-	 || sigaction(SIGINT, &handler, NULL)
-	 || sigaction(SIGTERM, &handler, NULL)
-	 || sigaction(SIGUSR1, &handler, NULL)
-	 || sigaction(SIGUSR2, &handler, NULL)
-	 || sigaction(SIGSEGV, &handler, NULL)) {
+	// Everything else is handled by the EventLoop via a signalfd
+	if (sigaction(SIGSEGV, &handler, NULL)) {
 		string msg = strerror(errno);
 		log(TF_ERR) << "sigaction: " << msg;
 		return 1;
@@ -391,10 +842,28 @@ int main(int argc, char **argv) {
 			return 3;
 		}
 
-		// Load the config temporarily once so we may fail before forking
-		LogLevel old_lvl = Logger::instance().set_log_lvl(TF_ERR);
-		delete Config::read_config(config_file);
-		Logger::instance().set_log_lvl(old_lvl);
+		if (replay_file.length()) {
+			std::unique_ptr<Config> config(Config::read_offline(config_file));
+			replay(replay_file, *config);
+			return 0;
+		}
+
+		if (compile_config) {
+			if (!chk_sanity)
+				throw InvocationError(MSG_IMAGE_INSANE);
+			ConfigImage::compile(config_file);
+			return 0;
+		}
+
+		// Before any thread is started, so that only the EventLoop sees them
+		EventLoop::block_signals();
+
+		// Only checked before forking, so we may still fail on the terminal.
+		// The drivers are constructed, but init() touches hardware and may start
+		// threads, which wouldn't survive the fork.
+		Config::clock::time_point parse_start = Config::clock::now();
+		std::unique_ptr<Config> config(Config::read_config(config_file, nullptr, false));
+		startup_parse = Config::clock::now() - parse_start;
 
 		if (daemonize) {
 			pid_t child_pid = ::fork();
@@ -404,6 +873,8 @@ int main(int argc, char **argv) {
 			}
 			else if (child_pid > 0) {
 				log(TF_INF) << "Daemon PID: " << child_pid << flush;
+				// The fans belong to the child now, so they mustn't be reset here
+				config.release();
 				return 0;
 			}
 			else {
@@ -417,9 +888,30 @@ int main(int argc, char **argv) {
 			pid_file.reset(new PidFileHolder(::getpid()));
 		}
 
-		// Load the config for real after forking & enabling syslog
-		std::unique_ptr<const Config> config(Config::read_config(config_file));
-		temp_state = TemperatureState(config->num_temps());
+		// From here on, the control loop never waits for log output
+		Logger::instance().start_writer();
+
+		// Also a thread, so it has to be started after forking
+		if (metrics_file.length())
+			metrics.reset(new MetricsExporter(metrics_file));
+		if (trace_file.length())
+			trace.reset(new TraceRecorder(trace_file));
+		if (export_address.length()) {
+			if (export_node.empty()) {
+				char hostname[256] = { 0 };
+				::gethostname(hostname, sizeof(hostname) - 1);
+				export_node = hostname;
+			}
+			exporter.reset(new UdpExporter(export_address, export_node));
+		}
+		if (state_file.length())
+			state.reset(new StatePublisher(state_file));
+		// After the PID file, which makes sure we don't take over a live socket
+		if (control_path.length())
+			control.reset(new ControlSocket(control_path));
+
+		config->init_drivers();
+		temp_state = TemperatureState(*config);
 
 		do {
 			run(*config);
@@ -427,18 +919,25 @@ int main(int argc, char **argv) {
 			if (interrupted == SIGHUP) {
 				log(TF_INF) << MSG_RELOAD_CONF << flush;
 				try {
-					std::unique_ptr<const Config> config_new(Config::read_config(config_file));
+					// Unchanged drivers are handed over instead of being reset & re-opened
+					std::unique_ptr<Config> config_new(Config::read_config(config_file, config.get()));
 					config.swap(config_new);
+					temp_state = TemperatureState(*config);
 				} catch(ExpectedError &e) {
 					log(TF_ERR) << MSG_CONF_RELOAD_ERR << flush;
+					if (state)
+						state->reload_failed();
 				} catch(std::exception &e) {
 					log(TF_ERR) << "read_config: " << e.what() << flush;
 					log(TF_ERR) << MSG_CONF_RELOAD_ERR << flush;
+					if (state)
+						state->reload_failed();
 				}
 				interrupted = 0;
 			}
 			else if (interrupted == SIGUSR2) {
-				config->fan()->init();
+				for (const FanConfig *fan_cfg : config->fans())
+					fan_cfg->fan()->init();
 				interrupted = 0;
 			}
 		} while (!interrupted);
@@ -464,6 +963,4 @@ int main(int argc, char **argv) {
 	return 0;
 }
 
-
-
-
+#endif /* THINKFAN_BENCH */
@@ -38,6 +38,14 @@
 #define DEFAULT_SENSOR "/proc/acpi/ibm/thermal"
 #endif
 
+#ifndef HWMON_ROOT
+#define HWMON_ROOT "/sys/class/hwmon"
+#endif
+
+#ifndef HWMON_CACHE
+#define HWMON_CACHE "/var/cache/thinkfan/hwmon"
+#endif
+
 
 // Stolen from the gurus
 #define likely(x)       __builtin_expect((x),1)
@@ -51,25 +59,68 @@ typedef std::ofstream ofstream;
 typedef std::fstream fstream;
 typedef std::chrono::duration<unsigned int> seconds;
 typedef std::chrono::duration<float> secondsf;
+typedef std::chrono::milliseconds milliseconds;
+
+
+class SensorDriver;
+class Config;
 
 
+/* All temperatures as structure of arrays, one entry per temperature. The
+ * whole state is updated in a single pass over all samples. */
 class TemperatureState {
 public:
+	// How the bias of a temperature is computed
+	enum Trend {
+		TREND_JUMP,		// bias_level times any sudden rise of more than 2°C
+		TREND_DERIVATIVE,	// Predicted rise over the next horizon, from the last two samples
+		TREND_EWMA		// Same, but with an exponentially smoothed derivative
+	};
+
 	TemperatureState(unsigned int num_temps);
+	TemperatureState(const std::vector<const SensorDriver *> &sensors);
+	TemperatureState(const Config &config);
 	void restart();
-	void add_temp(int t);
+	void update(const std::vector<int> &samples, const std::vector<unsigned char> &fresh, double now);
+	void set_feedforward(float degrees);
+	bool adapt_sleeptime(bool cycle);
 
 	const std::vector<int> &get() const;
 	const std::vector<float> &biases() const;
+	const std::vector<int> &biased() const;
+	const std::vector<int> &control() const;
+	const std::vector<int> &columns() const;
+	bool grouped() const;
+	int feedforward() const;
 	bool complete() const;
 	void first_run();
 private:
 	std::vector<int> temps_;
 	std::vector<float> biases_;
 	std::vector<int> biased_temps_;
-	std::vector<int>::iterator temp_;
-	std::vector<float>::iterator bias_;
-	std::vector<int>::iterator biased_temp_;
+	std::vector<int> control_temps_;
+	std::vector<int> predict_;
+	std::vector<float> smooth_;
+	std::vector<float> horizon_;
+	std::vector<float> slopes_;
+	std::vector<double> last_sample_;
+
+	// Sensor groups: The group of each temperature, and per group its size,
+	// rank (0 for the mean), where its highest temperatures are kept in top_,
+	// and the running sum.
+	void aggregate();
+	std::vector<unsigned int> group_of_;
+	std::vector<unsigned int> group_size_;
+	std::vector<unsigned int> group_rank_;
+	std::vector<unsigned int> top_offset_;
+	std::vector<int> top_;
+	std::vector<long long> sums_;
+	std::vector<int> group_temps_;
+
+	int feedforward_;
+	bool complete_;
+	bool rising_;
+	bool falling_;
 public:
 	std::vector<int>::const_iterator tmax;
 };
@@ -91,11 +142,24 @@ extern bool daemonize;
 #ifdef USE_ATASMART
 extern bool dnd_disk;
 #endif /* USE_ATASMART */
-extern seconds sleeptime, tmp_sleeptime;
+extern milliseconds sleeptime, tmp_sleeptime;
+extern unsigned int num_threads;
+#ifdef USE_IO_URING
+extern bool uring_reads;
+#endif
+extern secondsf sensor_timeout;
+extern string export_address;
 extern float bias_level;
 extern volatile int interrupted;
 extern TemperatureState temp_state;
 
 
+class Config;
+class SensorPoller;
+
+void init_control(const Config &config, SensorPoller &poller);
+bool control_cycle(const Config &config, SensorPoller &poller, bool cycle);
+
+
 }
 #endif /* THINKFAN_H_ */
@@ -0,0 +1,353 @@
+/********************************************************************
+ * trace.cpp: Recording of temperatures & fan levels, and offline replay.
+ * (C) 2015, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "error.h"
+#include "trace.h"
+#include "config.h"
+#include "message.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+
+namespace thinkfan {
+
+static const char TRACE_MAGIC[8] = { 'T', 'F', 'T', 'R', 'A', 'C', 'E', '1' };
+
+// About two weeks worth of records with 16 temperatures at the default
+// sleeptime. Once full, the oldest records are overwritten.
+static const size_t TRACE_MAX_SIZE = 32 << 20;
+
+// Ask the kernel to start writing back dirty pages every so many records
+static const unsigned int TRACE_SYNC_RECORDS = 64;
+
+// Longer gaps between records (i.e. thinkfan wasn't running) aren't counted
+// as time spent in a fan level.
+static const int64_t TRACE_MAX_GAP_NS = 15 * 1000000000ll;
+
+
+/*----------------------------------------------------------------------------
+| TraceFile: Common part of recorder & reader, i.e. the file and its mapping.|
+----------------------------------------------------------------------------*/
+
+TraceFile::TraceFile(const string &path)
+: path_(path),
+  fd_(-1),
+  map_(nullptr),
+  map_size_(0),
+  header_(nullptr)
+{}
+
+
+TraceFile::~TraceFile()
+{
+	unmap();
+	if (fd_ >= 0)
+		::close(fd_);
+}
+
+
+size_t TraceFile::record_size(unsigned int num_temps, unsigned int num_fans)
+{
+	size_t rv = sizeof(int64_t) + (2 * num_temps + num_fans) * sizeof(int32_t);
+	return (rv + 7) & ~size_t(7);
+}
+
+
+void TraceFile::map(size_t size, bool writable)
+{
+	void *addr = ::mmap(nullptr, size, PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED, fd_, 0);
+	if (addr == MAP_FAILED)
+		throw IOerror(MSG_TRACE_OPEN(path_), errno);
+	map_ = static_cast<char *>(addr);
+	map_size_ = size;
+	header_ = reinterpret_cast<TraceHeader *>(map_);
+}
+
+
+void TraceFile::unmap()
+{
+	if (map_) {
+		::munmap(map_, map_size_);
+		map_ = nullptr;
+		header_ = nullptr;
+		map_size_ = 0;
+	}
+}
+
+
+char *TraceFile::record(uint64_t n) const
+{ return map_ + sizeof(TraceHeader) + (n % header_->capacity) * header_->record_size; }
+
+
+/* Read & check the header of an existing trace file. Returns false if
+ * the file is empty or doesn't look like a complete trace. */
+bool TraceFile::read_header(int fd, TraceHeader &hdr, const string &path)
+{
+	struct stat st;
+	if (::fstat(fd, &st))
+		throw IOerror(MSG_TRACE_OPEN(path), errno);
+	if (size_t(st.st_size) < sizeof(hdr))
+		return false;
+	if (::pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr))
+		throw IOerror(MSG_TRACE_OPEN(path), errno);
+
+	return std::memcmp(hdr.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) == 0
+			&& hdr.capacity > 0
+			&& hdr.record_size == record_size(hdr.num_temps, hdr.num_fans)
+			&& size_t(st.st_size) == sizeof(hdr) + size_t(hdr.capacity) * hdr.record_size;
+}
+
+
+/*----------------------------------------------------------------------------
+| TraceRecorder: An existing trace with the same number of temperatures and  |
+| fans is continued. Otherwise, the file is started over.                    |
+----------------------------------------------------------------------------*/
+
+TraceRecorder::TraceRecorder(const string &path)
+: TraceFile(path),
+  unsynced_(0)
+{
+	fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd_ < 0)
+		throw IOerror(MSG_TRACE_OPEN(path_), errno);
+}
+
+
+TraceRecorder::~TraceRecorder()
+{
+	if (map_)
+		::msync(map_, map_size_, MS_SYNC);
+}
+
+
+void TraceRecorder::attach(const Config &config)
+{
+	const unsigned int num_temps = config.num_temps();
+	const unsigned int num_fans = config.fans().size();
+
+	if (map_ && header_->num_temps == num_temps && header_->num_fans == num_fans)
+		return;
+
+	unmap();
+	TraceHeader hdr = TraceHeader();
+	if (read_header(fd_, hdr, path_) && hdr.num_temps == num_temps && hdr.num_fans == num_fans) {
+		map(sizeof(hdr) + size_t(hdr.capacity) * hdr.record_size, true);
+		return;
+	}
+
+	if (hdr.written > 0 && std::memcmp(hdr.magic, TRACE_MAGIC, sizeof(TRACE_MAGIC)) == 0)
+		log(TF_NOT) << MSG_TRACE_RESTART(path_) << flush;
+	create(num_temps, num_fans);
+}
+
+
+void TraceRecorder::create(unsigned int num_temps, unsigned int num_fans)
+{
+	const size_t rec_size = record_size(num_temps, num_fans);
+	const size_t capacity = std::max<size_t>(1, (TRACE_MAX_SIZE - sizeof(TraceHeader)) / rec_size);
+	const size_t size = sizeof(TraceHeader) + capacity * rec_size;
+
+	// Truncating first makes sure the whole file reads as zeroes
+	if (::ftruncate(fd_, 0) || ::ftruncate(fd_, size))
+		throw IOerror(MSG_TRACE_OPEN(path_), errno);
+	map(size, true);
+
+	header_->num_temps = num_temps;
+	header_->num_fans = num_fans;
+	header_->record_size = rec_size;
+	header_->capacity = capacity;
+	header_->written = 0;
+	std::memcpy(header_->magic, TRACE_MAGIC, sizeof(TRACE_MAGIC));
+	::msync(map_, sizeof(TraceHeader), MS_ASYNC);
+}
+
+
+void TraceRecorder::record(const TemperatureState &ts, const Config &config)
+{
+	char *rec = TraceFile::record(header_->written);
+
+	// A vDSO call, so this doesn't enter the kernel.
+	struct timespec now;
+	::clock_gettime(CLOCK_REALTIME, &now);
+	int64_t time_ns = int64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+	std::memcpy(rec, &time_ns, sizeof(time_ns));
+	rec += sizeof(time_ns);
+
+	const size_t temps_size = header_->num_temps * sizeof(int32_t);
+	std::memcpy(rec, ts.get().data(), temps_size);
+	rec += temps_size;
+	std::memcpy(rec, ts.biased().data(), temps_size);
+	rec += temps_size;
+
+	for (const FanConfig *fan_cfg : config.fans()) {
+		int32_t lvl = fan_cfg->cur_lvl_idx();
+		std::memcpy(rec, &lvl, sizeof(lvl));
+		rec += sizeof(lvl);
+	}
+
+	++header_->written;
+
+	if (unlikely(++unsynced_ >= TRACE_SYNC_RECORDS)) {
+		::msync(map_, map_size_, MS_ASYNC);
+		unsynced_ = 0;
+	}
+}
+
+
+TraceReader::TraceReader(const string &path)
+: TraceFile(path)
+{
+	fd_ = ::open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd_ < 0)
+		throw IOerror(MSG_TRACE_OPEN(path_), errno);
+
+	TraceHeader hdr;
+	if (!read_header(fd_, hdr, path_))
+		throw SystemError(MSG_TRACE_FORMAT(path_));
+	map(sizeof(hdr) + size_t(hdr.capacity) * hdr.record_size, false);
+
+	first_ = header_->written > header_->capacity ? header_->written - header_->capacity : 0;
+}
+
+
+uint64_t TraceReader::size() const
+{ return header_->written - first_; }
+
+
+int64_t TraceReader::time_ns(uint64_t i) const
+{
+	int64_t rv;
+	std::memcpy(&rv, record(first_ + i), sizeof(rv));
+	return rv;
+}
+
+
+const int32_t *TraceReader::temps(uint64_t i) const
+{ return reinterpret_cast<const int32_t *>(record(first_ + i) + sizeof(int64_t)); }
+
+
+const int32_t *TraceReader::levels(uint64_t i) const
+{ return temps(i) + 2 * num_temps(); }
+
+
+/*----------------------------------------------------------------------------
+| replay: Run the recorded temperatures through TemperatureState and the     |
+| level tables of the given config, as fast as possible and without ever     |
+| touching a fan. Each record is treated like a main cycle. Configs that the |
+| level tables alone don't describe are refused: A trace has no loads to     |
+| feed forward, and continuous control ramps by the wall clock.              |
+----------------------------------------------------------------------------*/
+
+void replay(const string &trace_path, const Config &config)
+{
+	typedef std::chrono::steady_clock clock;
+
+	if (!config.load_specs().empty())
+		throw ConfigError(MSG_REPLAY_LOADS);
+	for (const FanSpec &spec : config.fan_specs())
+		if (spec.continuous)
+			throw ConfigError(MSG_REPLAY_CONTINUOUS(spec.path));
+
+	TraceReader trace(trace_path);
+	if (trace.num_temps() != config.num_temps())
+		throw ConfigError(MSG_REPLAY_TEMPS(trace_path, trace.num_temps(), config.num_temps()));
+
+	const uint64_t num_records = trace.size();
+	if (num_records == 0) {
+		log(TF_INF) << MSG_REPLAY_EMPTY(trace_path) << flush;
+		return;
+	}
+
+	const std::vector<FanConfig *> &fans = config.fans();
+	std::vector<unsigned int> cur_lvl(fans.size(), 0);
+	std::vector<uint64_t> changes(fans.size(), 0);
+	std::vector<std::vector<int64_t>> level_time(fans.size());
+	for (size_t f = 0; f < fans.size(); ++f)
+		level_time[f].resize(fans[f]->levels().size(), 0);
+	uint64_t recorded_changes = 0;
+	int64_t total_time = 0;
+
+	temp_state = TemperatureState(config);
+	std::vector<int> samples(trace.num_temps());
+	const std::vector<unsigned char> fresh(trace.num_temps(), 1);
+	tmp_sleeptime = sleeptime;
+
+	clock::time_point start = clock::now();
+
+	for (uint64_t i = 0; i < num_records; ++i) {
+		temp_state.restart();
+		const int32_t *temps = trace.temps(i);
+		std::copy(temps, temps + trace.num_temps(), samples.begin());
+		temp_state.update(samples, fresh, trace.time_ns(i) / 1e9);
+
+		if (i == 0)
+			temp_state.first_run();
+		else
+			temp_state.adapt_sleeptime(true);
+
+		for (size_t f = 0; f < fans.size(); ++f) {
+			unsigned int lvl = fans[f]->table().lookup(cur_lvl[f]);
+			if (i > 0 && lvl != cur_lvl[f])
+				++changes[f];
+			cur_lvl[f] = lvl;
+		}
+
+		if (i > 0) {
+			const int32_t *prev = trace.levels(i - 1), *cur = trace.levels(i);
+			for (unsigned int f = 0; f < trace.num_fans(); ++f)
+				recorded_changes += prev[f] != cur[f];
+		}
+
+		if (i + 1 < num_records) {
+			int64_t dt = std::max<int64_t>(0, std::min(trace.time_ns(i + 1) - trace.time_ns(i), TRACE_MAX_GAP_NS));
+			for (size_t f = 0; f < fans.size(); ++f)
+				level_time[f][cur_lvl[f]] += dt;
+			total_time += dt;
+		}
+	}
+
+	double elapsed = std::chrono::duration_cast<secondsf>(clock::now() - start).count();
+
+	char buf[128];
+	snprintf(buf, sizeof(buf), "%llu records covering %.1f hours in %.3f seconds.",
+			static_cast<unsigned long long>(num_records), total_time / 3600e9, elapsed);
+	log(TF_INF) << "Replayed " << trace_path << ": " << string(buf) << flush;
+	log(TF_INF) << MSG_REPLAY_RECORDED(recorded_changes) << flush;
+
+	for (size_t f = 0; f < fans.size(); ++f) {
+		Logger &l = log(TF_INF) << config.fan_specs()[f].path << ": " << std::to_string(changes[f])
+				<< " level change(s). Time spent in each level:";
+		for (size_t lvl = 0; lvl < level_time[f].size(); ++lvl) {
+			snprintf(buf, sizeof(buf), "%5.1f%%", total_time > 0 ? 100.0 * level_time[f][lvl] / total_time : 0);
+			l << "\n  " << fans[f]->levels()[lvl]->str() << ": " << string(buf);
+		}
+		l << flush;
+	}
+}
+
+
+}
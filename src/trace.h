@@ -0,0 +1,116 @@
+/********************************************************************
+ * trace.h: Recording of temperatures & fan levels, and offline replay.
+ * (C) 2015, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#ifndef THINKFAN_TRACE_H_
+#define THINKFAN_TRACE_H_
+
+#include <cstdint>
+#include <cstddef>
+
+#include "thinkfan.h"
+
+namespace thinkfan {
+
+class Config;
+
+
+/* On-disk layout of a trace file: This header, followed by a ring of
+ * `capacity' fixed-size records. Each record is
+ *   int64_t time_ns              (CLOCK_REALTIME)
+ *   int32_t temps[num_temps]     (as read, with correction values applied)
+ *   int32_t biased[num_temps]
+ *   int32_t levels[num_fans]     (index into each fan's level list)
+ * padded to a multiple of 8 bytes. All values are in host byte order. */
+struct TraceHeader {
+	char magic[8];
+	uint32_t num_temps;
+	uint32_t num_fans;
+	uint32_t record_size;
+	uint32_t capacity;
+	uint64_t written;	// Total number of records, the next one goes to written % capacity
+};
+
+
+class TraceFile {
+public:
+	TraceFile(const TraceFile &) = delete;
+	~TraceFile();
+
+	unsigned int num_temps() const { return header_->num_temps; }
+	unsigned int num_fans() const { return header_->num_fans; }
+
+	TraceFile &operator = (const TraceFile &) = delete;
+
+protected:
+	TraceFile(const string &path);
+	void map(size_t size, bool writable);
+	void unmap();
+	char *record(uint64_t n) const;
+
+	static size_t record_size(unsigned int num_temps, unsigned int num_fans);
+	static bool read_header(int fd, TraceHeader &hdr, const string &path);
+
+	const string path_;
+	int fd_;
+	char *map_;
+	size_t map_size_;
+	TraceHeader *header_;
+};
+
+
+/* Appends one record per control cycle to a memory-mapped trace file. The
+ * file has a fixed size, so old records are overwritten once it is full.
+ * Recording is just a few stores into the mapping, the kernel is only asked
+ * to write back dirty pages every now and then. */
+class TraceRecorder : public TraceFile {
+public:
+	TraceRecorder(const string &path);
+	~TraceRecorder();
+
+	void attach(const Config &config);
+	void record(const TemperatureState &ts, const Config &config);
+
+private:
+	void create(unsigned int num_temps, unsigned int num_fans);
+	unsigned int unsynced_;
+};
+
+
+class TraceReader : public TraceFile {
+public:
+	TraceReader(const string &path);
+
+	uint64_t size() const;
+	int64_t time_ns(uint64_t i) const;
+	const int32_t *temps(uint64_t i) const;
+	const int32_t *levels(uint64_t i) const;
+
+private:
+	uint64_t first_;
+};
+
+
+void replay(const string &trace_path, const Config &config);
+
+
+}
+
+#endif /* THINKFAN_TRACE_H_ */
@@ -0,0 +1,525 @@
+/********************************************************************
+ * udp.cpp: Temperature feeds from other thinkfan instances over UDP.
+ * (C) 2015, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#include "error.h"
+#include "udp.h"
+#include "config.h"
+#include "message.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <random>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace thinkfan {
+
+static const char UDP_MAGIC[4] = { 'T', 'F', 't', '1' };
+
+
+/* Splits HOST:PORT or [HOST]:PORT. The brackets are required for an IPv6
+ * address, since it contains colons itself. */
+static void split_address(const string &address, string &host, string &port)
+{
+	string::size_type colon;
+	if (address.length() && address[0] == '[') {
+		string::size_type end = address.find(']');
+		if (end == string::npos || end + 1 >= address.length() || address[end + 1] != ':')
+			throw ConfigError(MSG_UDP_ADDR(address));
+		host = address.substr(1, end - 1);
+		colon = end + 1;
+	}
+	else if ((colon = address.rfind(':')) != string::npos) {
+		host = address.substr(0, colon);
+		if (host.find(':') != string::npos)
+			throw ConfigError(MSG_UDP_ADDR(address));
+	}
+	else
+		throw ConfigError(MSG_UDP_ADDR(address));
+
+	port = address.substr(colon + 1);
+	if (host.empty() || port.empty() || port.length() > 5
+			|| port.find_first_not_of("0123456789") != string::npos)
+		throw ConfigError(MSG_UDP_ADDR(address));
+}
+
+
+/* IPv4 addresses are compared as v4-mapped IPv6 addresses, since that's what
+ * a dual-stack socket receives them as. */
+static bool to_in6(const struct sockaddr *sa, struct in6_addr &addr)
+{
+	if (sa->sa_family == AF_INET6)
+		addr = reinterpret_cast<const struct sockaddr_in6 *>(sa)->sin6_addr;
+	else if (sa->sa_family == AF_INET) {
+		std::memset(&addr, 0, sizeof(addr));
+		addr.s6_addr[10] = addr.s6_addr[11] = 0xff;
+		std::memcpy(&addr.s6_addr[12], &reinterpret_cast<const struct sockaddr_in *>(sa)->sin_addr, 4);
+	}
+	else
+		return false;
+	return true;
+}
+
+
+static bool is_wildcard(const struct in6_addr &addr)
+{
+	static const unsigned char v4_any[16] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff, 0, 0, 0, 0 };
+	return IN6_IS_ADDR_UNSPECIFIED(&addr) || std::memcmp(addr.s6_addr, v4_any, sizeof(v4_any)) == 0;
+}
+
+
+/* A non-blocking datagram socket that is either bound to a local address
+ * (passive) or connected to a remote one. A passive socket prefers IPv6,
+ * which also receives IPv4 unless the system is configured otherwise.
+ * Returns -1 with errno set if no address works. */
+static int open_socket(const string &host, const string &port, bool passive)
+{
+	struct addrinfo hints;
+	std::memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_NUMERICSERV | (passive ? AI_PASSIVE : 0);
+
+	struct addrinfo *res;
+	int err = ::getaddrinfo(host.length() ? host.c_str() : nullptr, port.c_str(), &hints, &res);
+	if (err)
+		throw SystemError(MSG_UDP_RESOLVE(host, string(::gai_strerror(err))));
+
+	int fd = -1, saved_errno = EADDRNOTAVAIL;
+	for (int pass = 0; pass < 2 && fd < 0; ++pass) {
+		for (struct addrinfo *ai = res; ai && fd < 0; ai = ai->ai_next) {
+			if (passive && (ai->ai_family == AF_INET6) != (pass == 0))
+				continue;
+			else if (!passive && pass > 0)
+				break;
+
+			fd = ::socket(ai->ai_family, ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, ai->ai_protocol);
+			if (fd < 0) {
+				saved_errno = errno;
+				continue;
+			}
+			if (passive && ai->ai_family == AF_INET6) {
+				int off = 0;
+				::setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+			}
+			if ((passive ? ::bind(fd, ai->ai_addr, ai->ai_addrlen)
+					: ::connect(fd, ai->ai_addr, ai->ai_addrlen)) < 0) {
+				saved_errno = errno;
+				::close(fd);
+				fd = -1;
+			}
+		}
+	}
+	::freeaddrinfo(res);
+
+	if (fd < 0)
+		errno = saved_errno;
+	return fd;
+}
+
+
+/*----------------------------------------------------------------------------
+| UdpListener: Receiving happens only in the control thread, right before    |
+| the sensors are read, so a datagram that arrives mid-cycle simply waits in |
+| the socket buffer. Datagrams from unknown nodes are dropped silently, they |
+| may well be meant for another aggregator listening on the same port. So is |
+| a datagram for a known node that doesn't come from one of its addresses.   |
+----------------------------------------------------------------------------*/
+
+std::map<string, std::weak_ptr<UdpListener>> UdpListener::instances_;
+
+
+std::shared_ptr<UdpListener> UdpListener::get(const string &address)
+{
+	std::shared_ptr<UdpListener> rv = instances_[address].lock();
+	if (!rv) {
+		rv.reset(new UdpListener(address));
+		instances_[address] = rv;
+	}
+	return rv;
+}
+
+
+UdpListener::UdpListener(const string &address)
+: address_(address)
+{
+	string host, port;
+	split_address(address, host, port);
+	if ((fd_ = open_socket(host, port, true)) < 0)
+		throw IOerror(MSG_UDP_BIND(address), errno);
+
+	// Listening on all interfaces would let anyone who can reach the port
+	// feed us temperatures.
+	struct sockaddr_storage local;
+	socklen_t local_len = sizeof(local);
+	struct in6_addr addr;
+	if (::getsockname(fd_, reinterpret_cast<struct sockaddr *>(&local), &local_len)
+			|| !to_in6(reinterpret_cast<struct sockaddr *>(&local), addr) || is_wildcard(addr)) {
+		::close(fd_);
+		throw ConfigError(MSG_UDP_WILDCARD(address));
+	}
+}
+
+
+UdpListener::~UdpListener()
+{
+	::close(fd_);
+	instances_.erase(address_);
+}
+
+
+void UdpListener::add(UdpSensorDriver *peer)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	peers_.push_back(peer);
+}
+
+
+void UdpListener::remove(UdpSensorDriver *peer)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	peers_.erase(std::remove(peers_.begin(), peers_.end(), peer), peers_.end());
+}
+
+
+void UdpListener::receive()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	struct sockaddr_storage src;
+	socklen_t src_len = sizeof(src);
+	struct in6_addr from;
+	ssize_t len;
+	while ((len = ::recvfrom(fd_, buf_, sizeof(buf_), 0, reinterpret_cast<struct sockaddr *>(&src), &src_len)) >= 0) {
+		if (to_in6(reinterpret_cast<struct sockaddr *>(&src), from))
+			handle(static_cast<size_t>(len), from);
+		src_len = sizeof(src);
+	}
+}
+
+
+void UdpListener::handle(size_t len, const struct in6_addr &from)
+{
+	UdpHeader hdr;
+	if (len < sizeof(hdr))
+		return;
+	std::memcpy(&hdr, buf_, sizeof(hdr));
+	if (std::memcmp(hdr.magic, UDP_MAGIC, sizeof(UDP_MAGIC))
+			|| len != sizeof(hdr) + hdr.node_len + hdr.count * sizeof(int16_t))
+		return;
+
+	const unsigned char *node = buf_ + sizeof(hdr);
+	// After a config reload, the old and the new sensor may both be registered
+	for (UdpSensorDriver *peer : peers_)
+		if (peer->node().length() == hdr.node_len
+				&& std::memcmp(peer->node().data(), node, hdr.node_len) == 0
+				&& peer->accepts(from))
+			peer->deliver(ntohl(hdr.instance), ntohl(hdr.seq), node + hdr.node_len, hdr.count);
+}
+
+
+bool UdpListener::complete() const
+{
+	for (const UdpSensorDriver *peer : peers_)
+		if (!peer->reported())
+			return false;
+	return true;
+}
+
+
+void UdpListener::receive_all()
+{
+	const UdpSensorDriver::clock::time_point now = UdpSensorDriver::clock::now();
+	for (const std::pair<const string, std::weak_ptr<UdpListener>> &entry : instances_) {
+		std::shared_ptr<UdpListener> listener = entry.second.lock();
+		if (!listener)
+			continue;
+		listener->receive();
+
+		std::lock_guard<std::mutex> lock(listener->mutex_);
+		for (UdpSensorDriver *peer : listener->peers_)
+			peer->check(now);
+	}
+}
+
+
+/* Right after startup, give every peer one staleness timeout to report in.
+ * Otherwise the first cycles would run the fans at full speed just because
+ * the peers haven't sent anything yet. */
+void UdpListener::await_all()
+{
+	typedef UdpSensorDriver::clock clock;
+
+	std::vector<std::shared_ptr<UdpListener>> listeners;
+	std::vector<struct pollfd> fds;
+	clock::time_point deadline = clock::now();
+	unsigned int num_peers = 0;
+	for (const std::pair<const string, std::weak_ptr<UdpListener>> &entry : instances_) {
+		std::shared_ptr<UdpListener> listener = entry.second.lock();
+		if (!listener)
+			continue;
+		std::lock_guard<std::mutex> lock(listener->mutex_);
+		for (const UdpSensorDriver *peer : listener->peers_) {
+			deadline = std::max(deadline, clock::now()
+					+ std::chrono::duration_cast<clock::duration>(peer->stale()));
+			++num_peers;
+		}
+		listeners.push_back(listener);
+		fds.push_back({ listener->fd_, POLLIN, 0 });
+	}
+	if (!num_peers)
+		return;
+
+	log(TF_INF) << MSG_UDP_AWAIT(num_peers) << flush;
+	while (true) {
+		bool complete = true;
+		for (const std::shared_ptr<UdpListener> &listener : listeners) {
+			listener->receive();
+			std::lock_guard<std::mutex> lock(listener->mutex_);
+			complete = complete && listener->complete();
+		}
+
+		const clock::time_point now = clock::now();
+		if (complete || now >= deadline)
+			break;
+
+		int timeout_ms = static_cast<int>(std::ceil(
+				std::chrono::duration<double, std::milli>(deadline - now).count()));
+		if (::poll(fds.data(), fds.size(), timeout_ms) < 0 && errno != EINTR)
+			break;
+	}
+
+	// Anyone who's still missing gets reported as stale right away
+	receive_all();
+}
+
+
+/*----------------------------------------------------------------------------
+| UdpSensorDriver: A peer that hasn't been heard from within the staleness   |
+| timeout is assumed to be at UDP_STALE_TEMP, without correction. That's a   |
+| fail-safe: All fans go up rather than run slow on temperatures that may be |
+| long out of date.                                                          |
+----------------------------------------------------------------------------*/
+
+UdpSensorDriver::UdpSensorDriver(const string &path, unsigned int num_temps, secondsf stale, const string &from)
+: SensorDriver(path),
+  stale_(stale),
+  from_(from),
+  instance_(0),
+  seq_(0),
+  reported_(false),
+  logged_stale_(false),
+  logged_count_(false)
+{
+	string::size_type at = path.find('@');
+	if (at == 0 || at == string::npos || at > 255 || at + 1 >= path.length())
+		throw ConfigError(MSG_UDP_PATH(path));
+	node_ = path.substr(0, at);
+
+	if (from.empty())
+		throw ConfigError(MSG_UDP_FROM(path));
+	string::size_type start = 0, comma;
+	do {
+		comma = from.find(',', start);
+		resolve(from.substr(start, comma == string::npos ? string::npos : comma - start));
+		start = comma + 1;
+	} while (comma != string::npos);
+
+	set_num_temps(num_temps);
+	received_.resize(num_temps, UDP_STALE_TEMP);
+
+	listener_ = UdpListener::get(path.substr(at + 1));
+	listener_->add(this);
+}
+
+
+UdpSensorDriver::~UdpSensorDriver()
+{ listener_->remove(this); }
+
+
+void UdpSensorDriver::resolve(const string &host)
+{
+	struct addrinfo hints;
+	std::memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+
+	struct addrinfo *res;
+	int err = host.empty() ? EAI_NONAME : ::getaddrinfo(host.c_str(), nullptr, &hints, &res);
+	if (err)
+		throw SystemError(MSG_UDP_RESOLVE(host, string(::gai_strerror(err))));
+
+	struct in6_addr addr;
+	for (struct addrinfo *ai = res; ai; ai = ai->ai_next)
+		if (to_in6(ai->ai_addr, addr))
+			allowed_.push_back(addr);
+	::freeaddrinfo(res);
+}
+
+
+bool UdpSensorDriver::accepts(const struct in6_addr &from) const
+{
+	for (const struct in6_addr &addr : allowed_)
+		if (IN6_ARE_ADDR_EQUAL(&addr, &from))
+			return true;
+	return false;
+}
+
+
+bool UdpSensorDriver::is_stale(clock::time_point now) const
+{ return !reported_ || now - last_ > stale_; }
+
+
+void UdpSensorDriver::read_temps() const
+{
+	std::lock_guard<std::mutex> lock(listener_->mutex_);
+	if (unlikely(is_stale(clock::now())))
+		std::fill(temps_.begin(), temps_.end(), UDP_STALE_TEMP);
+	else
+		for (unsigned int i = 0; i < num_temps(); ++i)
+			temps_[i] = received_[i] + correction_[i];
+}
+
+
+void UdpSensorDriver::deliver(uint32_t instance, uint32_t seq, const unsigned char *temps, unsigned int count)
+{
+	if (unlikely(count != num_temps())) {
+		if (!logged_count_)
+			log(TF_WRN) << MSG_UDP_COUNT(path_, count, num_temps()) << flush;
+		logged_count_ = true;
+		return;
+	}
+	logged_count_ = false;
+
+	// Drop duplicates and datagrams that were overtaken by a newer one
+	if (reported_ && instance == instance_ && static_cast<int32_t>(seq - seq_) <= 0)
+		return;
+
+	for (unsigned int i = 0; i < count; ++i) {
+		uint16_t raw;
+		std::memcpy(&raw, temps + i * sizeof(raw), sizeof(raw));
+		received_[i] = static_cast<int16_t>(ntohs(raw));
+	}
+	instance_ = instance;
+	seq_ = seq;
+	last_ = clock::now();
+	reported_ = true;
+}
+
+
+void UdpSensorDriver::check(clock::time_point now)
+{
+	bool stale = is_stale(now);
+	if (unlikely(stale != logged_stale_)) {
+		if (stale)
+			log(TF_WRN) << MSG_UDP_STALE(path_, stale_.count(), UDP_STALE_TEMP) << flush;
+		else
+			log(TF_INF) << MSG_UDP_RECOVERED(path_) << flush;
+		logged_stale_ = stale;
+	}
+}
+
+
+/*----------------------------------------------------------------------------
+| UdpExporter: The datagram is laid out once by attach(), so a send only has |
+| to fill in the sequence number and the temperatures. A failing send is     |
+| logged once, the aggregator will notice the silence on its own anyway.     |
+----------------------------------------------------------------------------*/
+
+UdpExporter::UdpExporter(const string &destination, const string &node)
+: destination_(destination),
+  node_(node),
+  seq_(0),
+  failing_(false)
+{
+	if (node_.empty() || node_.length() > 255 || node_.find('@') != string::npos)
+		throw ConfigError(MSG_EXPORT_NODE(node_));
+
+	string host, port;
+	split_address(destination, host, port);
+	if ((fd_ = open_socket(host, port, false)) < 0)
+		throw IOerror(MSG_EXPORT_CONNECT(destination), errno);
+
+	std::random_device rng;
+	instance_ = rng();
+}
+
+
+UdpExporter::~UdpExporter()
+{ ::close(fd_); }
+
+
+void UdpExporter::attach(const Config &config)
+{
+	if (config.num_temps() > 255)
+		throw ConfigError(MSG_EXPORT_TEMPS(config.num_temps()));
+
+	UdpHeader hdr;
+	std::memcpy(hdr.magic, UDP_MAGIC, sizeof(hdr.magic));
+	hdr.instance = htonl(instance_);
+	hdr.seq = 0;
+	hdr.node_len = static_cast<uint8_t>(node_.length());
+	hdr.count = static_cast<uint8_t>(config.num_temps());
+
+	buf_.resize(sizeof(hdr) + node_.length() + config.num_temps() * sizeof(int16_t));
+	std::memcpy(buf_.data(), &hdr, sizeof(hdr));
+	std::memcpy(buf_.data() + sizeof(hdr), node_.data(), node_.length());
+}
+
+
+void UdpExporter::send(const TemperatureState &ts)
+{
+	const size_t offset = sizeof(UdpHeader) + node_.length();
+	const size_t n = std::min(ts.get().size(), (buf_.size() - offset) / sizeof(int16_t));
+
+	uint32_t seq = htonl(++seq_);
+	std::memcpy(buf_.data() + offsetof(UdpHeader, seq), &seq, sizeof(seq));
+	for (size_t i = 0; i < n; ++i) {
+		int t = std::max(-32768, std::min(32767, ts.get()[i]));
+		uint16_t raw = htons(static_cast<uint16_t>(static_cast<int16_t>(t)));
+		std::memcpy(buf_.data() + offset + i * sizeof(raw), &raw, sizeof(raw));
+	}
+
+	// ECONNREFUSED only reports an ICMP error for an earlier datagram. The
+	// aggregator may just not be running, and it doesn't keep this one from
+	// going out.
+	if (unlikely(::send(fd_, buf_.data(), buf_.size(), MSG_DONTWAIT | MSG_NOSIGNAL) < 0
+			&& errno != ECONNREFUSED)) {
+		if (!failing_) {
+			const char *msg = std::strerror(errno);
+			log(TF_WRN) << MSG_EXPORT_SEND(destination_) << msg << flush;
+		}
+		failing_ = true;
+	}
+	else if (unlikely(failing_)) {
+		log(TF_INF) << MSG_EXPORT_RECOVERED(destination_) << flush;
+		failing_ = false;
+	}
+}
+
+
+}
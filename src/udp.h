@@ -0,0 +1,170 @@
+/********************************************************************
+ * udp.h: Temperature feeds from other thinkfan instances over UDP.
+ * (C) 2015, Victor Mataré
+ *
+ * this file is part of thinkfan. See thinkfan.c for further information.
+ *
+ * thinkfan is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * thinkfan is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with thinkfan.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * ******************************************************************/
+
+#ifndef THINKFAN_UDP_H_
+#define THINKFAN_UDP_H_
+
+#include <chrono>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include <netinet/in.h>
+
+#include "thinkfan.h"
+#include "drivers.h"
+
+namespace thinkfan {
+
+class Config;
+
+
+/* Layout of a datagram: This header, followed by the node name (not
+ * terminated) and `count' temperatures as int16_t in °C. All integers are
+ * in network byte order. The instance is picked at random when an exporter
+ * starts, so that a restarted peer isn't mistaken for a replay of old
+ * datagrams. */
+struct UdpHeader {
+	char magic[4];
+	uint32_t instance;
+	uint32_t seq;
+	uint8_t node_len;
+	uint8_t count;
+} __attribute__((packed));
+
+constexpr size_t UDP_MAX_DATAGRAM = sizeof(UdpHeader) + 255 + 255 * sizeof(int16_t);
+
+// What a peer is assumed to be at when it hasn't reported in time
+constexpr int UDP_STALE_TEMP = 127;
+
+
+class UdpSensorDriver;
+
+
+/* One non-blocking UDP socket, bound to a local address (never to all of
+ * them). All udp sensors
+ * that listen on the same address share it, and so does the new config
+ * after a reload, which keeps the port bound. Datagrams are only picked up
+ * by receive_all() in the control thread. The mutex protects what has been
+ * received from concurrent reads by the poller threads. */
+class UdpListener {
+public:
+	static std::shared_ptr<UdpListener> get(const string &address);
+	UdpListener(const UdpListener &) = delete;
+	~UdpListener();
+
+	static void receive_all();
+	static void await_all();
+
+	void add(UdpSensorDriver *peer);
+	void remove(UdpSensorDriver *peer);
+
+	UdpListener &operator = (const UdpListener &) = delete;
+
+private:
+	friend class UdpSensorDriver;
+
+	UdpListener(const string &address);
+	void receive();
+	void handle(size_t len, const struct in6_addr &from);
+	bool complete() const;
+
+	const string address_;
+	int fd_;
+	std::mutex mutex_;
+	std::vector<UdpSensorDriver *> peers_;
+	unsigned char buf_[UDP_MAX_DATAGRAM + 1];
+
+	static std::map<string, std::weak_ptr<UdpListener>> instances_;
+};
+
+
+/* The temperatures of one peer, identified by its node name and accepted
+ * only from the addresses in `from' (a comma-separated list of hosts). The
+ * path is NODE@HOST:PORT or NODE@[HOST]:PORT, where HOST is the local address
+ * to listen on. */
+class UdpSensorDriver final : public SensorDriver {
+public:
+	typedef std::chrono::steady_clock clock;
+
+	UdpSensorDriver(const string &path, unsigned int num_temps, secondsf stale, const string &from);
+	~UdpSensorDriver();
+	virtual void read_temps() const override;
+
+	const string &node() const { return node_; }
+	secondsf stale() const { return stale_; }
+	const string &from() const { return from_; }
+
+	// Only called by the UdpListener, with its mutex held
+	bool accepts(const struct in6_addr &from) const;
+	void deliver(uint32_t instance, uint32_t seq, const unsigned char *temps, unsigned int count);
+	bool reported() const { return reported_; }
+	bool is_stale(clock::time_point now) const;
+	void check(clock::time_point now);
+
+private:
+	void resolve(const string &host);
+
+	string node_;
+	secondsf stale_;
+	string from_;
+	std::vector<struct in6_addr> allowed_;
+	std::shared_ptr<UdpListener> listener_;
+	std::vector<int> received_;
+	clock::time_point last_;
+	uint32_t instance_;
+	uint32_t seq_;
+	bool reported_;
+	bool logged_stale_;
+	bool logged_count_;
+};
+
+
+/* Sends all temperatures to an aggregating thinkfan once per control cycle.
+ * The socket is connected, so the destination is only resolved once, and a
+ * send never blocks. */
+class UdpExporter {
+public:
+	UdpExporter(const string &destination, const string &node);
+	UdpExporter(const UdpExporter &) = delete;
+	~UdpExporter();
+
+	void attach(const Config &config);
+	void send(const TemperatureState &ts);
+
+	UdpExporter &operator = (const UdpExporter &) = delete;
+
+private:
+	const string destination_;
+	const string node_;
+	int fd_;
+	uint32_t instance_;
+	uint32_t seq_;
+	bool failing_;
+	std::vector<unsigned char> buf_;
+};
+
+
+}
+
+#endif /* THINKFAN_UDP_H_ */